@@ -111,6 +111,7 @@ void bson_reset(bson *b) {
     b->err = 0;
     b->errstr = NULL;
     b->flags = 0;
+    b->arena = NULL;
 }
 
 static bson_bool_t bson_isnumstr(const char *str, int len);
@@ -449,7 +450,9 @@ static bson_type bson_find_fieldpath_value_impl(char* pstack, int curr, FFPCTX *
     const char *fpath = ffpctx->fpath;
     while ((t = bson_iterator_next(it)) != BSON_EOO) {
         const char* key = BSON_ITERATOR_KEY(it);
-        klen = strlen(key);
+        /* Keys longer than what is left of the path can not match, no
+         * need to find their end */
+        klen = strnlen(key, fplen - curr + 1);
         if (curr + klen > fplen) {
             continue;
         }
@@ -610,7 +613,7 @@ bson_type bson_iterator_next(bson_iterator *i) {
         }
     }
     if (klen == 0) {
-        for (; *(i->cur + 1 + klen) != '\0'; ++klen);
+        klen = strlen(i->cur + 1);
     }
     i->cur += (1 + klen + 1 + ds);
     return (bson_type) (*i->cur);
@@ -915,6 +918,8 @@ void bson_append64(bson *b, const void *data) {
     b->cur += 8;
 }
 
+static int _bson_arena_realloc(bson *b, int new_size);
+
 int bson_ensure_space(bson *b, const int bytesNeeded) {
     int pos = b->cur - b->data;
     char *orig = b->data;
@@ -934,7 +939,11 @@ int bson_ensure_space(bson *b, const int bytesNeeded) {
         }
     }
 
-    if (b->flags & BSON_FLAG_STACK_ALLOCATED) { //translate stack memory into heap
+    if (b->flags & BSON_FLAG_ARENA) {
+        if (_bson_arena_realloc(b, new_size) == BSON_ERROR) {
+            return BSON_ERROR;
+        }
+    } else if (b->flags & BSON_FLAG_STACK_ALLOCATED) { //translate stack memory into heap
         char *odata = b->data;
         b->data = bson_malloc_func(new_size);
         if (!b->data) {
@@ -989,7 +998,11 @@ static int bson_ensure_buffer_size(bson *b, const int bytesNeeded) {
         }
     }
 
-    if (b->flags & BSON_FLAG_STACK_ALLOCATED) { //translate stack memory into heap
+    if (b->flags & BSON_FLAG_ARENA) {
+        if (_bson_arena_realloc(b, new_size) == BSON_ERROR) {
+            return BSON_ERROR;
+        }
+    } else if (b->flags & BSON_FLAG_STACK_ALLOCATED) { //translate stack memory into heap
         char *odata = b->data;
         b->data = bson_malloc_func(new_size);
         if (!b->data) {
@@ -1033,10 +1046,20 @@ int bson_finish(bson *b) {
 
 void bson_destroy(bson *b) {
     if (b) {
-        if (b->data 
+        if (b->data && (b->flags & BSON_FLAG_ARENA)) {
+            /* Release the data if it is the most recent allocation */
+            bson_arena *a = b->arena;
+            if (b->data + b->dataSize == a->data + a->used) {
+                a->used = b->data - a->data;
+            }
+        } else if (b->data 
             && !(b->flags & BSON_FLAG_STACK_ALLOCATED) 
             && !(b->flags & BSON_FLAG_EXTERNAL_BUFFER)) 
         {
+            if (b->arena && b->arena->used + b->dataSize > b->arena->peak) {
+                /* Data did not fit in the arena, have it grow on reset */
+                b->arena->peak = b->arena->used + b->dataSize;
+            }
             bson_free(b->data);
         }
         b->err = 0;
@@ -3468,18 +3491,23 @@ static int bson_copy_with_state(bson* out, const bson* in) {
 
     // copy bson data
     memcpy(out->data, in->data, bson_size(in));
-    bson_init_finished_data(out, out->data);
     
-    // save the original buffer
+    // save the original buffer and who owns it
     char* data = out->data;
     int dataSize = out->dataSize;
+    int owner = out->flags & (BSON_FLAG_STACK_ALLOCATED | BSON_FLAG_EXTERNAL_BUFFER | BSON_FLAG_ARENA);
+    bson_arena* arena = out->arena;
     
     // copy state
     memcpy(out, in, sizeof(bson));
     
-    // restore buffer and buffer size
+    // restore buffer, buffer size and ownership, so bson_destroy releases
+    // the data the way it was allocated
     out->data = data;
     out->dataSize = dataSize;
+    out->cur = data + (in->cur - in->data);
+    out->flags = (in->flags & ~(BSON_FLAG_STACK_ALLOCATED | BSON_FLAG_EXTERNAL_BUFFER | BSON_FLAG_ARENA)) | owner;
+    out->arena = arena;
     
     return BSON_OK;
 }
@@ -3699,3 +3727,402 @@ void bson_update(bson* orig, bson* update) {
     
     bson_destroy(&tmp);
 }
+
+typedef struct {
+    const bson_extract_field *fields;
+    int nfields;
+    bson_iterator *out;
+    bool found[BSON_EXTRACT_MAX_FIELDS];
+    int pending;
+} _BSONEXTRACTCTX;
+
+/* offs[f] is the position in fields[f].fpath matched so far, or -1 if
+ * the field is not below the object being walked */
+static void _bson_extract_impl(_BSONEXTRACTCTX *ctx, const char *data, const int *offs) {
+    bson_iterator it;
+    bson_type bt;
+    int suboffs[BSON_EXTRACT_MAX_FIELDS];
+    
+    BSON_ITERATOR_FROM_BUFFER(&it, data);
+    while ((bt = bson_iterator_next(&it)) != BSON_EOO) {
+        const char *key = BSON_ITERATOR_KEY(&it);
+        int klen = strlen(key);
+        bool descend = false;
+        int f;
+        
+        for (f = 0; f < ctx->nfields; ++f) {
+            suboffs[f] = -1;
+            if (offs[f] < 0 || ctx->found[f]) {
+                continue;
+            }
+            const char *p = ctx->fields[f].fpath + offs[f];
+            if (strncmp(p, key, klen) != 0) {
+                continue;
+            }
+            if (p[klen] == '\0') {
+                ctx->out[f] = it;
+                ctx->found[f] = true;
+                ctx->pending--;
+            } else if (p[klen] == '.' && (bt == BSON_OBJECT || bt == BSON_ARRAY)) {
+                suboffs[f] = offs[f] + klen + 1;
+                descend = true;
+            }
+        }
+        
+        if (descend) {
+            _bson_extract_impl(ctx, bson_iterator_value(&it), suboffs);
+        }
+        if (ctx->pending == 0) {
+            return;
+        }
+    }
+}
+
+int bson_extract(const void *bsdata, const bson_extract_field *fields, int nfields, bson_iterator *out) {
+    _BSONEXTRACTCTX ctx;
+    int offs[BSON_EXTRACT_MAX_FIELDS];
+    int f;
+    
+    if (nfields > BSON_EXTRACT_MAX_FIELDS) {
+        nfields = BSON_EXTRACT_MAX_FIELDS;
+    }
+    
+    ctx.fields = fields;
+    ctx.nfields = nfields;
+    ctx.out = out;
+    ctx.pending = nfields;
+    for (f = 0; f < nfields; ++f) {
+        ctx.found[f] = false;
+        offs[f] = 0;
+        out[f] = bson_iterator_eoo();
+    }
+    
+    if (nfields > 0) {
+        _bson_extract_impl(&ctx, bsdata, offs);
+    }
+    
+    for (f = 0; f < nfields; ++f) {
+        const bson_extract_field *field = &fields[f];
+        bson_type bt = BSON_ITERATOR_TYPE(&out[f]);
+        
+        if (!ctx.found[f]) {
+            if (field->flags & BSON_EXTRACT_OPTIONAL) {
+                continue;
+            }
+            return f;
+        }
+        if (field->type != BSON_EOO && bt != field->type) {
+            return f;
+        }
+        if (bt == BSON_BINDATA) {
+            int len = bson_iterator_bin_len(&out[f]);
+            if ((field->len > 0 && len != field->len) || (field->maxlen > 0 && len > field->maxlen)) {
+                return f;
+            }
+        } else if (bt == BSON_STRING) {
+            if (field->maxlen > 0 && bson_iterator_string_len(&out[f]) > field->maxlen) {
+                return f;
+            }
+        }
+    }
+    return -1;
+}
+
+int bson_check_buffer(const void *data, int len) {
+    const unsigned char *base = data;
+    /* Position of the terminating NUL of each open document */
+    const unsigned char *end[BSON_CHECK_MAX_DEPTH];
+    const unsigned char *p, *q;
+    int depth = 0;
+    int size, l, avail, ds;
+    
+    if (!data || len < 5) {
+        return BSON_ERROR;
+    }
+    bson_little_endian32(&size, base);
+    if (size != len || base[size - 1] != 0) {
+        return BSON_ERROR;
+    }
+    end[0] = base + size - 1;
+    p = base + 4;
+    
+    while (true) {
+        if (p == end[depth]) {
+            if (depth == 0) {
+                return BSON_OK;
+            }
+            p++;
+            depth--;
+            continue;
+        }
+        
+        bson_type type = (bson_type) *p++;
+        q = memchr(p, '\0', end[depth] - p);
+        if (!q) {
+            return BSON_ERROR;
+        }
+        p = q + 1;
+        /* Bytes left for the value before the terminator */
+        avail = end[depth] - p;
+        
+        switch (type) {
+            case BSON_UNDEFINED:
+            case BSON_NULL:
+                ds = 0;
+                break;
+            case BSON_BOOL:
+                ds = 1;
+                break;
+            case BSON_INT:
+                ds = 4;
+                break;
+            case BSON_LONG:
+            case BSON_DOUBLE:
+            case BSON_TIMESTAMP:
+            case BSON_DATE:
+                ds = 8;
+                break;
+            case BSON_OID:
+                ds = 12;
+                break;
+            case BSON_STRING:
+            case BSON_SYMBOL:
+            case BSON_CODE:
+            case BSON_DBREF:
+                if (avail < 4) {
+                    return BSON_ERROR;
+                }
+                bson_little_endian32(&l, p);
+                if (l < 1 || l > avail - 4 || p[4 + l - 1] != 0) {
+                    return BSON_ERROR;
+                }
+                ds = 4 + l + (type == BSON_DBREF ? 12 : 0);
+                break;
+            case BSON_BINDATA:
+                if (avail < 5) {
+                    return BSON_ERROR;
+                }
+                bson_little_endian32(&l, p);
+                if (l < 0 || l > avail - 5) {
+                    return BSON_ERROR;
+                }
+                if (p[4] == BSON_BIN_BINARY_OLD) {
+                    int inner;
+                    if (l < 4) {
+                        return BSON_ERROR;
+                    }
+                    bson_little_endian32(&inner, p + 5);
+                    if (inner != l - 4) {
+                        return BSON_ERROR;
+                    }
+                }
+                ds = 5 + l;
+                break;
+            case BSON_OBJECT:
+            case BSON_ARRAY:
+                if (avail < 5) {
+                    return BSON_ERROR;
+                }
+                bson_little_endian32(&l, p);
+                if (l < 5 || l > avail || p[l - 1] != 0 || depth + 1 >= BSON_CHECK_MAX_DEPTH) {
+                    return BSON_ERROR;
+                }
+                end[++depth] = p + l - 1;
+                p += 4;
+                continue;
+            case BSON_CODEWSCOPE:
+            {
+                /* int32 total, string, scope document */
+                int sl, dl;
+                if (avail < 4 + 5 + 5) {
+                    return BSON_ERROR;
+                }
+                bson_little_endian32(&l, p);
+                bson_little_endian32(&sl, p + 4);
+                if (l < 4 + 5 + 5 || l > avail || sl < 1 || sl > l - 4 - 4 - 5 || p[8 + sl - 1] != 0) {
+                    return BSON_ERROR;
+                }
+                bson_little_endian32(&dl, p + 8 + sl);
+                if (8 + sl + dl != l || p[l - 1] != 0 || depth + 1 >= BSON_CHECK_MAX_DEPTH) {
+                    return BSON_ERROR;
+                }
+                /* The scope document ends where the element ends */
+                end[++depth] = p + l - 1;
+                p += 8 + sl + 4;
+                continue;
+            }
+            case BSON_REGEX:
+                q = memchr(p, '\0', avail);
+                if (!q) {
+                    return BSON_ERROR;
+                }
+                q = memchr(q + 1, '\0', end[depth] - (q + 1));
+                if (!q) {
+                    return BSON_ERROR;
+                }
+                ds = q + 1 - p;
+                break;
+            default:
+                return BSON_ERROR;
+        }
+        
+        if (ds > avail) {
+            return BSON_ERROR;
+        }
+        p += ds;
+    }
+}
+
+int bson_init_checked(bson *bs, const void *data, int len) {
+    if (bson_check_buffer(data, len) != BSON_OK) {
+        return BSON_ERROR;
+    }
+    bson_init_with_data(bs, data);
+    bs->flags |= BSON_FLAG_TRUSTED;
+    return BSON_OK;
+}
+
+int bson_arena_init(bson_arena *a, int size) {
+    a->data = bson_malloc_func(size);
+    a->size = a->data ? size : 0;
+    a->used = 0;
+    a->peak = 0;
+    return a->data ? BSON_OK : BSON_ERROR;
+}
+
+void bson_arena_reset(bson_arena *a) {
+    if (a->peak > a->size && a->peak <= BSON_ARENA_MAX_SIZE) {
+        /* Make room for the demand seen, contents need not be kept */
+        char *data = bson_malloc_func(a->peak);
+        if (data) {
+            bson_free_func(a->data);
+            a->data = data;
+            a->size = a->peak;
+        }
+    }
+    a->used = 0;
+    a->peak = 0;
+}
+
+void bson_arena_destroy(bson_arena *a) {
+    bson_free_func(a->data);
+    a->data = NULL;
+    a->size = 0;
+    a->used = 0;
+    a->peak = 0;
+}
+
+/* Allocate size bytes, 8 byte aligned, or return NULL */
+static char *_bson_arena_alloc(bson_arena *a, int size) {
+    int start = (a->used + 7) & ~7;
+    
+    if (a->data == NULL || size > a->size - start) {
+        return NULL;
+    }
+    a->used = start + size;
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    return a->data + start;
+}
+
+/* Grow the data of an arena bson to new_size, in place if it is the most
+ * recent allocation, else by copying to a new allocation from the arena or
+ * at last from the heap. A bson moved to the heap keeps b->arena, so that
+ * bson_destroy can record its size as demand on the arena. */
+static int _bson_arena_realloc(bson *b, int new_size) {
+    bson_arena *a = b->arena;
+    char *odata = b->data;
+    int start = odata - a->data;
+    
+    if (odata + b->dataSize == a->data + a->used) {
+        if (new_size <= a->size - start) {
+            a->used = start + new_size;
+            if (a->used > a->peak) {
+                a->peak = a->used;
+            }
+            return BSON_OK;
+        }
+        /* Nothing after this allocation would fit either */
+        b->data = NULL;
+    } else {
+        b->data = _bson_arena_alloc(a, new_size);
+    }
+    if (!b->data) {
+        b->data = bson_malloc_func(new_size);
+        if (!b->data) {
+            bson_fatal_msg(!!b->data, "malloc() failed");
+            return BSON_ERROR;
+        }
+        b->flags &= ~BSON_FLAG_ARENA;
+    }
+    memcpy(b->data, odata, b->cur - odata);
+    return BSON_OK;
+}
+
+void bson_init_arena(bson *b, bson_arena *a, int size_hint) {
+    char *data;
+    
+    if (size_hint < 5) {
+        size_hint = initialBufferSize;
+    }
+    if (!a || !(data = _bson_arena_alloc(a, size_hint))) {
+        _bson_init_size(b, size_hint);
+        b->arena = a;
+        return;
+    }
+    bson_reset(b);
+    b->data = data;
+    b->cur = b->data + 4;
+    b->dataSize = size_hint;
+    b->flags |= BSON_FLAG_ARENA;
+    b->arena = a;
+}
+
+int bson_path_compile(bson_path *path, const char *fpath) {
+    const char *key = fpath;
+    path->ntokens = 0;
+    for (;;) {
+        const char *dot = strchr(key, '.');
+        int len = dot ? dot - key : (int) strlen(key);
+        if (len == 0 || path->ntokens == BSON_PATH_MAX_TOKENS) {
+            return BSON_ERROR;
+        }
+        path->tokens[path->ntokens].key = key;
+        path->tokens[path->ntokens].len = len;
+        path->ntokens++;
+        if (!dot) {
+            return BSON_OK;
+        }
+        key = dot + 1;
+    }
+}
+
+/* strncmp stops at the end of a shorter key, so key is never read past
+ * its terminator */
+static bool bson_path_key_eq(const char *key, const bson_path_token *token) {
+    return key[0] == token->key[0]
+            && strncmp(key, token->key, token->len) == 0
+            && key[token->len] == '\0';
+}
+
+bson_type bson_find_path(const bson_path *path, bson_iterator *it) {
+    bson_type t;
+    int level = 0;
+    if (path->ntokens < 1) {
+        return BSON_EOO;
+    }
+    while ((t = bson_iterator_next(it)) != BSON_EOO) {
+        if (!bson_path_key_eq(BSON_ITERATOR_KEY(it), &path->tokens[level])) {
+            continue;
+        }
+        if (level + 1 == path->ntokens) {
+            return t;
+        }
+        if (t == BSON_OBJECT || t == BSON_ARRAY) {
+            level++;
+            BSON_ITERATOR_SUBITERATOR(it, it);
+        }
+    }
+    return BSON_EOO;
+}
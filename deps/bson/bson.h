@@ -76,7 +76,9 @@ enum bson_binary_subtype_t {
 enum bson_flags_t {
     BSON_FLAG_QUERY_MODE = 1,
     BSON_FLAG_STACK_ALLOCATED = 1 << 1, /**< If it set BSON data is allocated on stack and realloc should deal with this case */
-    BSON_FLAG_EXTERNAL_BUFFER = 1 << 2  /**< Force to use given buffer */
+    BSON_FLAG_EXTERNAL_BUFFER = 1 << 2, /**< Force to use given buffer */
+    BSON_FLAG_TRUSTED = 1 << 3, /**< Data has passed bson_check_buffer, all lengths are within bounds */
+    BSON_FLAG_ARENA = 1 << 4 /**< BSON data is allocated from bson::arena */
 };
 
 typedef enum {
@@ -118,6 +120,7 @@ typedef struct {
     int err; /**< Bitfield representing errors or warnings on this buffer */
     char *errstr; /**< A string representation of the most recent error or warning. */
     int flags;
+    struct bson_arena *arena; /**< Arena of the data, if BSON_FLAG_ARENA is set */
 } bson;
 
 #pragma pack(1)
@@ -1412,5 +1415,153 @@ void bson_update(bson* orig, bson* update);
 
 bson_iterator bson_iterator_eoo();
 
+/** Maximum number of fields in one bson_extract schema */
+#define BSON_EXTRACT_MAX_FIELDS 16
+
+/** bson_extract field flags */
+#define BSON_EXTRACT_OPTIONAL 1 /**< A missing field is not an error (a present one must still match) */
+
+/**
+ * One field of a bson_extract schema
+ */
+typedef struct {
+    const char *fpath; /**< Field path, same format as for bson_find_fieldpath_value */
+    bson_type type; /**< Expected type, BSON_EOO accepts any type */
+    int len; /**< Exact length of a BSON_BINDATA value, 0 for no check */
+    int maxlen; /**< Maximum bson_iterator_string_len of a string or bson_iterator_bin_len of a binary, 0 for no check */
+    int flags; /**< BSON_EXTRACT_* flags */
+} bson_extract_field;
+
+/**
+ * Find several fields of a document in one pass.
+ *
+ * The document is walked once, descending only into the objects and arrays
+ * on the given field paths, and the walk ends as soon as all fields have been
+ * found. For each field, out[i] is set to the field found, or to an iterator
+ * of type BSON_EOO if it is not present.
+ *
+ * @param bsdata the document
+ * @param fields the schema, at most BSON_EXTRACT_MAX_FIELDS fields
+ * @param nfields number of fields in schema
+ * @param out array of nfields iterators
+ * @return -1 if all fields satisfy the schema, else the index of the first
+ * field which is missing (out[i] of type BSON_EOO), has another type or
+ * violates the length constraints
+ */
+int bson_extract(const void *bsdata, const bson_extract_field *fields, int nfields, bson_iterator *out);
+
+/** Maximum nesting depth of documents accepted by bson_check_buffer */
+#define BSON_CHECK_MAX_DEPTH 32
+
+/**
+ * Check that a buffer holds exactly one well formed document.
+ *
+ * The document is walked once, without recursion, and every element is
+ * checked to lie within its enclosing document and the buffer: keys and
+ * strings are NUL terminated, and all embedded lengths are consistent.
+ * Once a buffer has passed, the unchecked iterators can be used on it
+ * safely.
+ *
+ * @param data the buffer
+ * @param len number of bytes in buffer, which must equal the document size
+ * @return BSON_OK or BSON_ERROR
+ */
+int bson_check_buffer(const void *data, int len);
+
+/**
+ * Like bson_init_with_data, but check the data with bson_check_buffer
+ * first and mark bs with BSON_FLAG_TRUSTED.
+ *
+ * @return BSON_OK or BSON_ERROR, in which case bs is not initialized
+ */
+int bson_init_checked(bson *bs, const void *data, int len);
+
+/** Upper limit for the growth of a bson_arena in bson_arena_reset */
+#define BSON_ARENA_MAX_SIZE (1024 * 1024)
+
+/**
+ * A bump allocator for short lived bson builders.
+ *
+ * Builders initialized with bson_init_arena take their buffer from the
+ * arena, and grow in place while they are the most recent allocation.
+ * bson_destroy releases the most recent allocation; everything else is
+ * released at once by bson_arena_reset. When the arena is exhausted the
+ * builder continues on the heap, and the next reset enlarges the arena
+ * to the peak demand seen, so that steady state use does not allocate.
+ */
+typedef struct bson_arena {
+    char *data;
+    int size;
+    int used;
+    int peak; /**< Largest demand since the last reset, including what did not fit */
+} bson_arena;
+
+/**
+ * Allocate the arena memory.
+ *
+ * @return BSON_OK or BSON_ERROR
+ */
+int bson_arena_init(bson_arena *a, int size);
+
+/**
+ * Release all allocations of the arena. No bson built from the arena may
+ * be used after this.
+ */
+void bson_arena_reset(bson_arena *a);
+
+void bson_arena_destroy(bson_arena *a);
+
+/**
+ * Initialize a bson builder with its buffer taken from an arena.
+ *
+ * @param b the bson
+ * @param a the arena, or NULL to use the heap like bson_init_size
+ * @param size_hint initial buffer size, the expected size of the document
+ */
+void bson_init_arena(bson *b, bson_arena *a, int size_hint);
+
+/** Maximum number of keys in a bson_path */
+#define BSON_PATH_MAX_TOKENS 8
+
+/** One key of a bson_path, not NUL terminated */
+typedef struct {
+    const char *key;
+    int len;
+} bson_path_token;
+
+/**
+ * A field path split into its keys once, for lookups with bson_find_path.
+ *
+ * Constant paths can be written out at compile time:
+ *
+ *     static const bson_path luid_path = { 2, { BSON_PATH_KEY("0"), BSON_PATH_KEY("luid") } };
+ */
+typedef struct {
+    int ntokens;
+    bson_path_token tokens[BSON_PATH_MAX_TOKENS];
+} bson_path;
+
+/** bson_path_token initializer for a string literal */
+#define BSON_PATH_KEY(k) { (k), sizeof(k) - 1 }
+
+/**
+ * Split a dotted field path into path. The tokens point into fpath, which
+ * must outlive path.
+ *
+ * @return BSON_OK, or BSON_ERROR if fpath has an empty key or more than
+ * BSON_PATH_MAX_TOKENS keys
+ */
+int bson_path_compile(bson_path *path, const char *fpath);
+
+/**
+ * Advance it to the field at path, like bson_find_fieldpath_value. Keys are
+ * matched one level at a time, so unlike bson_find_fieldpath_value a key
+ * containing a dot never matches, and only the first matching object or
+ * array on each level is descended into.
+ *
+ * @return type of the field found, or BSON_EOO
+ */
+bson_type bson_find_path(const bson_path *path, bson_iterator *it);
+
 //EJDB_EXTERN_C_END
 #endif
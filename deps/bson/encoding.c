@@ -37,9 +37,22 @@
  */
 
 
+#include <stdint.h>
+#include <string.h>
+
 #include "bson.h"
 #include "encoding.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* AVX2 is selected at run time, on x86 with GCC or Clang */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(BSON_NO_AVX2)
+#include <immintrin.h>
+#define BSON_AVX2_DISPATCH 1
+#endif
+
 /*
  * Index into the table below with the first byte of a UTF-8 sequence to
  * get the number of trailing bytes that are supposed to follow it.
@@ -101,6 +114,83 @@ static int isLegalUTF8(const unsigned char *source, int length) {
     return 1;
 }
 
+/* --------------------------------------------------------------------- */
+
+/*
+ * Length of the run of ASCII bytes at the start of string. Strings handled
+ * here (keys, aliases, protocol names) are mostly ASCII, so validation
+ * skips such runs in blocks and checks only the multibyte sequences byte
+ * by byte.
+ */
+static int ascii_run_scalar(const unsigned char *string, int length) {
+    int position = 0;
+    /* Eight bytes at a time */
+    while (position + 8 <= length) {
+        uint64_t word;
+        memcpy(&word, string + position, 8);
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+        position += 8;
+    }
+    while (position < length && string[position] < 0x80) {
+        position++;
+    }
+    return position;
+}
+
+#if defined(__SSE2__)
+static int ascii_run_sse2(const unsigned char *string, int length) {
+    int position = 0;
+    while (position + 16 <= length) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (string + position)));
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+        position += 16;
+    }
+    return position + ascii_run_scalar(string + position, length - position);
+}
+#endif
+
+#if defined(BSON_AVX2_DISPATCH)
+__attribute__((target("avx2")))
+static int ascii_run_avx2(const unsigned char *string, int length) {
+    int position = 0;
+    while (position + 32 <= length) {
+        unsigned int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) (string + position)));
+        if (mask) {
+            return position + __builtin_ctz(mask);
+        }
+        position += 32;
+    }
+    return position + ascii_run_scalar(string + position, length - position);
+}
+
+static int ascii_run_select(const unsigned char *string, int length);
+
+static int (*ascii_run)(const unsigned char *string, int length) = ascii_run_select;
+
+/* Pick the implementation on first use */
+static int ascii_run_select(const unsigned char *string, int length) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ascii_run = ascii_run_avx2;
+    } else {
+#if defined(__SSE2__)
+        ascii_run = ascii_run_sse2;
+#else
+        ascii_run = ascii_run_scalar;
+#endif
+    }
+    return ascii_run(string, length);
+}
+#elif defined(__SSE2__)
+#define ascii_run ascii_run_sse2
+#else
+#define ascii_run ascii_run_scalar
+#endif
+
 /* If the name is part of a db ref ($ref, $db, or $id), then return true. */
 static int bson_string_is_db_ref(const unsigned char *string, const int length) {
     int result = 0;
@@ -128,25 +218,30 @@ static int bson_validate_string(bson *b, const unsigned char *string,
             b->err |= BSON_FIELD_INIT_DOLLAR;
     }
 
-    while (position < length) {
-        if (check_dot && *(string + position) == '.') {
-            b->err |= BSON_FIELD_HAS_DOT;
-        }
-        if (check_utf8) {
-            sequence_length = trailingBytesForUTF8[*(string + position)] + 1;
-            if ((position + sequence_length) > length) {
-                b->err |= BSON_NOT_UTF8;
-                return BSON_ERROR;
+    if (check_utf8) {
+        while (position < length) {
+            position += ascii_run(string + position, length - position);
+            if (position == length) {
+                break;
             }
-            if (!isLegalUTF8(string + position, sequence_length)) {
+            sequence_length = trailingBytesForUTF8[*(string + position)] + 1;
+            if ((position + sequence_length) > length
+                    || !isLegalUTF8(string + position, sequence_length)) {
                 b->err |= BSON_NOT_UTF8;
-                return BSON_ERROR;
+                break;
             }
+            position += sequence_length;
         }
-        position += sequence_length;
+    } else {
+        position = length;
+    }
+
+    /* Dots are looked for up to the first invalid sequence */
+    if (check_dot && memchr(string, '.', position) != NULL) {
+        b->err |= BSON_FIELD_HAS_DOT;
     }
 
-    return BSON_OK;
+    return position == length ? BSON_OK : BSON_ERROR;
 }
 
 int bson_check_string(bson *b, const char *string,
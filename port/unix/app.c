@@ -12,6 +12,7 @@
  *
  * @license Apache-2.0
  */
+#define _GNU_SOURCE /* recvmmsg */
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -21,12 +22,15 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h> 
 #include <time.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include "utlist.h"
 
 #include "wish_version.h"
@@ -45,6 +49,7 @@
 
 #include "fs_port.h"
 #include "wish_relay_client.h"
+#include "wish_peer_state.h"
 
 #include "wish_port_config.h"
 
@@ -122,7 +127,7 @@ int wish_open_connection(wish_core_t* core, wish_connection_t* connection, wish_
         printf("Malloc fail");
         exit(1);
     }
-    *(sockfd_ptr) = socket(AF_INET, SOCK_STREAM, 0);
+    *(sockfd_ptr) = socket(ip->domain == WISH_ADDR_IPV6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
 
     int sockfd = *(sockfd_ptr);
     socket_set_nonblocking(sockfd);
@@ -136,21 +141,32 @@ int wish_open_connection(wish_core_t* core, wish_connection_t* connection, wish_
     }
 
     // set ip and port to wish connection
-    memcpy(connection->remote_ip_addr, ip->addr, WISH_IPV4_ADDRLEN);
+    if (ip->domain == WISH_ADDR_IPV4) {
+        memcpy(connection->remote_ip_addr, ip->addr, WISH_IPV4_ADDRLEN);
+    }
     connection->remote_port = port;
     
-    struct sockaddr_in serv_addr;
-    serv_addr.sin_family = AF_INET;
-    
-    // set ip
-    char ip_str[20];
-    snprintf(ip_str, 20, "%d.%d.%d.%d", ip->addr[0], ip->addr[1], ip->addr[2], ip->addr[3]);
-    inet_aton(ip_str, &serv_addr.sin_addr);
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_len;
+    memset(&serv_addr, 0, sizeof (serv_addr));
     
-    // set port
-    serv_addr.sin_port = htons(port);
+    if (ip->domain == WISH_ADDR_IPV6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &serv_addr;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, ip->addr, WISH_IPV6_ADDRLEN);
+        sin6->sin6_scope_id = ip->scope_id;
+        sin6->sin6_port = htons(port);
+        serv_addr_len = sizeof (struct sockaddr_in6);
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in *) &serv_addr;
+        sin->sin_family = AF_INET;
+        /* Wish addresses are already in network byte order */
+        memcpy(&sin->sin_addr.s_addr, ip->addr, WISH_IPV4_ADDRLEN);
+        sin->sin_port = htons(port);
+        serv_addr_len = sizeof (struct sockaddr_in);
+    }
     
-    int ret = connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr));
+    int ret = connect(sockfd,(struct sockaddr *) &serv_addr, serv_addr_len);
     if (ret == -1) {
         if (errno == EINPROGRESS) {
             WISHDEBUG(LOG_DEBUG, "Connect now in progress");
@@ -193,6 +209,7 @@ char usage_str[] = "Wish Core " WISH_CORE_VERSION_STRING
     -r connect to a relay server, for accepting incoming connections via the relay.\n\
 \n\
     -a <port> start \"App TCP\" interface server at port\n\
+    -u <path> also accept Apps on a Unix domain socket at path\n\
 \n\
     Direct client connection:\n\
     -c <ip_addr> open a direct client connection to this IP addr\n\
@@ -237,6 +254,9 @@ bool as_relay_client = true;
 bool as_app_server = true;
 uint16_t app_port = 9094;
 extern int app_serverfd; /* Defined in app_server.c */
+/* -u <path> Unix domain socket path for local Apps, in addition to the App TCP port */
+char* app_unix_path = NULL;
+extern int app_unix_serverfd; /* Defined in app_server.c */
 extern int app_fds[];
 extern enum app_state app_states[];
 #endif
@@ -246,7 +266,7 @@ extern enum app_state app_states[];
  * variables accordingly */
 static void process_cmdline_opts(int argc, char** argv) {
     int opt = 0;
-    while ((opt = getopt(argc, argv, "hbilc:C:R:sp:ra:")) != -1) {
+    while ((opt = getopt(argc, argv, "hbilc:C:R:sp:ra:u:")) != -1) {
         switch (opt) {
         case 'b':
             printf("Will not do wld broadcast!\n");
@@ -299,6 +319,14 @@ static void process_cmdline_opts(int argc, char** argv) {
 #else // WITH_APP_TCP_SERVER
             printf("App tcp server not included in build!\n");
             exit(1);
+#endif
+            break;
+        case 'u':
+#ifdef WITH_APP_TCP_SERVER
+            app_unix_path = strdup(optarg);
+#else // WITH_APP_TCP_SERVER
+            printf("App server not included in build!\n");
+            exit(1);
 #endif
             break;
         default:
@@ -317,6 +345,14 @@ static void process_cmdline_opts(int argc, char** argv) {
 int wld_fd = 0;
 struct sockaddr_in sockaddr_wld;
 
+/* The UDP Wish local discovery socket for IPv6, receiving adverts sent
+ * to the link-local all nodes multicast address. -1 if IPv6 is not
+ * available. */
+int wld6_fd = -1;
+
+/* The link-local multicast group where IPv6 adverts are sent */
+#define WLD_IPV6_GROUP "ff02::1"
+
 /* This function sets up a UDP socket for listening to UDP local
  * discovery broadcasts */
 void setup_wish_local_discovery(void) {
@@ -345,48 +381,226 @@ void setup_wish_local_discovery(void) {
         error("local discovery bind()");
     }
 
+    /* IPv6 is optional, discovery keeps working over IPv4 without it */
+    wld6_fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (wld6_fd == -1) {
+        perror("wld: IPv6 local discovery not available");
+        return;
+    }
+    
+    setsockopt(wld6_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    setsockopt(wld6_fd, IPPROTO_IPV6, IPV6_V6ONLY, &option, sizeof(option));
+    socket_set_nonblocking(wld6_fd);
+    
+    struct sockaddr_in6 sockaddr_wld6;
+    memset(&sockaddr_wld6, 0, sizeof (sockaddr_wld6));
+    sockaddr_wld6.sin6_family = AF_INET6;
+    sockaddr_wld6.sin6_port = htons(LOCAL_DISCOVERY_UDP_PORT);
+    sockaddr_wld6.sin6_addr = in6addr_any;
+    
+    if (bind(wld6_fd, (struct sockaddr*) &sockaddr_wld6, sizeof (sockaddr_wld6)) == -1) {
+        perror("wld: IPv6 local discovery bind()");
+        close(wld6_fd);
+        wld6_fd = -1;
+    }
+}
+
+/* Per source address state of the local discovery receiver: a token
+ * bucket limiting the adverts accepted per second, and the hashes of the
+ * latest adverts for dropping repeats within WISH_PORT_WLD_DEDUP_MS */
+#define WLD_DEDUP_SLOTS 4
+
+typedef struct {
+    uint32_t addr;          /* Hash of the source address */
+    uint32_t tokens;        /* In thousandths of an advert */
+    uint64_t refill_ms;
+    uint64_t seen_ms;
+    uint32_t hash[WLD_DEDUP_SLOTS];
+    uint64_t hash_ms[WLD_DEDUP_SLOTS];
+    int next_hash;
+} wld_source_t;
+
+static wld_source_t wld_sources[WISH_PORT_WLD_SOURCES];
+
+static uint64_t wld_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a */
+static uint32_t wld_hash(const uint8_t* buf, int len) {
+    uint32_t h = 2166136261u;
+    int i;
+    
+    for (i = 0; i < len; i++) {
+        h = (h ^ buf[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Find the state of a source, or take over the least recently seen one */
+static wld_source_t* wld_source(uint32_t addr, uint64_t now) {
+    wld_source_t* oldest = &wld_sources[0];
+    int i;
+    
+    for (i = 0; i < WISH_PORT_WLD_SOURCES; i++) {
+        wld_source_t* src = &wld_sources[i];
+        
+        if (src->seen_ms != 0 && src->addr == addr) {
+            return src;
+        }
+        if (src->seen_ms < oldest->seen_ms) {
+            oldest = src;
+        }
+    }
+    
+    memset(oldest, 0, sizeof (wld_source_t));
+    oldest->addr = addr;
+    oldest->tokens = WISH_PORT_WLD_BURST * 1000;
+    oldest->refill_ms = now;
+    return oldest;
+}
+
+/* Returns true if the advert should be passed on to wish_ldiscover_feed */
+static bool wld_accept(uint32_t addr, const uint8_t* buf, int len, uint64_t now) {
+    wld_source_t* src = wld_source(addr, now);
+    uint32_t h = wld_hash(buf, len);
+    int i;
+    
+    src->seen_ms = now;
+    
+    for (i = 0; i < WLD_DEDUP_SLOTS; i++) {
+        if (src->hash_ms[i] != 0 && src->hash[i] == h && now - src->hash_ms[i] < WISH_PORT_WLD_DEDUP_MS) {
+            return false;
+        }
+    }
+    
+    uint64_t refill = (now - src->refill_ms) * WISH_PORT_WLD_RATE;
+    src->refill_ms = now;
+    
+    if (src->tokens + refill > WISH_PORT_WLD_BURST * 1000) {
+        src->tokens = WISH_PORT_WLD_BURST * 1000;
+    } else {
+        src->tokens += refill;
+    }
+    
+    if (src->tokens < 1000) {
+        return false;
+    }
+    src->tokens -= 1000;
+    
+    src->hash[src->next_hash] = h;
+    src->hash_ms[src->next_hash] = now;
+    src->next_hash = (src->next_hash + 1) % WLD_DEDUP_SLOTS;
+    return true;
+}
+
+static void wld_feed(struct sockaddr_storage* from, uint8_t* buf, int len, uint64_t now) {
+    wish_ip_addr_t ip_addr;
+    uint16_t port;
+    
+    if (len <= 0) {
+        return;
+    }
+    
+    memset(&ip_addr, 0, sizeof (ip_addr));
+    
+    /* XXX Don't convert to host byte order here. Wish ip addresses
+     * have network byte order */
+    if (from->ss_family == AF_INET6) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*) from;
+        ip_addr.domain = WISH_ADDR_IPV6;
+        memcpy(&ip_addr.addr, &sin6->sin6_addr, WISH_IPV6_ADDRLEN);
+        ip_addr.scope_id = sin6->sin6_scope_id;
+        port = ntohs(sin6->sin6_port);
+    } else {
+        struct sockaddr_in* sin = (struct sockaddr_in*) from;
+        ip_addr.domain = WISH_ADDR_IPV4;
+        memcpy(&ip_addr.addr, &sin->sin_addr.s_addr, WISH_IPV4_ADDRLEN);
+        port = ntohs(sin->sin_port);
+    }
+    
+    if (!wld_accept(wld_hash(ip_addr.addr, WISH_IPV6_ADDRLEN), buf, len, now)) {
+        return;
+    }
+    
+    wish_ldiscover_feed(core, &ip_addr, port, buf, len);
 }
 
 /* This function reads data from the local discovery socket. This
  * function should be called when select() indicates that the local
- * discovery socket has data available */
-void read_wish_local_discovery(void) {
-    const int buf_len = 1024;
-    uint8_t buf[buf_len];
-    int blen;
-    socklen_t slen = sizeof(struct sockaddr_in);
-
-    blen = recvfrom(wld_fd, buf, sizeof(buf), 0, (struct sockaddr*) &sockaddr_wld, &slen);
-    if (blen == -1) {
-      error("recvfrom()");
-    }
-
-    if (blen > 0) {
-        //printf("Received from %s:%hu\n\n",inet_ntoa(sockaddr_wld.sin_addr), ntohs(sockaddr_wld.sin_port));
-        union ip {
-           uint32_t as_long;
-           uint8_t as_bytes[4];
-        } ip;
-        /* XXX Don't convert to host byte order here. Wish ip addresses
-         * have network byte order */
-        //ip.as_long = ntohl(sockaddr_wld.sin_addr.s_addr);
-        ip.as_long = sockaddr_wld.sin_addr.s_addr;
-        wish_ip_addr_t ip_addr;
-        memcpy(&ip_addr.addr, ip.as_bytes, 4);
-        //printf("UDP data from: %i, %i, %i, %i\n", ip_addr.addr[0],
-        //    ip_addr.addr[1], ip_addr.addr[2], ip_addr.addr[3]);
-
-        wish_ldiscover_feed(core, &ip_addr, 
-           ntohs(sockaddr_wld.sin_port), buf, blen);
+ * discovery socket has data available. Up to WISH_PORT_WLD_BATCH
+ * datagrams are handled per call, the rest wait for the next round of
+ * the event loop. */
+void read_wish_local_discovery(int fd) {
+    static uint8_t bufs[WISH_PORT_WLD_BATCH][1024];
+    static struct sockaddr_storage from[WISH_PORT_WLD_BATCH];
+    uint64_t now = wld_now_ms();
+    int i;
+
+#ifdef __linux__
+    static struct mmsghdr msgs[WISH_PORT_WLD_BATCH];
+    static struct iovec iovecs[WISH_PORT_WLD_BATCH];
+
+    for (i = 0; i < WISH_PORT_WLD_BATCH; i++) {
+        iovecs[i].iov_base = bufs[i];
+        iovecs[i].iov_len = sizeof (bufs[i]);
+        memset(&msgs[i].msg_hdr, 0, sizeof (struct msghdr));
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_storage);
+    }
+
+    int n = recvmmsg(fd, msgs, WISH_PORT_WLD_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        error("recvmmsg()");
+    }
+
+    for (i = 0; i < n; i++) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            /* Larger than any valid advert */
+            continue;
+        }
+        wld_feed(&from[i], bufs[i], msgs[i].msg_len, now);
     }
+#else
+    for (i = 0; i < WISH_PORT_WLD_BATCH; i++) {
+        socklen_t slen = sizeof(struct sockaddr_storage);
+        int blen = recvfrom(fd, bufs[0], sizeof (bufs[0]), 0, (struct sockaddr*) &from[0], &slen);
+        
+        if (blen == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            error("recvfrom()");
+        }
+        wld_feed(&from[0], bufs[0], blen, now);
+    }
+#endif
 }
 
 void cleanup_local_discovery(void) {
     close(wld_fd);
+    if (wld6_fd >= 0) {
+        close(wld6_fd);
+    }
 
 }
 
-int wish_send_advertizement(wish_core_t* core, uint8_t *ad_msg, size_t ad_len) {
+/* The socket for sending local discovery adverts, opened on first use
+ * and kept for the lifetime of the core */
+static int advert_fd = -1;
+
+static int advert_socket(void) {
+    if (advert_fd >= 0) {
+        return advert_fd;
+    }
+    
     int s = socket(AF_INET, SOCK_DGRAM, 0);
     if (s < 0) {
         perror("Could not create socket for broadcasting");
@@ -399,7 +613,6 @@ int wish_send_advertizement(wish_core_t* core, uint8_t *ad_msg, size_t ad_len) {
         error("set sock opt");
     }
 
-
     struct sockaddr_in sockaddr_src;
     memset(&sockaddr_src, 0, sizeof (struct sockaddr_in));
     sockaddr_src.sin_family = AF_INET;
@@ -407,24 +620,144 @@ int wish_send_advertizement(wish_core_t* core, uint8_t *ad_msg, size_t ad_len) {
     if (bind(s, (struct sockaddr *)&sockaddr_src, sizeof(struct sockaddr_in)) != 0) {
         error("Send local discovery: bind()");
     }
-    struct sockaddr_in si_other;
-    si_other.sin_family = AF_INET;
-    si_other.sin_port = htons(LOCAL_DISCOVERY_UDP_PORT);
-    inet_aton("255.255.255.255", &si_other.sin_addr);
-    socklen_t addrlen = sizeof(struct sockaddr_in);
-
-    if (sendto(s, ad_msg, ad_len, 0, 
-            (struct sockaddr*) &si_other, addrlen) == -1) {
-        if (errno == ENETUNREACH || errno == ENETDOWN) {
-            printf("wld: Network currently unreachable, or down. Retrying later.\n");
-        } else if (errno == EPERM) {
-            printf("wld: Network returned EPERM.\n");
-        } else {
-            error("sendto()");
+    
+    /* Adverts are best effort, never block the event loop on them */
+    socket_set_nonblocking(s);
+    
+    advert_fd = s;
+    return advert_fd;
+}
+
+/* The socket for sending IPv6 adverts, -1 until opened, or if IPv6 is
+ * not available */
+static int advert6_fd = -1;
+
+static int advert6_socket(void) {
+    static bool tried = false;
+    
+    if (advert6_fd >= 0 || tried) {
+        return advert6_fd;
+    }
+    tried = true;
+    
+    int s = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (s < 0) {
+        perror("wld: IPv6 adverts not available");
+        return -1;
+    }
+    
+    int hops = 1;
+    setsockopt(s, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+    socket_set_nonblocking(s);
+    
+    advert6_fd = s;
+    return advert6_fd;
+}
+
+/* Where adverts are sent: the broadcast address of each IPv4 interface,
+ * and the link-local multicast group on each IPv6 interface. The list
+ * is refreshed every WLD_ADVERT_DST_REFRESH seconds, so that interfaces
+ * coming and going are noticed. */
+#define WLD_ADVERT_DST_MAX 16
+#define WLD_ADVERT_DST_REFRESH 30
+
+static struct sockaddr_storage advert_dst[WLD_ADVERT_DST_MAX];
+static int advert_num_dst;
+static time_t advert_dst_timestamp;
+
+static void advert_dst_add(struct sockaddr* addr, socklen_t len) {
+    int i;
+    
+    for (i = 0; i < advert_num_dst; i++) {
+        if (memcmp(&advert_dst[i], addr, len) == 0) {
+            return;
+        }
+    }
+    
+    if (advert_num_dst < WLD_ADVERT_DST_MAX) {
+        memset(&advert_dst[advert_num_dst], 0, sizeof (struct sockaddr_storage));
+        memcpy(&advert_dst[advert_num_dst++], addr, len);
+    }
+}
+
+static void advert_dst_refresh(void) {
+    struct ifaddrs *ifaddr, *ifa;
+    bool have_ipv4 = false;
+    
+    advert_num_dst = 0;
+    
+    if (getifaddrs(&ifaddr) == 0) {
+        for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
+            if (ifa->ifa_addr == NULL || !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK)) {
+                continue;
+            }
+            
+            if (ifa->ifa_addr->sa_family == AF_INET && (ifa->ifa_flags & IFF_BROADCAST) && ifa->ifa_broadaddr != NULL) {
+                struct sockaddr_in dst;
+                memcpy(&dst, ifa->ifa_broadaddr, sizeof (dst));
+                dst.sin_port = htons(LOCAL_DISCOVERY_UDP_PORT);
+                advert_dst_add((struct sockaddr*) &dst, sizeof (dst));
+                have_ipv4 = true;
+            } else if (ifa->ifa_addr->sa_family == AF_INET6 && (ifa->ifa_flags & IFF_MULTICAST)) {
+                struct sockaddr_in6 dst;
+                memset(&dst, 0, sizeof (dst));
+                dst.sin6_family = AF_INET6;
+                dst.sin6_port = htons(LOCAL_DISCOVERY_UDP_PORT);
+                inet_pton(AF_INET6, WLD_IPV6_GROUP, &dst.sin6_addr);
+                dst.sin6_scope_id = if_nametoindex(ifa->ifa_name);
+                advert_dst_add((struct sockaddr*) &dst, sizeof (dst));
+            }
+        }
+        freeifaddrs(ifaddr);
+    } else {
+        perror("wld: getifaddrs");
+    }
+    
+    if (!have_ipv4) {
+        /* Interfaces unknown, fall back to the limited broadcast */
+        struct sockaddr_in dst;
+        memset(&dst, 0, sizeof (dst));
+        dst.sin_family = AF_INET;
+        dst.sin_port = htons(LOCAL_DISCOVERY_UDP_PORT);
+        dst.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+        advert_dst_add((struct sockaddr*) &dst, sizeof (dst));
+    }
+    
+    advert_dst_timestamp = time(NULL);
+}
+
+int wish_send_advertizement(wish_core_t* core, uint8_t *ad_msg, size_t ad_len) {
+    int i;
+    
+    if (advert_num_dst == 0 || time(NULL) > advert_dst_timestamp + WLD_ADVERT_DST_REFRESH) {
+        advert_dst_refresh();
+    }
+
+    for (i = 0; i < advert_num_dst; i++) {
+        struct sockaddr* dst = (struct sockaddr*) &advert_dst[i];
+        bool ipv6 = (dst->sa_family == AF_INET6);
+        int fd = ipv6 ? advert6_socket() : advert_socket();
+        
+        if (fd < 0) {
+            continue;
+        }
+        
+        if (sendto(fd, ad_msg, ad_len, 0, dst, 
+                ipv6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == -1) {
+            if (errno == ENETUNREACH || errno == ENETDOWN) {
+                printf("wld: Network currently unreachable, or down. Retrying later.\n");
+            } else if (errno == EPERM) {
+                printf("wld: Network returned EPERM.\n");
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Dropped, the next round will advertize again */
+            } else if (ipv6 || errno == EADDRNOTAVAIL) {
+                /* The interface went away, the list is refreshed later */
+            } else {
+                error("sendto()");
+            }
         }
     }
 
-    close(s);
     return 0;
 }
 
@@ -439,24 +772,43 @@ int serverfd = 0;
  * detect readable condition immediately when a TCP client connects.
  * */
 void setup_wish_server(wish_core_t* core) {
-    serverfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverfd < 0) {
-        perror("server socket creation");
-        exit(1);
+    /* One dual-stack socket takes both IPv4 and IPv6 connections, as
+     * IPv6 candidates from local discovery are dialled first. Hosts
+     * without IPv6 get a plain IPv4 socket. */
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len;
+    memset(&server_addr, 0, sizeof (server_addr));
+
+    serverfd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (serverfd >= 0) {
+        int v6only = 0;
+        setsockopt(serverfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &server_addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_any;
+        sin6->sin6_port = htons(wish_get_host_port(core));
+        server_addr_len = sizeof (struct sockaddr_in6);
+    } else {
+        serverfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (serverfd < 0) {
+            perror("server socket creation");
+            exit(1);
+        }
+
+        struct sockaddr_in *sin = (struct sockaddr_in *) &server_addr;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = INADDR_ANY;
+        sin->sin_port = htons(wish_get_host_port(core));
+        server_addr_len = sizeof (struct sockaddr_in);
     }
     int option = 1;
     setsockopt(serverfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
     socket_set_nonblocking(serverfd);
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof (server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(wish_get_host_port(core));
-    if (bind(serverfd, (struct sockaddr *) &server_addr, 
-            sizeof(server_addr)) < 0) {
+    if (bind(serverfd, (struct sockaddr *) &server_addr, server_addr_len) < 0) {
         perror("ERROR on binding wish server socket");
-        printf("setup_wish_server: Trying to bind port %d failed.\n", server_addr.sin_port);
+        printf("setup_wish_server: Trying to bind port %d failed.\n", wish_get_host_port(core));
         exit(1);
     }
     int connection_backlog = 1;
@@ -471,6 +823,33 @@ static void update_max_fd(int fd, int *max_fd) {
     }
 }
 
+/* Read from fd directly into the free space of a ring buffer. A free
+ * area wrapping around the end of the buffer memory is filled with the
+ * same readv() call. Returns like read(); the caller must make sure
+ * there is free space in the ring buffer. */
+static ssize_t read_to_ring_buffer(int fd, ring_buffer_t* rb) {
+    struct iovec iov[2];
+    uint8_t* ptr = NULL;
+    int iovcnt = 0;
+
+    uint16_t len = ring_buffer_write_span(rb, &ptr);
+    iov[iovcnt].iov_base = ptr;
+    iov[iovcnt].iov_len = len;
+    iovcnt++;
+    len = ring_buffer_write_span_wrapped(rb, &ptr);
+    if (len > 0) {
+        iov[iovcnt].iov_base = ptr;
+        iov[iovcnt].iov_len = len;
+        iovcnt++;
+    }
+
+    ssize_t read_len = readv(fd, iov, iovcnt);
+    if (read_len > 0) {
+        ring_buffer_write_commit(rb, read_len);
+    }
+    return read_len;
+}
+
 static int seed_random_init() {
     unsigned int randval;
     
@@ -494,12 +873,17 @@ static int seed_random_init() {
 
 #define IO_BUF_LEN 1000
 
+static uint32_t platform_time_ms(void) {
+    return (uint32_t) wld_now_ms();
+}
+
 int main(int argc, char** argv) {
     wish_platform_set_malloc(malloc);
     wish_platform_set_realloc(realloc);
     wish_platform_set_free(free);
     
     wish_platform_set_rng(random);
+    wish_platform_set_time_ms(platform_time_ms);
     wish_platform_set_vprintf(vprintf);
     wish_platform_set_vsprintf(vsprintf);
 
@@ -560,6 +944,9 @@ int main(int argc, char** argv) {
     if (as_app_server) {
         setup_app_server(core, app_port);
     }
+    if (as_app_server && app_unix_path != NULL) {
+        setup_app_server_unix(core, app_unix_path);
+    }
 #endif
 
 #if 0
@@ -596,6 +983,10 @@ int main(int argc, char** argv) {
         if (listen_to_adverts) {
             FD_SET(wld_fd, &rfds);
             update_max_fd(wld_fd, &max_fd);
+            if (wld6_fd >= 0) {
+                FD_SET(wld6_fd, &rfds);
+                update_max_fd(wld6_fd, &max_fd);
+            }
         }
 
         if (as_relay_client) {
@@ -624,10 +1015,17 @@ int main(int argc, char** argv) {
         if (as_app_server) {
             FD_SET(app_serverfd, &rfds);
             update_max_fd(app_serverfd, &max_fd);
+            if (app_unix_serverfd != -1) {
+                FD_SET(app_unix_serverfd, &rfds);
+                update_max_fd(app_unix_serverfd, &max_fd);
+            }
             int i;
             for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
                 if (app_states[i] == APP_CONNECTION_CONNECTED) {
                     FD_SET(app_fds[i], &rfds);
+                    if (app_connection_has_pending_tx(i)) {
+                        FD_SET(app_fds[i], &wfds);
+                    }
                     update_max_fd(app_fds[i], &max_fd);
                 }
             }
@@ -672,7 +1070,11 @@ int main(int argc, char** argv) {
         if (select_ret > 0) {
 
             if (FD_ISSET(wld_fd, &rfds)) {
-                read_wish_local_discovery();
+                read_wish_local_discovery(wld_fd);
+            }
+
+            if (wld6_fd >= 0 && FD_ISSET(wld6_fd, &rfds)) {
+                read_wish_local_discovery(wld6_fd);
             }
 
             if (as_relay_client) {
@@ -692,6 +1094,8 @@ int main(int argc, char** argv) {
                         if (connect_error == 0) {
                             /* connect() succeeded, the connection is open */
                             printf("Relay client connected\n");
+                            /* The TCP connect took one round-trip */
+                            wish_relay_client_rtt_sample(core, relay, (uint32_t) wld_now_ms() - relay->connect_started_ms);
                             relay_ctrl_connected_cb(core, relay);
                             wish_relay_client_periodic(core, relay);
                         }
@@ -706,11 +1110,16 @@ int main(int argc, char** argv) {
                         }
                     }
                     else if (FD_ISSET(relay->sockfd, &rfds) && relay->curr_state != WISH_RELAY_CLIENT_INITIAL) { /* Note: Before select() we added fd to be checked for readability, if the relay fd was in some other state than its initial state. Now we need to check writability under the same condition */
-                        uint8_t byte;   /* That's right, we read just one
-                            byte at a time! */
-                        int read_len = read(relay->sockfd, &byte, 1);
+                        if (ring_buffer_space(&(relay->rx_ringbuf)) == 0) {
+                            /* Let the state machine consume what is
+                             * buffered before reading more */
+                            wish_relay_client_periodic(core, relay);
+                            continue;
+                        }
+                        /* Read everything available (up to the free space) directly into the relay rx ring buffer */
+                        int read_len = read_to_ring_buffer(relay->sockfd, &(relay->rx_ringbuf));
                         if (read_len > 0) {
-                            wish_relay_client_feed(core, relay, &byte, 1);
+                            relay->last_input_timestamp = wish_time_get_relative(core);
                             wish_relay_client_periodic(core, relay);
                         }
                         else if (read_len == 0) {
@@ -734,27 +1143,11 @@ int main(int argc, char** argv) {
                 if (FD_ISSET(app_serverfd, &rfds)) {
                     /* New connection to app server port */
                     //printf("Detected incoming App connection\n");
-                    int newsockfd = accept(app_serverfd, NULL, NULL);
-                    if (newsockfd < 0) {
-                        perror("on accept");
-                        exit(1);
-                    }
-                    socket_set_nonblocking(newsockfd);
-                    int i = 0;
-                    /* Find a vacant app connection "slot" */
-                    for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
-                        if (app_states[i] == APP_CONNECTION_INITIAL) {
-                            // App socketfd: newsockfd
-                            app_fds[i] = newsockfd;
-                            app_states[i] = APP_CONNECTION_CONNECTED;
-                            break;
-                        }
-                    }
-                    if (i >= NUM_APP_CONNECTIONS) {
-                        printf("No vacant app connection found!\n");
-                        close(newsockfd);
-                    }
- 
+                    app_server_accept(core, app_serverfd);
+                }
+                if (app_unix_serverfd != -1 && FD_ISSET(app_unix_serverfd, &rfds)) {
+                    /* New connection to app server unix socket */
+                    app_server_accept(core, app_unix_serverfd);
                 }
                 
                 int i = 0;
@@ -764,15 +1157,26 @@ int main(int argc, char** argv) {
                         continue;
                     }
                     if (FD_ISSET(app_fds[i], &rfds)) {
-                        /* Existing App connection has become readable */
-                        size_t buffer_len = 100;
-                        uint8_t buffer[buffer_len];
-                        
-                        int read_len = read(app_fds[i], buffer, buffer_len);
+                        /* Existing App connection has become readable.
+                         * Read as much as fits directly into the app's
+                         * rx ring buffer, then handle every complete
+                         * frame in it. */
+                        ring_buffer_t* rb = app_connection_rx_ring_buffer(i);
+                        int read_len = 0;
                         
-                        if (read_len > 0) {
+                        if (ring_buffer_space(rb) == 0) {
+                            app_connection_process(core, i);
+                            if (app_states[i] == APP_CONNECTION_CONNECTED && ring_buffer_space(rb) == 0) {
+                                /* No frame can be completed from a full
+                                 * ring buffer, the app is not following
+                                 * the protocol */
+                                WISHDEBUG(LOG_CRITICAL, "App connection %i: ring buffer full, closing", i);
+                                app_connection_cleanup(core, i);
+                                close(app_fds[i]);
+                            }
+                        } else if ((read_len = read_to_ring_buffer(app_fds[i], rb)) > 0) {
                             /* App data can be read */
-                            app_connection_feed(core, i, buffer, read_len);
+                            app_connection_process(core, i);
                         } else if (read_len == 0) {
                             /* App has disconnected. Do clean-up */
                             //printf("App has disconnected\n");
@@ -784,6 +1188,13 @@ int main(int argc, char** argv) {
                             close(app_fds[i]);
                         }             
                     }
+                    if (app_states[i] == APP_CONNECTION_CONNECTED && FD_ISSET(app_fds[i], &wfds)) {
+                        /* Socket has room again for data queued earlier */
+                        if (app_connection_flush(core, i) < 0) {
+                            app_connection_cleanup(core, i);
+                            close(app_fds[i]);
+                        }
+                    }
                 }
             }
 #endif
@@ -946,6 +1357,12 @@ int main(int argc, char** argv) {
             wish_time_report_periodic(core);
         }
 
+        /* Tell the services about the peers which changed this round */
+        wish_peer_state_flush(core);
+
+        /* Nothing built during this round is referenced any more */
+        bson_arena_reset(&core->arena);
+
         //mist_follow_task();
     }
 
@@ -26,6 +26,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <netdb.h> 
 #include <time.h>
@@ -51,6 +54,7 @@
 
 #include "fs_port.h"
 #include "wish_relay_client.h"
+#include "utlist.h"
 
 
 #include "app_server.h"
@@ -60,6 +64,7 @@
 void socket_set_nonblocking(int sockfd);
 
 int app_serverfd = 0;
+int app_unix_serverfd = -1;
 
 /* This array holds the fds for app connections */
 int app_fds[NUM_APP_CONNECTIONS];
@@ -76,6 +81,24 @@ static struct app_entry apps[NUM_APP_CONNECTIONS];
 
 bool app_login_complete[NUM_APP_CONNECTIONS];
 
+/* Frames (or frame remainders) which could not be written to the app
+ * socket at once. They are drained in order when select() reports the
+ * socket writable, see app_connection_flush() */
+struct app_tx_buf {
+    uint8_t *data;
+    size_t len;
+    size_t offset;
+    struct app_tx_buf *next;
+};
+static struct app_tx_buf *app_tx_queue[NUM_APP_CONNECTIONS];
+static size_t app_tx_queue_bytes[NUM_APP_CONNECTIONS];
+
+#ifdef __APPLE__
+#define APP_SEND_FLAGS SO_NOSIGPIPE
+#else
+#define APP_SEND_FLAGS MSG_NOSIGNAL
+#endif
+
 
 /** This function sets up the app server listening socket so that App
  * clients can be accepted when select detects incoming connection
@@ -121,6 +144,81 @@ void setup_app_server(wish_core_t* core, uint16_t app_port) {
     }
 }
 
+/** This function sets up a Unix domain stream socket for accepting App
+ * clients on the same host. The framing is identical to the App TCP
+ * port, and accepted connections share the app connection slots.
+ *
+ * @param path the filesystem path of the socket. A stale socket file
+ * left at the path is removed first; any other kind of file there is an
+ * error.
+ */
+void setup_app_server_unix(wish_core_t* core, const char* path) {
+    struct sockaddr_un server_addr;
+    if (strlen(path) >= sizeof (server_addr.sun_path)) {
+        printf("App server socket path too long: %s\n", path);
+        exit(1);
+    }
+
+    app_unix_serverfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (app_unix_serverfd < 0) {
+        perror("App server unix socket creation");
+        exit(1);
+    }
+    socket_set_nonblocking(app_unix_serverfd);
+
+    memset(&server_addr, 0, sizeof (server_addr));
+    server_addr.sun_family = AF_UNIX;
+    strncpy(server_addr.sun_path, path, sizeof (server_addr.sun_path) - 1);
+
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("App server socket path exists and is not a socket: %s\n", path);
+            exit(1);
+        }
+        unlink(path);
+    }
+    if (bind(app_unix_serverfd, (struct sockaddr *) &server_addr, 
+            sizeof(server_addr)) < 0) {
+        perror("ERROR on binding app unix socket");
+        exit(1);
+    }
+    int connection_backlog = 5;
+    if (listen(app_unix_serverfd, connection_backlog) < 0) {
+        perror("listen()");
+    }
+}
+
+/** Accept a new App client from one of the app server listening sockets
+ * and give it a vacant app connection slot
+ *
+ * @param listen_fd app_serverfd or app_unix_serverfd
+ */
+void app_server_accept(wish_core_t* core, int listen_fd) {
+    int newsockfd = accept(listen_fd, NULL, NULL);
+    if (newsockfd < 0) {
+        /* The client may have gone already, or we are out of fds. Either
+         * way the core keeps running. */
+        perror("on app accept");
+        return;
+    }
+    socket_set_nonblocking(newsockfd);
+    int i = 0;
+    /* Find a vacant app connection "slot" */
+    for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
+        if (app_states[i] == APP_CONNECTION_INITIAL) {
+            // App socketfd: newsockfd
+            app_fds[i] = newsockfd;
+            app_states[i] = APP_CONNECTION_CONNECTED;
+            break;
+        }
+    }
+    if (i >= NUM_APP_CONNECTIONS) {
+        printf("No vacant app connection found!\n");
+        close(newsockfd);
+    }
+}
+
 bool is_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]) {
     bool retval = false;
     int i = 0;
@@ -135,45 +233,212 @@ bool is_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]) {
     return retval;
 }
 
+static ssize_t app_sendv(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof (msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(fd, &msg, APP_SEND_FLAGS);
+}
+
+/* Append the unwritten parts of the given iovecs to the TX queue of
+ * app connection i. Returns false if the queue limit would be exceeded. */
+static bool app_tx_enqueue(int i, struct iovec *iov, int iovcnt, size_t skip) {
+    size_t total = 0;
+    int n;
+    for (n = 0; n < iovcnt; n++) {
+        total += iov[n].iov_len;
+    }
+    total -= skip;
+
+    if (app_tx_queue_bytes[i] + total > APP_TX_QUEUE_MAX_SZ) {
+        WISHDEBUG(LOG_CRITICAL, "App connection %i: TX queue full, dropping %i bytes", i, (int) total);
+        return false;
+    }
+
+    struct app_tx_buf *tx = wish_platform_malloc(sizeof (struct app_tx_buf) + total);
+    if (tx == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "App connection %i: out of memory for TX queue", i);
+        return false;
+    }
+    tx->data = (uint8_t *) (tx + 1);
+    tx->len = total;
+    tx->offset = 0;
+    tx->next = NULL;
+
+    size_t pos = 0;
+    for (n = 0; n < iovcnt; n++) {
+        size_t iov_len = iov[n].iov_len;
+        size_t iov_off = 0;
+        if (skip >= iov_len) {
+            skip -= iov_len;
+            continue;
+        }
+        iov_off = skip;
+        skip = 0;
+        memcpy(tx->data + pos, (uint8_t *) iov[n].iov_base + iov_off, iov_len - iov_off);
+        pos += iov_len - iov_off;
+    }
+
+    LL_APPEND(app_tx_queue[i], tx);
+    app_tx_queue_bytes[i] += total;
+    return true;
+}
+
+static void app_tx_queue_clear(int i) {
+    struct app_tx_buf *tx;
+    struct app_tx_buf *tmp;
+    LL_FOREACH_SAFE(app_tx_queue[i], tx, tmp) {
+        LL_DELETE(app_tx_queue[i], tx);
+        wish_platform_free(tx);
+    }
+    app_tx_queue_bytes[i] = 0;
+}
+
+/* Give up on app connection i after part of a frame was already written
+ * and the rest could not be queued. The stream is out of sync from here
+ * on, so nothing more may be written: drop the queue and shut the socket
+ * down. The read side then sees the connection end and cleans up. */
+static void app_connection_abort(int i) {
+    WISHDEBUG(LOG_CRITICAL, "App connection %i: could not queue rest of frame, closing", i);
+    app_tx_queue_clear(i);
+    shutdown(app_fds[i], SHUT_RDWR);
+}
+
 void send_core_to_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const uint8_t *data, size_t len) {
+    wish_ipc_buf_t buf = { data, len };
+    send_core_to_app_via_tcp_v(core, wsid, &buf, 1);
+}
+
+void send_core_to_app_via_tcp_v(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const wish_ipc_buf_t *bufs, int nbufs) {
     /* Find app index */
     int i = 0;
     for (i = 0; i < NUM_APP_CONNECTIONS; i++) {
         if (memcmp(apps[i].wsid, wsid, WISH_ID_LEN) == 0) {
             /* Found our app connection */
-            
-            uint16_t frame_len =  ((len & 0xff) << 8) | (len >> 8);
-            
-            char* p = (char*)&frame_len;
-            //printf("Found app connection, going to send %lu bytes, setting frame len to 0x%02x%02x\n", len, p[0] & 0xff, p[1] & 0xff);
+            size_t len = 0;
+            int n;
+            for (n = 0; n < nbufs; n++) {
+                len += bufs[n].len;
+            }
 
-            char buf_c[65535];
-            char* buf = buf_c;
-            
-            memcpy(buf, p, 2);
-            memcpy(buf+2, data, len);
-            
-#ifdef __APPLE__
-            ssize_t write_ret = send(app_fds[i], buf, 2+len, SO_NOSIGPIPE);
-#else
-            ssize_t write_ret = send(app_fds[i], buf, 2+len, MSG_NOSIGNAL);
-#endif
-            
-            if (write_ret != 2+len) {
-                //printf("App connection: Write error! (c) Wanted %i got %zd\n", 2, write_ret);
-                //close(app_fds[i]);
+            if (len > 0xffff) {
+                WISHDEBUG(LOG_CRITICAL, "App connection: frame too large for app transport (%i bytes)", (int) len);
+                return;
+            }
+
+            uint8_t frame_len[2] = { (len >> 8) & 0xff, len & 0xff };
+
+            /* The length header and the message parts are written
+             * straight from where they are, without copying into a frame
+             * buffer */
+            struct iovec iov[1 + nbufs];
+            iov[0].iov_base = frame_len;
+            iov[0].iov_len = 2;
+            for (n = 0; n < nbufs; n++) {
+                iov[1 + n].iov_base = (void *) bufs[n].data;
+                iov[1 + n].iov_len = bufs[n].len;
+            }
+
+            if (app_tx_queue[i] != NULL) {
+                /* Earlier data is still waiting, keep the ordering. If
+                 * the frame cannot be queued it is dropped as a whole,
+                 * nothing of it has been written yet. */
+                if (!app_tx_enqueue(i, iov, 1 + nbufs, 0)) {
+                    WISHDEBUG(LOG_CRITICAL, "App connection %i: dropped frame of %i bytes", i, (int) len);
+                }
                 return;
             }
+
+            ssize_t write_ret = app_sendv(app_fds[i], iov, 1 + nbufs);
+
+            if (write_ret < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    /* The read side will notice the broken connection
+                     * and clean up */
+                    return;
+                }
+                write_ret = 0;
+            }
+
+            if (write_ret < 2 + len) {
+                /* Short write, queue the rest until the socket becomes
+                 * writable again */
+                if (!app_tx_enqueue(i, iov, 1 + nbufs, write_ret)) {
+                    if (write_ret > 0) {
+                        app_connection_abort(i);
+                    } else {
+                        WISHDEBUG(LOG_CRITICAL, "App connection %i: dropped frame of %i bytes", i, (int) len);
+                    }
+                }
+            }
             return;
         }
     }
 }
 
+bool app_connection_has_pending_tx(int i) {
+    return app_tx_queue[i] != NULL;
+}
+
+int app_connection_flush(wish_core_t* core, int i) {
+    while (app_tx_queue[i] != NULL) {
+        struct iovec iov[APP_TX_IOV_MAX];
+        int iovcnt = 0;
+        size_t batch_len = 0;
+        struct app_tx_buf *tx;
+
+        LL_FOREACH(app_tx_queue[i], tx) {
+            if (iovcnt == APP_TX_IOV_MAX) {
+                break;
+            }
+            iov[iovcnt].iov_base = tx->data + tx->offset;
+            iov[iovcnt].iov_len = tx->len - tx->offset;
+            batch_len += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
+
+        ssize_t write_ret = app_sendv(app_fds[i], iov, iovcnt);
+        if (write_ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+
+        size_t written = write_ret;
+        app_tx_queue_bytes[i] -= written;
+        while (written > 0 && app_tx_queue[i] != NULL) {
+            tx = app_tx_queue[i];
+            size_t remaining = tx->len - tx->offset;
+            if (written < remaining) {
+                tx->offset += written;
+                break;
+            }
+            written -= remaining;
+            LL_DELETE(app_tx_queue[i], tx);
+            wish_platform_free(tx);
+        }
+
+        if (write_ret < batch_len) {
+            /* The socket did not take everything, wait for next writable */
+            return 0;
+        }
+    }
+    return 0;
+}
 
 void app_connection_feed(wish_core_t* core, int i, uint8_t *buffer, size_t buffer_len) {
     //printf("Feeding %i bytes from app %i\n", (int) buffer_len, i);
     ring_buffer_write(&app_rx_ring_bufs[i], buffer, buffer_len);
+    app_connection_process(core, i);
+}
 
+ring_buffer_t* app_connection_rx_ring_buffer(int i) {
+    return &app_rx_ring_bufs[i];
+}
+
+void app_connection_process(wish_core_t* core, int i) {
 again:
     switch (app_transport_states[i]) {
     case APP_TRANSPORT_INITIAL:
@@ -192,7 +457,7 @@ again:
                     && preamble[2] == 0x18) {
                 printf("Error: App server secure handshake not implemented.\n");
                 app_transport_states[i] = APP_TRANSPORT_CLOSING;
-                break;
+                goto again;
             }
             else if (preamble[0] == 'W' 
                     && preamble[1] == '.' 
@@ -238,6 +503,13 @@ again:
             
             //printf("Received whole frame! len = %i\n", expect_len);
             
+            /* All further parsing of the frame relies on this check */
+            if (bson_check_buffer(payload, expect_len) != BSON_OK) {
+                WISHDEBUG(LOG_CRITICAL, "Malformed payload of %i bytes", expect_len);
+                app_transport_states[i] = APP_TRANSPORT_CLOSING;
+                goto again;
+            }
+            
             if (app_login_complete[i] == false) {
                 /* Snatch WSID */
 
@@ -253,15 +525,6 @@ again:
                 }
             }
             
-            bson bs;
-            bson_init_with_data(&bs, payload);
-            
-            if ( bson_size(&bs) != expect_len ) {
-                WISHDEBUG(LOG_CRITICAL, "Payload size mismatch, %i while expecting %i", bson_size(&bs), expect_len);
-                app_transport_states[i] = APP_TRANSPORT_CLOSING;
-                break;
-            }
-
             receive_app_to_core(core, apps[i].wsid, payload, expect_len);
             if (ring_buffer_length(&app_rx_ring_bufs[i]) >= 2) {
                 goto again;
@@ -271,8 +534,10 @@ again:
         break;
     }
     case APP_TRANSPORT_CLOSING:
-        WISHDEBUG(LOG_CRITICAL, "This transport is in CLOSING state, server is disregarding.");
-        /* FIXME unhandled! */
+        /* Nothing more is read from this app, drop the connection */
+        WISHDEBUG(LOG_CRITICAL, "App connection %i: closing", i);
+        app_connection_cleanup(core, i);
+        close(app_fds[i]);
         break;
     }
 }
@@ -296,4 +561,7 @@ void app_connection_cleanup(wish_core_t* core, int i) {
     /* Empty the ring buffer so that no trashes are left */
     uint16_t len = ring_buffer_length(&app_rx_ring_bufs[i]);
     ring_buffer_skip(&app_rx_ring_bufs[i], len);
+
+    /* Drop anything that was still waiting to be sent to the app */
+    app_tx_queue_clear(i);
 }
@@ -18,10 +18,23 @@
 
 #define APP_RX_RB_SZ 64*1024-1
 
+/* Maximum number of bytes queued for one app connection while its socket
+ * is not writable. Frames exceeding this are dropped. */
+#define APP_TX_QUEUE_MAX_SZ (1024*1024)
+
+/* Maximum number of queued buffers written by one app_connection_flush
+ * system call */
+#define APP_TX_IOV_MAX 16
+
 #include "wish_core.h"
+#include "core_service_ipc.h"
 
 void setup_app_server(wish_core_t* core, uint16_t port);
 
+void setup_app_server_unix(wish_core_t* core, const char* path);
+
+void app_server_accept(wish_core_t* core, int listen_fd);
+
 /* This defines the possible states of an App connection */
 enum app_state { APP_CONNECTION_INITIAL, APP_CONNECTION_CONNECTED };
 
@@ -34,8 +47,30 @@ enum app_transport_state {
 
 void app_connection_feed(wish_core_t* core, int i, uint8_t *buffer, size_t buffer_len);
 
+/** Returns the receive ring buffer of app connection i, so that socket
+ * data can be read into it directly. Call app_connection_process after
+ * adding data. */
+ring_buffer_t* app_connection_rx_ring_buffer(int i);
+
+/** Run the app transport state machine on the data in the receive ring
+ * buffer of app connection i, handling every complete frame */
+void app_connection_process(wish_core_t* core, int i);
+
 void app_connection_cleanup(wish_core_t* core, int i);
 
+/** Returns true if there is data queued for app connection i, which
+ * could not be written yet. The socket should then be selected for
+ * writability. */
+bool app_connection_has_pending_tx(int i);
+
+/** Write queued data to app connection i. Call when the socket is
+ * writable. Returns 0 on success (also when the socket would block) or
+ * -1 if the connection is broken. */
+int app_connection_flush(wish_core_t* core, int i);
+
 void send_core_to_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const uint8_t *data, size_t len);
 
+/** Send a message given in pieces, see send_core_to_app_v */
+void send_core_to_app_via_tcp_v(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const wish_ipc_buf_t *bufs, int nbufs);
+
 bool is_app_via_tcp(wish_core_t* core, const uint8_t wsid[WISH_WSID_LEN]);
@@ -0,0 +1,308 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+
+/* Benchmark of the BSON library on the message shapes of the core:
+ * services.send requests, identity documents and peers lists. Reports
+ * ns/op and allocations/op for each case.
+ *
+ * Usage: bench_bson [min_ms]   (default 200 ms per case) */
+
+#include "wish_port_config.h"
+#include "wish_platform.h"
+#include "bson.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_UID_LEN 32
+#define BENCH_PEERS 32
+#define BENCH_PAYLOAD_MAX (60 * 1024)
+#define BENCH_BUF_SZ (BENCH_PAYLOAD_MAX + 1024)
+
+static long allocs;
+
+static void* counting_malloc(size_t size) {
+    allocs++;
+    return malloc(size);
+}
+
+static void* counting_realloc(void *ptr, size_t size) {
+    allocs++;
+    return realloc(ptr, size);
+}
+
+static uint8_t uid[4][BENCH_UID_LEN];
+static uint8_t payload[BENCH_PAYLOAD_MAX];
+static char buf[BENCH_BUF_SZ];
+static bson_arena arena;
+
+/* Encoded documents for the decoding cases */
+static char send_doc[3][BENCH_BUF_SZ];
+static char identity_doc[1024];
+static char peers_doc[8 * 1024];
+
+static const int payload_lens[3] = { 64, 1024, BENCH_PAYLOAD_MAX };
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Run fn until at least min_ns have passed, doubling the batch size */
+static void bench(const char *name, void (*fn)(int arg), int arg, double min_ns) {
+    long n = 1;
+    long total = 0;
+    double start = now_ns();
+    double elapsed;
+
+    fn(arg);
+    allocs = 0;
+    start = now_ns();
+    do {
+        for (long i = 0; i < n; i++) {
+            fn(arg);
+        }
+        total += n;
+        n *= 2;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_ns);
+
+    printf("%-32s %10.1f ns/op %8.2f allocs/op\n", name, elapsed / total, (double) allocs / total);
+}
+
+/* { req: { op: 'send', args: [ lsid, rsid, protocol, payload ] } } */
+static void encode_send(bson *bs, int len) {
+    bson_append_start_object(bs, "req");
+    bson_append_string(bs, "op", "send");
+    bson_append_start_array(bs, "args");
+    bson_append_binary(bs, "0", uid[0], BENCH_UID_LEN);
+    bson_append_binary(bs, "1", uid[1], BENCH_UID_LEN);
+    bson_append_string(bs, "2", "ucp");
+    bson_append_binary(bs, "3", payload, len);
+    bson_append_finish_array(bs);
+    bson_append_finish_object(bs);
+    bson_finish(bs);
+}
+
+static void identity(bson *bs) {
+    bson_append_string(bs, "alias", "Alice the Tester");
+    bson_append_binary(bs, "uid", uid[0], BENCH_UID_LEN);
+    bson_append_binary(bs, "pubkey", uid[1], BENCH_UID_LEN);
+    bson_append_binary(bs, "privkey", payload, 64);
+    bson_append_start_array(bs, "transports");
+    bson_append_string(bs, "0", "wish://192.168.1.23:37008");
+    bson_append_string(bs, "1", "wish://relay.example.com:40000");
+    bson_append_finish_array(bs);
+    bson_append_start_object(bs, "meta");
+    bson_append_string(bs, "product", "wish-core");
+    bson_append_finish_object(bs);
+    bson_finish(bs);
+}
+
+static void peers(bson *bs) {
+    char index[21];
+    bson_append_start_array(bs, "data");
+    for (int i = 0; i < BENCH_PEERS; i++) {
+        bson_numstrn(index, sizeof (index), i);
+        bson_append_start_object(bs, index);
+        bson_append_binary(bs, "luid", uid[0], BENCH_UID_LEN);
+        bson_append_binary(bs, "ruid", uid[1], BENCH_UID_LEN);
+        bson_append_binary(bs, "rhid", uid[2], BENCH_UID_LEN);
+        bson_append_binary(bs, "rsid", uid[3], BENCH_UID_LEN);
+        bson_append_string(bs, "protocol", "ucp");
+        bson_append_bool(bs, "online", true);
+        bson_append_finish_object(bs);
+    }
+    bson_append_finish_array(bs);
+    bson_finish(bs);
+}
+
+static void encode_send_buffer(int i) {
+    bson bs;
+    bson_init_buffer(&bs, buf, sizeof (buf));
+    encode_send(&bs, payload_lens[i]);
+}
+
+static void encode_send_heap(int i) {
+    bson bs;
+    bson_init(&bs);
+    encode_send(&bs, payload_lens[i]);
+    bson_destroy(&bs);
+}
+
+static void encode_send_arena(int i) {
+    bson bs;
+    bson_init_arena(&bs, &arena, 0);
+    encode_send(&bs, payload_lens[i]);
+    bson_destroy(&bs);
+    bson_arena_reset(&arena);
+}
+
+static const bson_extract_field send_schema[] = {
+    { "req.op", BSON_STRING, 0, 0, 0 },
+    { "req.args.0", BSON_BINDATA, BENCH_UID_LEN, 0, 0 },
+    { "req.args.1", BSON_BINDATA, BENCH_UID_LEN, 0, 0 },
+    { "req.args.2", BSON_STRING, 0, 0, 0 },
+    { "req.args.3", BSON_BINDATA, 0, 0, 0 },
+};
+
+static void decode_send(int i) {
+    bson_iterator out[5];
+    const char *doc = send_doc[i];
+    bson bs;
+
+    if (bson_init_checked(&bs, doc, bson_size2(doc)) != BSON_OK
+            || bson_extract(doc, send_schema, 5, out) != -1) {
+        fprintf(stderr, "decode_send failed\n");
+        exit(1);
+    }
+}
+
+static void encode_identity(int unused) {
+    bson bs;
+    bson_init_buffer(&bs, buf, sizeof (buf));
+    identity(&bs);
+}
+
+static void decode_identity(int unused) {
+    static const bson_path paths[] = {
+        { 1, { BSON_PATH_KEY("alias") } },
+        { 1, { BSON_PATH_KEY("uid") } },
+        { 1, { BSON_PATH_KEY("pubkey") } },
+        { 2, { BSON_PATH_KEY("transports"), BSON_PATH_KEY("0") } },
+        { 2, { BSON_PATH_KEY("meta"), BSON_PATH_KEY("product") } },
+    };
+    bson_iterator it;
+
+    for (int i = 0; i < 5; i++) {
+        bson_iterator_from_buffer(&it, identity_doc);
+        if (bson_find_path(&paths[i], &it) == BSON_EOO) {
+            fprintf(stderr, "decode_identity failed\n");
+            exit(1);
+        }
+    }
+}
+
+static void decode_identity_fieldpath(int unused) {
+    static const char *paths[] = { "alias", "uid", "pubkey", "transports.0", "meta.product" };
+    bson_iterator it;
+
+    for (int i = 0; i < 5; i++) {
+        bson_iterator_from_buffer(&it, identity_doc);
+        if (bson_find_fieldpath_value(paths[i], &it) == BSON_EOO) {
+            fprintf(stderr, "decode_identity_fieldpath failed\n");
+            exit(1);
+        }
+    }
+}
+
+static void encode_peers(int unused) {
+    bson bs;
+    bson_init_buffer(&bs, buf, sizeof (buf));
+    peers(&bs);
+}
+
+/* Walk all peers like the peers reply handlers do */
+static void decode_peers(int unused) {
+    bson_iterator it;
+    bson_iterator sit;
+    bson_iterator pit;
+    int n = 0;
+
+    bson_iterator_from_buffer(&it, peers_doc);
+    if (bson_find_fieldpath_value("data", &it) != BSON_ARRAY) {
+        exit(1);
+    }
+    bson_iterator_subiterator(&it, &sit);
+    while (bson_iterator_next(&sit) == BSON_OBJECT) {
+        bson_iterator_subiterator(&sit, &pit);
+        while (bson_iterator_next(&pit) != BSON_EOO) {
+            n++;
+        }
+    }
+    if (n != BENCH_PEERS * 6) {
+        fprintf(stderr, "decode_peers failed\n");
+        exit(1);
+    }
+}
+
+static void check_peers(int unused) {
+    if (bson_check_buffer(peers_doc, bson_size2(peers_doc)) != BSON_OK) {
+        fprintf(stderr, "check_peers failed\n");
+        exit(1);
+    }
+}
+
+static void copy_doc(char *dst, size_t dst_len, bson *bs) {
+    if (bs->err || (size_t) bson_size(bs) > dst_len) {
+        fprintf(stderr, "Could not build document\n");
+        exit(1);
+    }
+    memcpy(dst, bson_data(bs), bson_size(bs));
+}
+
+int main(int argc, char** argv) {
+    double min_ns = (argc > 1 ? atof(argv[1]) : 200) * 1e6;
+    bson bs;
+
+    wish_platform_set_malloc(counting_malloc);
+    wish_platform_set_realloc(counting_realloc);
+    wish_platform_set_free(free);
+    wish_platform_set_vsprintf(vsprintf);
+
+    for (int i = 0; i < 4; i++) {
+        memset(uid[i], 0x11 * (i + 1), BENCH_UID_LEN);
+    }
+    for (int i = 0; i < BENCH_PAYLOAD_MAX; i++) {
+        payload[i] = i;
+    }
+    bson_arena_init(&arena, 4 * 1024);
+
+    for (int i = 0; i < 3; i++) {
+        bson_init_buffer(&bs, buf, sizeof (buf));
+        encode_send(&bs, payload_lens[i]);
+        copy_doc(send_doc[i], sizeof (send_doc[i]), &bs);
+    }
+    bson_init_buffer(&bs, buf, sizeof (buf));
+    identity(&bs);
+    copy_doc(identity_doc, sizeof (identity_doc), &bs);
+    bson_init_buffer(&bs, buf, sizeof (buf));
+    peers(&bs);
+    copy_doc(peers_doc, sizeof (peers_doc), &bs);
+
+    bench("send 64B encode (buffer)", encode_send_buffer, 0, min_ns);
+    bench("send 1KiB encode (buffer)", encode_send_buffer, 1, min_ns);
+    bench("send 60KiB encode (buffer)", encode_send_buffer, 2, min_ns);
+    bench("send 64B encode (heap)", encode_send_heap, 0, min_ns);
+    bench("send 60KiB encode (heap)", encode_send_heap, 2, min_ns);
+    bench("send 64B encode (arena)", encode_send_arena, 0, min_ns);
+    bench("send 60KiB encode (arena)", encode_send_arena, 2, min_ns);
+    bench("send 64B check+extract", decode_send, 0, min_ns);
+    bench("send 1KiB check+extract", decode_send, 1, min_ns);
+    bench("send 60KiB check+extract", decode_send, 2, min_ns);
+    bench("identity encode", encode_identity, 0, min_ns);
+    bench("identity 5 fields (path)", decode_identity, 0, min_ns);
+    bench("identity 5 fields (fieldpath)", decode_identity_fieldpath, 0, min_ns);
+    bench("peers 32 encode", encode_peers, 0, min_ns);
+    bench("peers 32 iterate", decode_peers, 0, min_ns);
+    bench("peers 32 check", check_peers, 0, min_ns);
+
+    bson_arena_destroy(&arena);
+    return 0;
+}
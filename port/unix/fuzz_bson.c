@@ -0,0 +1,148 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+
+/* Fuzz harness for the BSON parser. Input goes through bson_check_buffer
+ * like every message entering the core, and documents that pass are
+ * walked with the iterators and lookups used by the core.
+ *
+ * With BSON_FUZZ_LIBFUZZER defined, only LLVMFuzzerTestOneInput is
+ * provided. Otherwise main() runs each file given on the command line,
+ * or stdin when there are none, which is what AFL expects.
+ *
+ * Seed corpus: port/unix/fuzz_bson_corpus */
+
+#include "wish_port_config.h"
+#include "wish_platform.h"
+#include "bson.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#define FUZZ_INPUT_MAX (64 * 1024)
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void walk(bson_iterator *it) {
+    bson_type t;
+    bson_iterator sub;
+
+    while ((t = bson_iterator_next(it)) != BSON_EOO) {
+        /* Touch the key and the value bytes */
+        volatile size_t klen = strlen(bson_iterator_key(it));
+        (void) klen;
+
+        switch (t) {
+            case BSON_STRING:
+                if (bson_iterator_string_len(it) > 0) {
+                    volatile char c = bson_iterator_string(it)[bson_iterator_string_len(it) - 1];
+                    (void) c;
+                }
+                break;
+            case BSON_BINDATA:
+                if (bson_iterator_bin_len(it) > 0) {
+                    volatile char c = bson_iterator_bin_data(it)[bson_iterator_bin_len(it) - 1];
+                    (void) c;
+                }
+                break;
+            case BSON_OBJECT:
+            case BSON_ARRAY:
+                bson_iterator_subiterator(it, &sub);
+                walk(&sub);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static const bson_extract_field send_schema[] = {
+    { "req.op", BSON_STRING, 0, 0, 0 },
+    { "req.args.0", BSON_BINDATA, 32, 0, BSON_EXTRACT_OPTIONAL },
+    { "req.args.2", BSON_STRING, 0, 64, BSON_EXTRACT_OPTIONAL },
+    { "req.args.3", BSON_BINDATA, 0, 0, BSON_EXTRACT_OPTIONAL },
+};
+
+static const bson_path data_rsid_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("rsid") } };
+
+static void fuzz_init(void) {
+    wish_platform_set_malloc(malloc);
+    wish_platform_set_realloc(realloc);
+    wish_platform_set_free(free);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    bson_iterator it;
+    bson_iterator out[4];
+    bson bs;
+
+    if (size < 5 || size > FUZZ_INPUT_MAX) {
+        return 0;
+    }
+
+    /* Exact size copy, so that reads past the input are detected */
+    char *doc = malloc(size);
+    memcpy(doc, data, size);
+
+    if (bson_init_checked(&bs, doc, size) == BSON_OK) {
+        bson_iterator_from_buffer(&it, doc);
+        walk(&it);
+
+        bson_find_from_buffer(&it, doc, "transports");
+        bson_iterator_from_buffer(&it, doc);
+        bson_find_fieldpath_value("0.luid", &it);
+        bson_iterator_from_buffer(&it, doc);
+        bson_find_path(&data_rsid_path, &it);
+        bson_extract(doc, send_schema, 4, out);
+    }
+
+    free(doc);
+    return 0;
+}
+
+#ifdef BSON_FUZZ_LIBFUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+    fuzz_init();
+    return 0;
+}
+#else
+static int run_file(FILE *f) {
+    static uint8_t buf[FUZZ_INPUT_MAX + 1];
+    size_t len = fread(buf, 1, sizeof (buf), f);
+    return LLVMFuzzerTestOneInput(buf, len);
+}
+
+int main(int argc, char** argv) {
+    fuzz_init();
+
+    if (argc < 2) {
+        return run_file(stdin);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        run_file(f);
+        fclose(f);
+    }
+    return 0;
+}
+#endif
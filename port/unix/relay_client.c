@@ -50,6 +50,11 @@ void wish_relay_client_open(wish_core_t* core, wish_relay_client_t* relay, uint8
      * components. For example, setting up the RB, next state, expect
      * byte, copying of id is generic to all ports */
     relay->curr_state = WISH_RELAY_CLIENT_CONNECTING;
+    
+    /* Timestamp for measuring the connect time, see app.c */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    relay->connect_started_ms = (uint32_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
     ring_buffer_init(&(relay->rx_ringbuf), relay->rx_ringbuf_storage, RELAY_CLIENT_RX_RB_LEN);
     memcpy(relay->uid, uid, WISH_ID_LEN);
 
@@ -114,3 +114,28 @@ void send_core_to_app(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const
 #endif
 }
 
+void send_core_to_app_v(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const wish_ipc_buf_t *bufs, int nbufs) {
+#ifdef WITH_APP_TCP_SERVER
+    if (is_app_via_tcp(core, wsid)) {
+        send_core_to_app_via_tcp_v(core, wsid, bufs, nbufs);
+        return;
+    }
+#endif
+    /* Other apps get the message in one piece */
+    size_t len = 0;
+    for (int i = 0; i < nbufs; i++) {
+        len += bufs[i].len;
+    }
+    if (len == 0) {
+        WISHDEBUG(LOG_CRITICAL, "send_core_to_app_v with data length 0!");
+        return;
+    }
+
+    uint8_t buf[len];
+    size_t pos = 0;
+    for (int i = 0; i < nbufs; i++) {
+        memcpy(buf + pos, bufs[i].data, bufs[i].len);
+        pos += bufs[i].len;
+    }
+    send_core_to_app(core, wsid, buf, len);
+}
@@ -98,11 +98,47 @@ int main(int argc, char** argv) {
 
     bson_visit("result:", bson_data(&bi));
     
-    bson_destroy(&update);
-    
     if (bi.err) {
         WISHDEBUG(LOG_CRITICAL, "We got an error while in bson_insert_string. %s", bson_first_errormsg(&bi));
     }
     
+    bson_destroy(&bi);
+    
+    /* bson_update on an arena bson must leave it owned by the arena, or
+     * bson_destroy would free() a pointer into the arena block. Both at
+     * arena offset 0 and after another allocation. */
+    bson_arena arena;
+    bson_arena_init(&arena, 4 * 1024);
+    
+    for (int i = 0; i < 2; i++) {
+        bson other;
+        if (i == 1) {
+            bson_init_arena(&other, &arena, 64);
+        }
+        
+        bson meta;
+        bson_init_arena(&meta, &arena, 0);
+        bson_finish(&meta);
+        
+        bson_update(&meta, &update);
+        
+        bson_iterator it;
+        if (!(meta.flags & BSON_FLAG_ARENA) || meta.arena != &arena 
+                || bson_find(&it, &meta, "fees") != BSON_OBJECT) 
+        {
+            WISHDEBUG(LOG_CRITICAL, "bson_update lost the arena of the bson (pass %i)", i);
+            return 1;
+        }
+        
+        bson_destroy(&meta);
+        if (i == 1) {
+            bson_destroy(&other);
+        }
+        bson_arena_reset(&arena);
+    }
+    
+    bson_arena_destroy(&arena);
+    bson_destroy(&update);
+    
     return 0;
 }
@@ -29,9 +29,26 @@
 /** This specifies the maximum size of the buffer where some RPC handlers build the reply (1400) */
 #define WISH_PORT_RPC_BUFFER_SZ ( 16*1024 )
 
+/** This specifies the initial size of the core's bson arena, where replies are built. It grows to the peak demand seen (4096) */
+#define WISH_PORT_BSON_ARENA_SZ ( 16*1024 )
+
 /** This defines the maximum number of entries in the Wish local discovery table (4).
  * You should make sure that in the worst case any message will fit into WISH_PORT_RPC_BUFFFER_SZ  */
-#define WISH_LOCAL_DISCOVERY_MAX ( 64 ) /* wld.list: 64 local discoveries should fit in 16k RPC buffer size */
+#define WISH_LOCAL_DISCOVERY_MAX ( 256 ) /* wld.list leaves out the entries which do not fit in the 64k app frame */
+
+/** Local discovery receive: the maximum number of datagrams read per event loop round */
+#define WISH_PORT_WLD_BATCH ( 16 )
+
+/** Local discovery receive: the number of source addresses tracked for rate limiting */
+#define WISH_PORT_WLD_SOURCES ( 32 )
+
+/** Local discovery receive: adverts accepted per second per source address, and the burst allowed.
+ * A core sends one advert per identity every 5 seconds, so the burst should cover its identities */
+#define WISH_PORT_WLD_RATE ( 8 )
+#define WISH_PORT_WLD_BURST ( 32 )
+
+/** Local discovery receive: identical adverts from one source within this many milliseconds are dropped */
+#define WISH_PORT_WLD_DEDUP_MS ( 1000 )
 
 /** This defines the maximum number of uids in database (max number of identities + contacts) (4) 
      You should make sure that in the worst case any message will fit into WISH_PORT_RPC_BUFFFER_SZ */
@@ -31,5 +31,16 @@ void receive_app_to_core(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], con
 /* wsid: the id the app which should receive the data */
 void send_core_to_app(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const uint8_t *data, size_t len);
 
+/* One part of a message passed in pieces to send_core_to_app_v */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} wish_ipc_buf_t;
+
+/* Like send_core_to_app, but the message is the concatenation of the
+ * nbufs buffers, which lets a payload be forwarded without copying it
+ * into a new message. The buffers are not used after the call returns. */
+void send_core_to_app_v(wish_core_t* core, const uint8_t wsid[WISH_ID_LEN], const wish_ipc_buf_t *bufs, int nbufs);
+
 void core_service_ipc_init(wish_core_t* core);
 
@@ -113,5 +113,26 @@ uint16_t ring_buffer_peek(ring_buffer_t* buf, uint8_t* data, uint16_t len) {
     return read;
 }
 
+uint16_t ring_buffer_write_span(ring_buffer_t* buf, uint8_t** ptr) {
+    uint16_t cursor = (buf->read+buf->data_len)%buf->max_len;
+    uint16_t space = ring_buffer_space(buf);
+    uint16_t to_end = buf->max_len - cursor;
+    *ptr = &buf->data[cursor];
+    return space < to_end ? space : to_end;
+}
 
+uint16_t ring_buffer_write_span_wrapped(ring_buffer_t* buf, uint8_t** ptr) {
+    uint8_t* first;
+    uint16_t first_len = ring_buffer_write_span(buf, &first);
+    *ptr = buf->data;
+    return ring_buffer_space(buf) - first_len;
+}
 
+uint16_t ring_buffer_write_commit(ring_buffer_t* buf, uint16_t len) {
+    uint16_t space = ring_buffer_space(buf);
+    if (len > space) {
+        len = space;
+    }
+    buf->data_len += len;
+    return len;
+}
@@ -84,6 +84,39 @@ uint16_t ring_buffer_skip(ring_buffer_t*  buf, uint16_t len);
 
 uint16_t ring_buffer_peek(ring_buffer_t*  buf, uint8_t* data, uint16_t len);
 
+/**
+ * Get the contiguous free area starting at the write cursor
+ * 
+ * Data can be placed there directly (e.g. by read() from a socket), and
+ * then made part of the buffer with ring_buffer_write_commit. When the
+ * free space wraps around the end of the memory, the rest of it starts at
+ * buf->data, see ring_buffer_write_span_wrapped.
+ * 
+ * @param buf
+ * @param ptr set to the start of the free area
+ * @return the length of the contiguous free area
+ */
+uint16_t ring_buffer_write_span(ring_buffer_t*  buf, uint8_t** ptr);
+
+/**
+ * Get the part of the free space which wraps around to the start of the
+ * memory, ie. what follows the area returned by ring_buffer_write_span
+ * 
+ * @param buf
+ * @param ptr set to the start of the wrapped free area
+ * @return the length of the wrapped free area, 0 if the free space does not wrap
+ */
+uint16_t ring_buffer_write_span_wrapped(ring_buffer_t*  buf, uint8_t** ptr);
+
+/**
+ * Commit len bytes which were placed in the free area directly
+ * 
+ * @param buf
+ * @param len
+ * @return number of bytes committed, limited by the free space
+ */
+uint16_t ring_buffer_write_commit(ring_buffer_t*  buf, uint16_t len);
+
 /* This function returns the smaller of two values */
 uint16_t min(uint16_t a, uint16_t b);
 
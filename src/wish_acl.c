@@ -105,7 +105,7 @@ void wish_api_acl_user_roles(rpc_server_req* req, const uint8_t* args) {
     wish_acl_role_t* tmp;
 
     bson bs;
-    bson_init(&bs);
+    bson_init_arena(&bs, &core->arena, 512);
     
     bson_append_start_array(&bs, "data");
     
@@ -20,6 +20,10 @@
 #include "wish_debug.h"
 #include "bson_visit.h"
 
+/* Paths into the peer argument { luid, ruid, rhid } */
+static const bson_path peer_luid_path = { 2, { BSON_PATH_KEY("0"), BSON_PATH_KEY("luid") } };
+static const bson_path peer_ruid_path = { 2, { BSON_PATH_KEY("0"), BSON_PATH_KEY("ruid") } };
+static const bson_path peer_rhid_path = { 2, { BSON_PATH_KEY("0"), BSON_PATH_KEY("rhid") } };
 /**
  * connections.list
  * 
@@ -56,6 +60,9 @@ void wish_api_connections_list(rpc_server_req* req, const uint8_t* args) {
             //bson_append_bool(&bs, "online", true);
             bson_append_bool(&bs, "outgoing", db[i].outgoing);
             bson_append_bool(&bs, "relay", db[i].via_relay);
+            if (db[i].rtt_ms != 0) {
+                bson_append_int(&bs, "rtt", db[i].rtt_ms);
+            }
             //bson_append_bool(&bs, "authenticated", true);
             /*
             bson_append_start_object(&bs, "transport");
@@ -134,7 +141,7 @@ void wish_api_connections_request(rpc_server_req* req, const uint8_t* args) {
     
     bson_iterator_from_buffer(&it, args);
     
-    if (bson_find_fieldpath_value("0.luid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&peer_luid_path, &it) != BSON_BINDATA) {
         rpc_server_error_msg(req, 307, "Argument 1 not Buffer.");
         return;
     }
@@ -149,7 +156,7 @@ void wish_api_connections_request(rpc_server_req* req, const uint8_t* args) {
 
     bson_iterator_from_buffer(&it, args);
 
-    if (bson_find_fieldpath_value("0.ruid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&peer_ruid_path, &it) != BSON_BINDATA) {
         rpc_server_error_msg(req, 307, "Argument 2 not Buffer.");
         return;
     }
@@ -164,7 +171,7 @@ void wish_api_connections_request(rpc_server_req* req, const uint8_t* args) {
 
     bson_iterator_from_buffer(&it, args);
 
-    if (bson_find_fieldpath_value("0.rhid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&peer_rhid_path, &it) != BSON_BINDATA) {
         rpc_server_error_msg(req, 307, "Argument 3 not Buffer.");
         return;
     }
@@ -341,7 +348,7 @@ void wish_api_connections_apps(rpc_server_req* req, const uint8_t* args) {
     
     bson_iterator_from_buffer(&it, args);
     
-    if (bson_find_fieldpath_value("0.luid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&peer_luid_path, &it) != BSON_BINDATA) {
         rpc_server_error_msg(req, 307, "Argument 1 not Buffer.");
         return;
     }
@@ -356,7 +363,7 @@ void wish_api_connections_apps(rpc_server_req* req, const uint8_t* args) {
 
     bson_iterator_from_buffer(&it, args);
 
-    if (bson_find_fieldpath_value("0.ruid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&peer_ruid_path, &it) != BSON_BINDATA) {
         rpc_server_error_msg(req, 307, "Argument 2 not Buffer.");
         return;
     }
@@ -371,7 +378,7 @@ void wish_api_connections_apps(rpc_server_req* req, const uint8_t* args) {
 
     bson_iterator_from_buffer(&it, args);
 
-    if (bson_find_fieldpath_value("0.rhid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&peer_rhid_path, &it) != BSON_BINDATA) {
         rpc_server_error_msg(req, 307, "Argument 3 not Buffer.");
         return;
     }
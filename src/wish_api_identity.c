@@ -23,6 +23,7 @@
 #include "core_service_ipc.h"
 #include "wish_relationship.h"
 #include "wish_dispatcher.h"
+#include "wish_peer_state.h"
 #include "wish_platform.h"
 #include "wish_debug.h"
 #include "string.h"
@@ -190,13 +191,14 @@ void wish_api_identity_import(rpc_server_req* req, const uint8_t* args) {
  *
  */
 void wish_api_identity_list(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = req->server->context;
     
     int num_uids_in_db = wish_get_num_uid_entries();
     wish_uid_list_elem_t uid_list[num_uids_in_db];
     int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
 
     bson bs; 
-    bson_init(&bs);
+    bson_init_arena(&bs, &core->arena, 64 + num_uids * (WISH_UID_LEN + WISH_ALIAS_LEN + 32));
     bson_append_start_array(&bs, "data");
     
     int i = 0;
@@ -211,6 +213,7 @@ void wish_api_identity_list(rpc_server_req* req, const uint8_t* args) {
             WISHDEBUG(LOG_CRITICAL, "Could not load identity");
             rpc_server_error_msg(req, 997, "Could not load identity");
             wish_identity_destroy(&identity);
+            bson_destroy(&bs);
             return;
         }
 
@@ -254,10 +257,11 @@ void wish_api_identity_list(rpc_server_req* req, const uint8_t* args) {
  *  private key and public key)
  */
 void wish_api_identity_get(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = req->server->context;
     WISHDEBUG(LOG_DEBUG, "In identity_get_handler");
 
     bson bs; 
-    bson_init(&bs);
+    bson_init_arena(&bs, &core->arena, 512);
     bson_append_start_object(&bs, "data");
     
     bson_iterator it;
@@ -428,12 +432,8 @@ void wish_api_identity_create(rpc_server_req* req, const uint8_t* args) {
     wish_ldiscover_advertize(core, id.uid);
     wish_report_identity_to_local_services(core, &id, true);
     
-    
-    wish_relay_client_t* relay;
-
-    LL_FOREACH(core->relay_db, relay) {
-        wish_relay_client_open(core, relay, id.uid);
-    }
+    /* The relay sessions of the new identity were added by
+     * wish_core_update_identities, and open on the next relay tick */
     
     wish_core_signals_emit_string(core, "identity");
 }
@@ -499,14 +499,14 @@ void wish_api_identity_update(rpc_server_req* req, const uint8_t* args) {
     if (id.meta) {
         bson_init_with_data(&meta, id.meta);
     } else {
-        bson_init(&meta);
+        bson_init_arena(&meta, &core->arena, 256);
         bson_finish(&meta);
         meta_created = true;
     }
 
     // create the update query object from iterator pointing at update parameter object
     bson update;
-    bson_init(&update);
+    bson_init_arena(&update, &core->arena, 256);
     bson_append_iterator(&update, &it);
     bson_finish(&update);
     
@@ -593,16 +593,9 @@ void wish_api_identity_remove(rpc_server_req* req, const uint8_t* args) {
             return;
         }
 
+        /* Also closes the relay sessions of the removed identity */
         wish_core_update_identities(core);
         
-        wish_relay_client_t* relay;
-
-        LL_FOREACH(core->relay_db, relay) {
-            if (memcmp(relay->uid, uid, WISH_UID_LEN) == 0) {
-                wish_relay_client_close(core, relay);
-            }
-        }
-        
         if (wish_service_exists(core, req->context) == NULL) {
             if (wish_connection_is_from_pool(core, req->ctx) != NULL) {
                 wish_connection_t *conn = req->ctx;
@@ -667,14 +660,14 @@ void wish_api_identity_permissions(rpc_server_req* req, const uint8_t* args) {
     if (id.permissions) {
         bson_init_with_data(&permissions, id.permissions);
     } else {
-        bson_init(&permissions);
+        bson_init_arena(&permissions, &core->arena, 256);
         bson_finish(&permissions);
         permissions_created = true;
     }
 
     // create the update query object from iterator pointing at update parameter object
     bson update;
-    bson_init(&update);
+    bson_init_arena(&update, &core->arena, 256);
     bson_append_iterator(&update, &it);
     bson_finish(&update);
     
@@ -1325,7 +1318,9 @@ static return_t wish_ldiscover_entry_from_bson(const char* signed_meta, wish_ldi
     bson_iterator_init(&it, &data);
     bson_find_fieldpath_value("transports.0", &it);
     if (bson_iterator_type(&it) != BSON_STRING) { return RET_E_INVALID_INPUT; }
-    wish_parse_transport_ip_port(bson_iterator_string(&it), bson_iterator_string_len(&it), &out->transport_ip, &out->transport_port);
+    if (wish_parse_transport_ip_port(bson_iterator_string(&it), bson_iterator_string_len(&it), &out->transports[0].ip, &out->transports[0].port) == 0) {
+        out->num_transports = 1;
+    }
     
     out->timestamp = UINT32_MAX;
     
@@ -1675,6 +1670,9 @@ void wish_report_identity_to_local_services(wish_core_t* core, wish_identity_t*
     uint8_t local_hostid[WISH_WHID_LEN];
     wish_core_get_host_id(core, local_hostid);
     struct wish_service_entry *service_registry = wish_service_get_registry(core);
+    
+    wish_peer_t peer = { .luid = identity->uid, .ruid = identity->uid, .rhid = local_hostid, .local = true };
+    
     int i = 0;
     for (i = 0; i < WISH_MAX_SERVICES; i++) {
         if (wish_service_entry_is_valid(core, &(service_registry[i]))) {
@@ -1682,34 +1680,10 @@ void wish_report_identity_to_local_services(wish_core_t* core, wish_identity_t*
             for (j = 0; j < WISH_MAX_SERVICES; j++) {
                 if (wish_service_entry_is_valid(core, &(service_registry[j]))) {
                     if (memcmp(service_registry[i].wsid, service_registry[j].wsid, WISH_WSID_LEN) != 0) {
-                        
-                        bson bs;
-                        int buffer_len = 2 * WISH_ID_LEN + WISH_WSID_LEN + WISH_WHID_LEN + WISH_PROTOCOL_NAME_MAX_LEN + 200;
-                        uint8_t buffer[buffer_len];
-                        bson_init_buffer(&bs, buffer, buffer_len);
-
-                        bson_append_string(&bs, "type", "peer");
-                        bson_append_start_object(&bs, "peer");
-                        bson_append_binary(&bs, "luid", (uint8_t*) identity->uid, WISH_ID_LEN);
-                        bson_append_binary(&bs, "ruid", (uint8_t*) identity->uid, WISH_ID_LEN);
-                        bson_append_binary(&bs, "rsid", (uint8_t*) service_registry[j].wsid, WISH_WSID_LEN);
-                        bson_append_binary(&bs, "rhid", (uint8_t*) local_hostid, WISH_ID_LEN);
+                        peer.rsid = service_registry[j].wsid;
                         /* FIXME support more protocols than just one */
-                        bson_append_string(&bs, "protocol", service_registry[j].protocols[0].name);
-                        bson_append_string(&bs, "type", "N");   /* FIXME will be type:"D" someday when deleting identity? */
-                        bson_append_bool(&bs, "online", online);
-                        bson_append_finish_object(&bs);
-
-                        bson_finish(&bs);
-                        
-                        if (bs.err) {
-                            WISHDEBUG(LOG_CRITICAL, "BSON error when creating peer message: %i %s len %i", bs.err, bs.errstr, bs.dataSize);
-                        }
-                        else {
-                            //WISHDEBUG(LOG_CRITICAL, "wish_core_app_rpc_func: Sending online message to app %s:", service_registry[i].name);
-                            //bson_visit("Sending peer message to app:", buffer);
-                            send_core_to_app(core, service_registry[i].wsid, (uint8_t *) bson_data(&bs), bson_size(&bs));
-                        }
+                        peer.protocol = (const char*) service_registry[j].protocols[0].name;
+                        wish_peer_state_set(core, service_registry[i].wsid, &peer, online);
                     }
                 }
             }
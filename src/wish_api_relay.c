@@ -39,6 +39,8 @@ void wish_api_relay_list(rpc_server_req* req, const uint8_t* args) {
     int i = 0;
     
     LL_FOREACH(core->relay_db, relay) {
+        if (relay->secondary) { continue; }
+        
         char index[21];
         BSON_NUMSTR(index, i);
         
@@ -49,6 +51,10 @@ void wish_api_relay_list(rpc_server_req* req, const uint8_t* args) {
         bson_append_start_object(&bs, index);
         bson_append_string(&bs, "host", host);
         bson_append_bool(&bs, "connected", relay->curr_state == WISH_RELAY_CLIENT_WAIT);
+        if (relay->rtt_ms != 0) {
+            bson_append_int(&bs, "rtt", relay->rtt_ms);
+        }
+        bson_append_int(&bs, "failures", relay->failures);
         bson_append_finish_object(&bs);
     }
     
@@ -128,7 +134,7 @@ void wish_api_relay_remove(rpc_server_req* req, const uint8_t* args) {
     bool found = false;
     
     LL_FOREACH_SAFE(core->relay_db, relay, tmp) {
-        if ( memcmp(&relay->ip.addr, &ctx.ip.addr, 4) != 0 || relay->port != ctx.port ) { continue; }
+        if ( !wish_transport_addr_equal(&relay->ip, relay->port, &ctx.ip, ctx.port) ) { continue; }
 
         found = true;
         
@@ -20,6 +20,242 @@
 #include "wish_debug.h"
 #include "string.h"
 #include "bson_visit.h"
+#include "wish_platform.h"
+#include "wish_wire.h"
+#include "wish_peer_state.h"
+
+/* Peer document fields, pointing into the RPC args buffer */
+typedef struct {
+    const uint8_t* luid;
+    const uint8_t* ruid;
+    const uint8_t* rhid;
+    const uint8_t* rsid;
+    const char* protocol;
+    int protocol_len;
+} wish_service_peer_t;
+
+/* Schema of the services.send args: the peer document and the payload,
+ * which is optional so that the same parsing serves services.openChannel */
+static const bson_extract_field services_peer_schema[] = {
+    { .fpath = "0.luid", .type = BSON_BINDATA, .len = WISH_UID_LEN },
+    { .fpath = "0.ruid", .type = BSON_BINDATA, .len = WISH_UID_LEN },
+    { .fpath = "0.rhid", .type = BSON_BINDATA, .len = WISH_UID_LEN },
+    { .fpath = "0.rsid", .type = BSON_BINDATA, .len = WISH_UID_LEN },
+    { .fpath = "0.protocol", .type = BSON_STRING, .maxlen = WISH_PROTOCOL_NAME_MAX_LEN },
+    { .fpath = "1", .type = BSON_BINDATA, .flags = BSON_EXTRACT_OPTIONAL },
+};
+
+enum { PEER_LUID, PEER_RUID, PEER_RHID, PEER_RSID, PEER_PROTOCOL, PEER_PAYLOAD, PEER_FIELDS };
+
+/* Parse the peer document found at args[0], and the payload at args[1]
+ * when present. On error an RPC error is sent and false is returned. */
+static bool services_parse_peer(rpc_server_req* req, const uint8_t* args, wish_service_peer_t* peer, bson_iterator* payload) {
+    static const char* names[] = { "luid", "ruid", "rhid", "rsid", "protocol" };
+    bson_iterator it[PEER_FIELDS];
+    
+    int err = bson_extract(args, services_peer_schema, PEER_FIELDS, it);
+    
+    if (err == PEER_PAYLOAD) {
+        rpc_server_error_msg(req, 311, "Invalid payload.");
+        return false;
+    } else if (err >= 0) {
+        char msg[64];
+        if (bson_iterator_type(&it[err]) != services_peer_schema[err].type) {
+            wish_platform_sprintf(msg, "Invalid peer. (%s not %s)", names[err], err == PEER_PROTOCOL ? "BSON_STRING" : "BSON_BINDATA");
+        } else {
+            wish_platform_sprintf(msg, "Invalid peer. (%s%s length)", names[err], err == PEER_PROTOCOL ? " name" : "");
+        }
+        rpc_server_error_msg(req, 311, msg);
+        return false;
+    }
+    
+    peer->luid = bson_iterator_bin_data(&it[PEER_LUID]);
+    peer->ruid = bson_iterator_bin_data(&it[PEER_RUID]);
+    peer->rhid = bson_iterator_bin_data(&it[PEER_RHID]);
+    peer->rsid = bson_iterator_bin_data(&it[PEER_RSID]);
+    peer->protocol = bson_iterator_string(&it[PEER_PROTOCOL]);
+    peer->protocol_len = bson_iterator_string_len(&it[PEER_PROTOCOL]);
+    
+    if (payload != NULL) {
+        *payload = it[PEER_PAYLOAD];
+    }
+    
+    return true;
+}
+
+/* Encode the message header of a channel: everything of the frame up to
+ * the payload, see wish_wire_finish */
+static bool channel_build_header(wish_core_t* core, wish_service_channel_t* channel) {
+    bool ok;
+    
+    if (channel->local) {
+        /* Frame to a local service, see wish_api_services_send. luid and
+         * ruid switch places */
+        ok = wish_wire_frame_header(&channel->header, channel->ruid, channel->luid, channel->rhid, channel->wsid, channel->protocol);
+    } else {
+        /* req: { op: 'send', args: [ lsid, rsid, protocol, payload ] } */
+        ok = wish_wire_send_header(&channel->header, channel->wsid, channel->rsid, channel->protocol);
+    }
+    
+    if (!ok) {
+        WISHDEBUG(LOG_CRITICAL, "Error creating channel header");
+    }
+    return ok;
+}
+
+/* Return a connected connection for a remote channel, revalidating the
+ * cached one first */
+static wish_connection_t* channel_connection(wish_core_t* core, wish_service_channel_t* channel) {
+    wish_connection_t* connection = channel->connection;
+    
+    if (connection != NULL 
+            && connection->context_state == WISH_CONTEXT_CONNECTED
+            && memcmp(connection->luid, channel->luid, WISH_UID_LEN) == 0
+            && memcmp(connection->ruid, channel->ruid, WISH_UID_LEN) == 0
+            && memcmp(connection->rhid, channel->rhid, WISH_WHID_LEN) == 0) {
+        return connection;
+    }
+    
+    connection = wish_core_lookup_connected_ctx_by_luid_ruid_rhid(core, channel->luid, channel->ruid, channel->rhid);
+    if (connection != NULL && connection->context_state != WISH_CONTEXT_CONNECTED) {
+        connection = NULL;
+    }
+    channel->connection = connection;
+    return connection;
+}
+
+/* Set up channel for sending from service wsid to peer */
+static bool channel_setup(wish_core_t* core, wish_service_channel_t* channel, const uint8_t* wsid, wish_service_peer_t* peer) {
+    memset(channel, 0, sizeof (wish_service_channel_t));
+    
+    memcpy(channel->wsid, wsid, WISH_WSID_LEN);
+    memcpy(channel->luid, peer->luid, WISH_UID_LEN);
+    memcpy(channel->ruid, peer->ruid, WISH_UID_LEN);
+    memcpy(channel->rhid, peer->rhid, WISH_WHID_LEN);
+    memcpy(channel->rsid, peer->rsid, WISH_WSID_LEN);
+    memcpy(channel->protocol, peer->protocol, peer->protocol_len);
+    
+    uint8_t local_hostid[WISH_WHID_LEN];
+    wish_core_get_host_id(core, local_hostid);
+    channel->local = memcmp(channel->rhid, local_hostid, WISH_WHID_LEN) == 0;
+    
+    if (!channel_build_header(core, channel)) {
+        return false;
+    }
+    
+    if (!channel->local) {
+        /* Resolve the connection now, but allow setting up the channel
+         * before the peer is connected */
+        channel_connection(core, channel);
+    }
+    return true;
+}
+
+/* Send one payload on channel. Returns 0 on success, or the RPC error
+ * code to report: 311 no connection, 312 frame could not be built, 506
+ * sending failed. */
+static int channel_send(wish_core_t* core, wish_service_channel_t* channel, const uint8_t* payload, int payload_len) {
+    if (channel->local) {
+        /* Local frames go to the app with the payload written from where
+         * it is */
+        wish_wire_envelope_t env;
+        if (wish_wire_envelope(&channel->header, &env, payload_len) == 0) {
+            WISHDEBUG(LOG_CRITICAL, "BSON write error, channel frame");
+            return 312;
+        }
+        wish_ipc_buf_t frame[3] = {
+            { env.head, env.head_len },
+            { payload, payload_len },
+            { env.tail, env.tail_len }
+        };
+        wish_peer_state_flush(core);
+        send_core_to_app_v(core, channel->rsid, frame, 3);
+        return 0;
+    }
+    
+    wish_connection_t* connection = channel_connection(core, channel);
+    if (connection == NULL) {
+        return 311;
+    }
+    
+    size_t frame_max_len = wish_wire_message_len(&channel->header, payload_len);
+    uint8_t frame[frame_max_len];
+    size_t frame_len = wish_wire_finish(&channel->header, frame, frame_max_len, payload, payload_len);
+    if (frame_len == 0) {
+        WISHDEBUG(LOG_CRITICAL, "BSON write error, channel frame");
+        return 312;
+    }
+    
+    if (wish_core_send_message(core, connection, frame, frame_len) != 0) {
+        WISHDEBUG(LOG_CRITICAL, "Core app RPC: Sending not possible at this time");
+        return 506;
+    }
+    return 0;
+}
+
+static void channel_send_error(rpc_server_req* req, int code) {
+    switch (code) {
+    case 311:
+        rpc_server_error_msg(req, 311, "No connection.");
+        break;
+    case 312:
+        rpc_server_error_msg(req, 312, "Error creating frame.");
+        break;
+    default:
+        rpc_server_error_msg(req, 506, "Failed sending message to remote core.");
+        break;
+    }
+}
+
+/* Find the cached route for sending from service wsid to peer, creating
+ * it on a miss */
+static wish_service_route_t* route_get(wish_core_t* core, const uint8_t* wsid, wish_service_peer_t* peer) {
+    wish_service_route_key_t key;
+    memset(&key, 0, sizeof (key));
+    memcpy(key.wsid, wsid, WISH_WSID_LEN);
+    memcpy(key.luid, peer->luid, WISH_UID_LEN);
+    memcpy(key.ruid, peer->ruid, WISH_UID_LEN);
+    memcpy(key.rhid, peer->rhid, WISH_WHID_LEN);
+    memcpy(key.rsid, peer->rsid, WISH_WSID_LEN);
+    memcpy(key.protocol, peer->protocol, peer->protocol_len);
+    
+    wish_service_route_t* route = NULL;
+    HASH_FIND(hh, core->service_routes, &key, sizeof (key), route);
+    if (route != NULL) {
+        return route;
+    }
+    
+    if (HASH_COUNT(core->service_routes) >= WISH_SERVICE_ROUTES_MAX) {
+        /* Evict the oldest route, the hash keeps insertion order */
+        route = core->service_routes;
+        HASH_DEL(core->service_routes, route);
+        wish_platform_free(route);
+    }
+    
+    route = wish_platform_malloc(sizeof (wish_service_route_t));
+    if (route == NULL) {
+        return NULL;
+    }
+    
+    if (!channel_setup(core, &route->channel, wsid, peer)) {
+        wish_platform_free(route);
+        return NULL;
+    }
+    memcpy(&route->key, &key, sizeof (key));
+    HASH_ADD(hh, core->service_routes, key, sizeof (key), route);
+    return route;
+}
+
+static wish_service_channel_t* channel_find(wish_core_t* core, const uint8_t* wsid, int id) {
+    wish_service_channel_t* channel;
+    
+    LL_FOREACH(core->service_channels, channel) {
+        if (channel->id == id && memcmp(channel->wsid, wsid, WISH_WSID_LEN) == 0) {
+            return channel;
+        }
+    }
+    return NULL;
+}
 
 /**
  * Request to send message to peer
@@ -34,188 +270,228 @@ void wish_api_services_send(rpc_server_req* req, const uint8_t* args) {
     
     wish_core_t* core = (wish_core_t*) req->server->context;
     wish_app_entry_t* app = (wish_app_entry_t*) req->context;
-    uint8_t* wsid = app->wsid;    
 
+    wish_service_peer_t peer;
     bson_iterator it;
     
-    bson_iterator_from_buffer(&it, args);
-
-    if ( bson_find_fieldpath_value("0.luid", &it) != BSON_BINDATA ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (luid not BSON_BINDATA)");
+    if (!services_parse_peer(req, args, &peer, &it)) {
         return;
     }
     
-    if ( bson_iterator_bin_len(&it) != WISH_UID_LEN ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (luid length)");
+    if ( bson_iterator_type(&it) != BSON_BINDATA ) {
+        rpc_server_error_msg(req, 311, "Invalid payload.");
         return;
     }
     
-    const uint8_t* luid = bson_iterator_bin_data(&it);
-    
-    bson_iterator_from_buffer(&it, args);
+    int payload_len = bson_iterator_bin_len(&it);
+    const uint8_t* payload = bson_iterator_bin_data(&it);
+    //bson_visit("Handling services.send, payload:", payload);
 
-    if ( bson_find_fieldpath_value("0.ruid", &it) != BSON_BINDATA ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (ruid not BSON_BINDATA)");
+    /* The route tells if the message is to be delivered to a local
+     * service (rhid is our own host id) or over a connection to a remote
+     * core, and holds the message header pre-encoded. For a local service
+     * the frame is much like the one the "core-to-core" RPC server
+     * constructs, but luid and ruid switch places in the peer document,
+     * and rsid is replaced by the service id which called this RPC
+     * handler. */
+    wish_service_route_t* route = route_get(core, app->wsid, &peer);
+    if (route == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "Error creating route for services.send");
+        rpc_server_error_msg(req, 312, "Error creating frame.");
         return;
     }
     
-    if ( bson_iterator_bin_len(&it) != WISH_UID_LEN ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (ruid length)");
+    int ret = channel_send(core, &route->channel, payload, payload_len);
+    if (ret != 0) {
+        channel_send_error(req, ret);
         return;
     }
     
-    const uint8_t* ruid = bson_iterator_bin_data(&it);
-    
-    bson_iterator_from_buffer(&it, args);
+    rpc_server_send(req, NULL, 0);
+}
 
-    if ( bson_find_fieldpath_value("0.rhid", &it) != BSON_BINDATA ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (rhid not BSON_BINDATA)");
+/**
+ * Open a sending channel to a peer
+ * 
+ *     args: [ { luid, ruid, rhid, rsid, protocol } ]
+ * 
+ * Returns a channel id to be used with services.sendBatch
+ */
+void wish_api_services_open_channel(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    wish_app_entry_t* app = (wish_app_entry_t*) req->context;
+    
+    wish_service_peer_t peer;
+    
+    if (!services_parse_peer(req, args, &peer, NULL)) {
         return;
     }
     
-    if ( bson_iterator_bin_len(&it) != WISH_UID_LEN ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (rhid length)");
+    int count = 0;
+    wish_service_channel_t* elt;
+    LL_COUNT(core->service_channels, elt, count);
+    if (count >= WISH_SERVICE_CHANNELS_MAX) {
+        rpc_server_error_msg(req, 313, "Too many open channels.");
         return;
     }
     
-    const uint8_t* rhid = bson_iterator_bin_data(&it);
-    
-    bson_iterator_from_buffer(&it, args);
-
-    if ( bson_find_fieldpath_value("0.rsid", &it) != BSON_BINDATA ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (rsid not BSON_BINDATA)");
+    wish_service_channel_t* channel = wish_platform_malloc(sizeof (wish_service_channel_t));
+    if (channel == NULL) {
+        rpc_server_error_msg(req, 313, "Out of memory.");
         return;
     }
     
-    if ( bson_iterator_bin_len(&it) != WISH_UID_LEN ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (rsid length)");
+    if (!channel_setup(core, channel, app->wsid, &peer)) {
+        wish_platform_free(channel);
+        rpc_server_error_msg(req, 312, "Error creating channel.");
         return;
     }
     
-    const uint8_t* rsid = bson_iterator_bin_data(&it);
+    channel->id = core->next_channel_id++;
+    LL_APPEND(core->service_channels, channel);
     
-    bson_iterator_from_buffer(&it, args);
+    uint8_t buf[WISH_PORT_RPC_BUFFER_SZ];
+    bson bs;
+    bson_init_buffer(&bs, buf, WISH_PORT_RPC_BUFFER_SZ);
+    bson_append_int(&bs, "data", channel->id);
+    bson_finish(&bs);
+    
+    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+}
 
-    if ( bson_find_fieldpath_value("0.protocol", &it) != BSON_STRING ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (protocol not BSON_STRING)");
-        return;
-    }
+/**
+ * Send a batch of payloads on a channel
+ * 
+ *     args: [ channel: number, payloads: Buffer[] ]
+ * 
+ * Returns the number of payloads sent. One response per batch.
+ */
+void wish_api_services_send_batch(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    wish_app_entry_t* app = (wish_app_entry_t*) req->context;
     
-    int protocol_len = bson_iterator_string_len(&it);
+    bson_iterator it;
+    bson_iterator_from_buffer(&it, args);
     
-    if ( protocol_len > WISH_PROTOCOL_NAME_MAX_LEN ) {
-        rpc_server_error_msg(req, 311, "Invalid peer. (protocol name length)");
+    if ( !BSON_IS_NUM_TYPE(bson_find_fieldpath_value("0", &it)) ) {
+        rpc_server_error_msg(req, 311, "Invalid channel.");
         return;
     }
     
-    const uint8_t* protocol = bson_iterator_string(&it);
+    wish_service_channel_t* channel = channel_find(core, app->wsid, bson_iterator_int(&it));
+    if (channel == NULL) {
+        rpc_server_error_msg(req, 311, "Invalid channel.");
+        return;
+    }
     
     bson_iterator_from_buffer(&it, args);
-
-    if ( bson_find_fieldpath_value("1", &it) != BSON_BINDATA ) {
-        rpc_server_error_msg(req, 311, "Invalid payload.");
+    
+    if ( bson_find_fieldpath_value("1", &it) != BSON_ARRAY ) {
+        rpc_server_error_msg(req, 311, "Invalid payloads.");
         return;
     }
     
-    int payload_len = bson_iterator_bin_len(&it);
-    const uint8_t* payload = bson_iterator_bin_data(&it);
-    //bson_visit("Handling services.send, payload:", payload);
-
-    /* First, check if message is to be delivered to some of our local services.
-     * In this case we very if the message's rhid corresponds to our local core's rhid 
-     */
-    uint8_t local_hostid[WISH_WHID_LEN];
-    wish_core_get_host_id(core, local_hostid);
-    if (memcmp(rhid, local_hostid, WISH_WHID_LEN) == 0) {
-        /* rhid matches to local core, message destined to a local service!
-         * Now we must construct a frame, much like we do in the "core-to-core" 
-         * RPC server, but in the peer document, the luid and ruid switch places,
-         * and rsid is replaced by the service id which called this RPC handler
-         * (that is found in the rpc context)
-         *  */
+    int sent = 0;
+    bson_iterator pit;
+    bson_iterator_subiterator(&it, &pit);
+    
+    while (bson_iterator_next(&pit) != BSON_EOO) {
+        if (bson_iterator_type(&pit) != BSON_BINDATA) {
+            rpc_server_error_msg(req, 311, "Invalid payload.");
+            return;
+        }
         
-        /* FIXME this is wasting stack space again */
-        size_t upcall_doc_max_len = (5+4*32+10) + payload_len + 100;
-        uint8_t upcall_doc[upcall_doc_max_len];
-        bson bs;
-        bson_init_buffer(&bs, upcall_doc, upcall_doc_max_len);
-        bson_append_string(&bs, "type", "frame");
-        bson_append_start_object(&bs, "peer");
-        /* luid and ruid switch places */
-        bson_append_binary(&bs, "luid", ruid, WISH_ID_LEN);
-        bson_append_binary(&bs, "ruid", luid, WISH_ID_LEN);
-        bson_append_binary(&bs, "rhid", rhid, WISH_WHID_LEN);
-        /* rsid is */
-        bson_append_binary(&bs, "rsid", wsid, WISH_WSID_LEN);
-        bson_append_string(&bs, "protocol", protocol);
-        bson_append_finish_object(&bs);
-        bson_append_binary(&bs, "data", payload, payload_len);
-        bson_finish(&bs);
-        if (bs.err) {
-            WISHDEBUG(LOG_CRITICAL, "Error creating frame to local service");
-            rpc_server_error_msg(req, 312, "Error creating frame for local service");
-        } else {
-            //bson_visit("About to send this to local service on local core:", upcall_doc);
-            send_core_to_app(core, rsid, bson_data(&bs), bson_size(&bs));
-            rpc_server_send(req, NULL, 0);
+        int ret = channel_send(core, channel, bson_iterator_bin_data(&pit), bson_iterator_bin_len(&pit));
+        if (ret != 0) {
+            WISHDEBUG(LOG_CRITICAL, "services.sendBatch: %i payloads sent before error", sent);
+            channel_send_error(req, ret);
+            return;
         }
-        return;
+        sent++;
     }
-    /* Destination is determined to be a remote service on a remote core. */
-    wish_connection_t* connection = wish_core_lookup_connected_ctx_by_luid_ruid_rhid(core, luid, ruid, rhid);
-
-    // We will just send data and not expect response, not registering a request
-    //  wish_rpc_client_request(core->core_rpc_client, &bs, NULL);
+    
+    uint8_t buf[WISH_PORT_RPC_BUFFER_SZ];
+    bson bs;
+    bson_init_buffer(&bs, buf, WISH_PORT_RPC_BUFFER_SZ);
+    bson_append_int(&bs, "data", sent);
+    bson_finish(&bs);
+    
+    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+}
 
-    if (connection != NULL && connection->context_state == WISH_CONTEXT_CONNECTED) {
-        
-        /* Build the actual on-wire message:
-         *
-         * req: {
-         *  op: 'send'
-         *  args: [ lsid, rsid, protocol, payload ]
-         * }
-         */
+/**
+ * Close a channel
+ * 
+ *     args: [ channel: number ]
+ */
+void wish_api_services_close_channel(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
+    wish_app_entry_t* app = (wish_app_entry_t*) req->context;
+    
+    bson_iterator it;
+    bson_iterator_from_buffer(&it, args);
+    
+    if ( !BSON_IS_NUM_TYPE(bson_find_fieldpath_value("0", &it)) ) {
+        rpc_server_error_msg(req, 311, "Invalid channel.");
+        return;
+    }
+    
+    wish_service_channel_t* channel = channel_find(core, app->wsid, bson_iterator_int(&it));
+    if (channel == NULL) {
+        rpc_server_error_msg(req, 311, "Invalid channel.");
+        return;
+    }
+    
+    LL_DELETE(core->service_channels, channel);
+    wish_platform_free(channel);
+    
+    uint8_t buf[WISH_PORT_RPC_BUFFER_SZ];
+    bson bs;
+    bson_init_buffer(&bs, buf, WISH_PORT_RPC_BUFFER_SZ);
+    bson_append_bool(&bs, "data", true);
+    bson_finish(&bs);
+    
+    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+}
 
-        size_t buf_len = 2*(WISH_WSID_LEN) + protocol_len + payload_len + 128;
-        uint8_t buf[buf_len];
-        bson bs; 
-        bson_init_buffer(&bs, buf, buf_len);
-        bson_append_start_object(&bs, "req");
-        bson_append_string(&bs, "op", "send");
-        bson_append_start_array(&bs, "args");
-        bson_append_binary(&bs, "0", wsid, WISH_WSID_LEN);
-        bson_append_binary(&bs, "1", rsid, WISH_WSID_LEN);
-        bson_append_string(&bs, "2", protocol);
-        bson_append_binary(&bs, "3", payload, payload_len);
-        bson_append_finish_array(&bs);
-        bson_append_finish_object(&bs);
-        bson_finish(&bs);
+void wish_api_services_channels_cleanup(wish_core_t* core, const uint8_t* wsid) {
+    wish_service_channel_t* channel;
+    wish_service_channel_t* tmp;
+    
+    LL_FOREACH_SAFE(core->service_channels, channel, tmp) {
+        if (memcmp(channel->wsid, wsid, WISH_WSID_LEN) == 0) {
+            LL_DELETE(core->service_channels, channel);
+            wish_platform_free(channel);
+        }
+    }
+    
+    wish_service_route_t* route;
+    wish_service_route_t* rtmp;
+    
+    HASH_ITER(hh, core->service_routes, route, rtmp) {
+        if (memcmp(route->key.wsid, wsid, WISH_WSID_LEN) == 0) {
+            HASH_DEL(core->service_routes, route);
+            wish_platform_free(route);
+        }
+    }
+}
 
-        if (bs.err) {
-            WISHDEBUG(LOG_CRITICAL, "BSON write error, args_buffer");
-            return;
+void wish_api_services_connection_closed(wish_core_t* core, struct wish_context* connection) {
+    wish_service_channel_t* channel;
+    
+    LL_FOREACH(core->service_channels, channel) {
+        if (channel->connection == connection) {
+            channel->connection = NULL;
         }
-        
-        int send_ret = wish_core_send_message(core, connection, bson_data(&bs), bson_size(&bs));
-        
-        if (send_ret != 0) {
-            /* Sending failed. Propagate RPC error */
-            WISHDEBUG(LOG_CRITICAL, "Core app RPC: Sending not possible at this time");
-            rpc_server_error_msg(req, 506, "Failed sending message to remote core.");
-        } else {
-            /* Sending successful */
-            rpc_server_send(req, NULL, 0);
+    }
+    
+    wish_service_route_t* route;
+    wish_service_route_t* rtmp;
+    
+    HASH_ITER(hh, core->service_routes, route, rtmp) {
+        if (route->channel.connection == connection) {
+            route->channel.connection = NULL;
         }
-    } else {
-        //WISHDEBUG(LOG_CRITICAL, "Could not find a suitable wish connection to send data.");
-        //WISHDEBUG(LOG_CRITICAL, "    luid: %02x %02x %02x %02x ...", luid[0], luid[1], luid[2], luid[3]);
-        //WISHDEBUG(LOG_CRITICAL, "    ruid: %02x %02x %02x %02x ...", ruid[0], ruid[1], ruid[2], ruid[3]);
-        //WISHDEBUG(LOG_CRITICAL, "    rhid: %02x %02x %02x %02x ...", rhid[0], rhid[1], rhid[2], rhid[3]);
-        //WISHDEBUG(LOG_CRITICAL, "    rsid: %02x %02x %02x %02x ...", rsid[0], rsid[1], rsid[2], rsid[3]);
-        //WISHDEBUG(LOG_CRITICAL, "    protocol: %s", protocol);
-        //bson_visit("Sending this failed in wish-core (may fail if payload not bson):", payload);
-        rpc_server_error_msg(req, 311, "No connection.");
     }
 }
 
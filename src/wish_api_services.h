@@ -22,15 +22,70 @@ extern "C" {
 #include "uthash.h"
     
 #include "wish_core.h"
+#include "wish_wire.h"
+    
+#define WISH_SERVICE_CHANNELS_MAX 32
+    
+    /* A sending channel opened by a service to one peer. The routing is
+     * resolved and the message header encoded once, when the channel is
+     * opened. */
+    typedef struct wish_service_channel {
+        int id;
+        /* The service which opened the channel */
+        uint8_t wsid[WISH_WSID_LEN];
+        uint8_t luid[WISH_UID_LEN];
+        uint8_t ruid[WISH_UID_LEN];
+        uint8_t rhid[WISH_WHID_LEN];
+        uint8_t rsid[WISH_WSID_LEN];
+        char protocol[WISH_PROTOCOL_NAME_MAX_LEN + 1];
+        /* Destination is a service on this core */
+        bool local;
+        /* Cached connection, revalidated before use */
+        struct wish_context* connection;
+        /* The frame encoded up to the payload */
+        wish_wire_header_t header;
+        struct wish_service_channel* next;
+    } wish_service_channel_t;
+    
+#define WISH_SERVICE_ROUTES_MAX 64
+    
+    /* Key of the services.send routing cache */
+    typedef struct {
+        uint8_t wsid[WISH_WSID_LEN];
+        uint8_t luid[WISH_UID_LEN];
+        uint8_t ruid[WISH_UID_LEN];
+        uint8_t rhid[WISH_WHID_LEN];
+        uint8_t rsid[WISH_WSID_LEN];
+        char protocol[WISH_PROTOCOL_NAME_MAX_LEN + 1];
+    } wish_service_route_key_t;
+    
+    /* Cached route of services.send, an implicitly opened channel */
+    typedef struct wish_service_route {
+        wish_service_route_key_t key;
+        wish_service_channel_t channel;
+        UT_hash_handle hh;
+    } wish_service_route_t;
     
     /* Services API */
     
     void wish_api_services_send(rpc_server_req* req, const uint8_t* args);
     
     void wish_api_services_list(rpc_server_req* req, const uint8_t* args);
+    
+    void wish_api_services_open_channel(rpc_server_req* req, const uint8_t* args);
+    
+    void wish_api_services_send_batch(rpc_server_req* req, const uint8_t* args);
+    
+    void wish_api_services_close_channel(rpc_server_req* req, const uint8_t* args);
 
     /* Services internals */
     
+    /* Remove the channels opened by a service, when the service goes away */
+    void wish_api_services_channels_cleanup(wish_core_t* core, const uint8_t* wsid);
+    
+    /* Drop references to a connection which is going away from channels and cached routes */
+    void wish_api_services_connection_closed(wish_core_t* core, struct wish_context* connection);
+    
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,15 @@
 #include "wish_local_discovery.h"
 #include "wish_connection_mgr.h"
 
+/* The wld.list reply has to fit in one 64k app frame, together with the
+ * ack around the data */
+#define WLD_LIST_REPLY_MAX ( 0xffff - 64 )
+
+/* Upper bound of the bson size of one wld.list item */
+static size_t wld_list_item_max(wish_ldiscover_t *elt) {
+    return 128 + 3 * WISH_ID_LEN + WISH_PUBKEY_LEN + strlen(elt->alias) + (elt->class ? strlen(elt->class) : 0);
+}
+
 /**
  * Wish Local Discovery
  *
@@ -33,49 +42,51 @@
  *   [pubkey: Buffer<>] // optional
  * }
  * 
+ * Items which would not fit in the app frame are left out.
  */
 void wish_api_wld_list(rpc_server_req* req, const uint8_t* args) {
     wish_core_t* core = (wish_core_t*) req->server->context;
     
-    int buffer_len = WISH_PORT_RPC_BUFFER_SZ;
-    uint8_t buffer[buffer_len];
-    
     wish_ldiscover_t *db = wish_ldiscover_get(core);
+    wish_ldiscover_t *elt;
+    wish_ldiscover_t *tmp;
 
     bson bs;
-    bson_init_buffer(&bs, buffer, buffer_len);
+    bson_init_arena(&bs, &core->arena, 64 + HASH_COUNT(db) * (3 * WISH_ID_LEN + WISH_PUBKEY_LEN + WISH_ALIAS_LEN + 96));
     bson_append_start_array(&bs, "data");
     
-    int i;
     int p = 0;
-    for(i=0; i< WISH_LOCAL_DISCOVERY_MAX; i++) {
-        if(db[i].occupied) {
-            char index[21];
-            BSON_NUMSTR(index, p);
-            
-            if (db[i].type == DISCOVER_TYPE_LOCAL) {
-                bson_append_start_object(&bs, index);
-                bson_append_string(&bs, "type", "local");
-                bson_append_string(&bs, "alias", db[i].alias);
-                bson_append_binary(&bs, "ruid", db[i].ruid, WISH_ID_LEN);
-                bson_append_binary(&bs, "rhid", db[i].rhid, WISH_ID_LEN);
-                bson_append_binary(&bs, "pubkey", db[i].pubkey, WISH_PUBKEY_LEN);
-                if (db[i].claim) { bson_append_bool(&bs, "claim", true); }
-                if (db[i].class) { bson_append_string(&bs, "class", db[i].class); }
-                bson_append_finish_object(&bs);
-            } else if (db[i].type == DISCOVER_TYPE_FRIEND_REQ) {
-                bson_append_start_object(&bs, index);
-                bson_append_string(&bs, "type", "friendReq");
-                bson_append_string(&bs, "alias", db[i].alias);
-                //bson_append_binary(&bs, "luid", db[i].luid, WISH_ID_LEN);
-                bson_append_binary(&bs, "ruid", db[i].ruid, WISH_ID_LEN);
-                bson_append_binary(&bs, "rhid", db[i].rhid, WISH_ID_LEN);
-                bson_append_binary(&bs, "rsid", db[i].rsid, WISH_ID_LEN);
-                bson_append_binary(&bs, "pubkey", db[i].pubkey, WISH_PUBKEY_LEN);
-                bson_append_finish_object(&bs);
-            }
-            p++;
+    HASH_ITER(hh, db, elt, tmp) {
+        char index[21];
+        BSON_NUMSTR(index, p);
+
+        if (bs.cur - bs.data + wld_list_item_max(elt) > WLD_LIST_REPLY_MAX) {
+            WISHDEBUG(LOG_CRITICAL, "wld.list: reply full, leaving out %i entries", HASH_COUNT(db) - p);
+            break;
         }
+
+        if (elt->type == DISCOVER_TYPE_LOCAL) {
+            bson_append_start_object(&bs, index);
+            bson_append_string(&bs, "type", "local");
+            bson_append_string(&bs, "alias", elt->alias);
+            bson_append_binary(&bs, "ruid", elt->ruid, WISH_ID_LEN);
+            bson_append_binary(&bs, "rhid", elt->rhid, WISH_ID_LEN);
+            bson_append_binary(&bs, "pubkey", elt->pubkey, WISH_PUBKEY_LEN);
+            if (elt->claim) { bson_append_bool(&bs, "claim", true); }
+            if (elt->class) { bson_append_string(&bs, "class", elt->class); }
+            bson_append_finish_object(&bs);
+        } else if (elt->type == DISCOVER_TYPE_FRIEND_REQ) {
+            bson_append_start_object(&bs, index);
+            bson_append_string(&bs, "type", "friendReq");
+            bson_append_string(&bs, "alias", elt->alias);
+            //bson_append_binary(&bs, "luid", elt->luid, WISH_ID_LEN);
+            bson_append_binary(&bs, "ruid", elt->ruid, WISH_ID_LEN);
+            bson_append_binary(&bs, "rhid", elt->rhid, WISH_ID_LEN);
+            bson_append_binary(&bs, "rsid", elt->rsid, WISH_ID_LEN);
+            bson_append_binary(&bs, "pubkey", elt->pubkey, WISH_PUBKEY_LEN);
+            bson_append_finish_object(&bs);
+        }
+        p++;
     }
 
     bson_append_finish_array(&bs);
@@ -83,10 +94,11 @@ void wish_api_wld_list(rpc_server_req* req, const uint8_t* args) {
     
     if (bs.err) {
         rpc_server_error_msg(req, 303, "Failed writing bson.");
-        return;
+    } else {
+        rpc_server_send(req, bson_data(&bs), bson_size(&bs));
     }
     
-    rpc_server_send(req, bson_data(&bs), bson_size(&bs));
+    bson_destroy(&bs);
 }
 
 /**
@@ -220,37 +232,27 @@ void wish_api_wld_friend_request(rpc_server_req* req, const uint8_t* args) {
     const uint8_t* rhid = bson_iterator_bin_data(&it);
 
     // now check if we have the wld details for this entry
-    wish_ldiscover_t *db = wish_ldiscover_get(core);
+    wish_ldiscover_t *elt = wish_ldiscover_find(core, ruid, rhid);
 
-    bool found = false;
-    
-    int i;
-    for(i=0; i< WISH_LOCAL_DISCOVERY_MAX; i++) {
-        if( db[i].occupied && 
-                memcmp(&db[i].ruid, ruid, WISH_ID_LEN) == 0 &&
-                memcmp(&db[i].rhid, rhid, WISH_ID_LEN) == 0) 
-        {
-            //WISHDEBUG(LOG_CRITICAL, "Found in slot %d", i);
-            found = true;
-            break;
-        }
-    }
-    
-    if(!found) {
+    if (elt == NULL) {
         rpc_server_error_msg(req, 304, "Wld entry not found.");
         return;
     }
 
+    if (elt->num_transports == 0) {
+        rpc_server_error_msg(req, 304, "Wld entry has no transports.");
+        return;
+    }
+
     wish_connection_t* connection = wish_connection_init(core, luid, ruid);
     connection->friend_req_connection = true;
-    connection->friend_req_meta = db[i].meta;
+    connection->friend_req_meta = elt->meta;
     memcpy(connection->rhid, rhid, WISH_ID_LEN);
         
-    uint8_t *ip = db[i].transport_ip.addr;
-    
-    //WISHDEBUG(LOG_CRITICAL, "Will start a friend req connection to: %u.%u.%u.%u\n", ip[0], ip[1], ip[2], ip[3]);
+    /* The address the peer was most recently seen at */
+    wish_transport_addr_t *transport = &elt->transports[0];
 
-    wish_open_connection(core, connection, &(db[i].transport_ip), db[i].transport_port, false);
+    wish_open_connection(core, connection, &transport->ip, transport->port, false);
 
     bson bs;
     bson_init_buffer(&bs, buffer, buffer_len);
@@ -130,6 +130,7 @@ int wish_core_config_save(wish_core_t* core) {
         char index[21];
         
         LL_FOREACH(core->relay_db, relay) {
+            if (relay->secondary) { continue; }
             
             char host[22];
             wish_platform_snprintf(host, 22, "%d.%d.%d.%d:%d", relay->ip.addr[0], relay->ip.addr[1], relay->ip.addr[2], relay->ip.addr[3], relay->port);
@@ -40,6 +40,7 @@
 #include "wish_core_rpc.h"
 #include "wish_core_app_rpc.h"
 #include "wish_connection_mgr.h"
+#include "wish_api_services.h"
 
 #include "utlist.h"
 
@@ -61,6 +62,7 @@ wish_connection_t* wish_connection_init(wish_core_t* core, const uint8_t* luid,
             connection->context_state = WISH_CONTEXT_IN_MAKING;
             /* Update timestamp */
             connection->latest_input_timestamp = wish_time_get_relative(core);
+            connection->keepalive_interval = PING_INTERVAL;
             break;
         }
     }
@@ -86,6 +88,7 @@ wish_connection_t* wish_connection_init(wish_core_t* core, const uint8_t* luid,
     connection->curr_transport_state = TRANSPORT_STATE_INITIAL;
     connection->curr_protocol_state = PROTO_STATE_INITIAL;
     connection->apps = NULL;
+    connection->attempt_id = 0;
 
     return connection;
 }
@@ -273,28 +276,21 @@ void wish_core_feed(wish_core_t* core, wish_connection_t* connection, unsigned c
 bool wish_core_check_wsid(wish_core_t* core, wish_connection_t* ctx, uint8_t* dst_id, uint8_t* src_id) {
     /* Whitelist/ACL processing? */
 
-    /* Load the source id from our DB.  */
-    wish_identity_t tmp_id;
-    
-    if ( wish_identity_load(src_id, &tmp_id) != RET_SUCCESS ) {
+    /* Check the ids against the in-memory copy of our DB, a reconnect
+     * storm should not read the DB for every connection */
+    if ( !wish_identity_is_known(src_id) ) {
         WISHDEBUG(LOG_CRITICAL, "We don't know to guy trying to connect to us.");
-        wish_identity_destroy(&tmp_id);
         return false;
     }
 
-    wish_identity_destroy(&tmp_id);
-    
-    if ( wish_identity_load(dst_id, &tmp_id) != RET_SUCCESS ) {
+    if ( !wish_identity_is_known(dst_id) ) {
         WISHDEBUG(LOG_CRITICAL, "We know who is trying to connect to us, but not the one he wants to connect to. (Did we delete an identity?)");
-        wish_identity_destroy(&tmp_id);
         return false;
     }
 
-    wish_identity_destroy(&tmp_id);
-
     /* Technically, we need to have the privkey for "dst_id", else we
      * cannot be communicating */
-    if (!wish_has_privkey(dst_id)) {
+    if (!wish_identity_is_local(dst_id)) {
         WISHDEBUG(LOG_CRITICAL, "We know both parties of the connection but we don't have the private key to open the connection.");
         return false;
     }
@@ -625,6 +621,9 @@ void wish_core_signal_tcp_event(wish_core_t* core, wish_connection_t* connection
         
         /* Delete any outstanding RPC request contexts */
         wish_cleanup_core_rpc_server(core, connection);
+        
+        /* Forget the connection in services.send routes and channels */
+        wish_api_services_connection_closed(core, connection);
 
         /* If the connection were to be closed when its protocol state is
          * PROTO_SERVER_STATE_DH, then we must free the server_dhm_context
@@ -962,6 +961,12 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
 
             }
 
+            if (bson_check_buffer(plaintxt, ciphertxt_len) != BSON_OK) {
+                WISHDEBUG(LOG_CRITICAL, "Malformed Wish handshake");
+                wish_close_connection(core, connection);
+                break;
+            }
+
             /* Submit the decrypted message upwards in the stack */
             wish_debug_print_array(LOG_TRIVIAL, "Performing local handshake steps", plaintxt, len-AES_GCM_AUTH_TAG_LEN);
             wish_core_process_handshake(core, connection, plaintxt);
@@ -985,6 +990,9 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
                     }
                 }
                 
+                /* The other dials of the same attempt are not needed */
+                wish_connections_attempt_won(core, connection);
+                
                 struct wish_event evt = { .event_type =
                     WISH_EVENT_NEW_CORE_CONNECTION, .context = connection };
                 wish_message_processor_notify(&evt);
@@ -1022,6 +1030,13 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
                 wish_close_connection(core, connection);
                 break;
             }
+            if (bson_check_buffer(plaintxt, plaintxt_len) != BSON_OK) {
+                WISHDEBUG(LOG_CRITICAL, "Malformed Wish message");
+                wish_platform_free(plaintxt);
+                wish_close_connection(core, connection);
+                break;
+            }
+            
             wish_debug_print_array(LOG_TRIVIAL, "Plaintext", plaintxt, len);
             wish_core_process_message(core, connection, plaintxt);
             wish_platform_free(plaintxt);
@@ -1195,6 +1210,13 @@ void wish_core_handle_payload(wish_core_t* core, wish_connection_t* connection,
                 break;
             }
 
+            if (bson_check_buffer(plaintxt, ciphertxt_len) != BSON_OK) {
+                WISHDEBUG(LOG_CRITICAL, "Malformed handshake reply");
+                wish_platform_free(plaintxt);
+                wish_close_connection(core, connection);
+                break;
+            }
+
             wish_debug_print_array(LOG_TRIVIAL, "Got handshake reply OK", plaintxt, len);
 
             bson_iterator it;
@@ -1451,6 +1473,8 @@ void wish_core_init(wish_core_t* core) {
     
     core->time_db = NULL;
     
+    bson_arena_init(&core->arena, WISH_PORT_BSON_ARENA_SZ);
+    
     core->wish_server_port = core->wish_server_port == 0 ? 37009 : core->wish_server_port;
     
     wish_connections_init(core);
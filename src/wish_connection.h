@@ -154,11 +154,22 @@ struct wish_context {
     wish_time_t latest_input_timestamp;
     /* A timestamp denoting when the connection ping was last sent. */
     wish_time_t ping_sent_timestamp;
+    /* Millisecond time of the ping waiting for a pong, 0 if none */
+    uint32_t ping_sent_ms;
+    /* Smoothed round-trip time and its mean deviation in milliseconds,
+     * measured from ping to pong. 0 when not measured yet. */
+    uint32_t rtt_ms;
+    uint32_t rtt_var_ms;
+    /* Seconds of silence before the connection is pinged */
+    wish_time_t keepalive_interval;
     /* This timestamp is used by the ESP8266 port to keep track when the
      * connection should be aborted */
     wish_time_t close_timestamp;
     /* true when connection initiated by us, false when accepted as incoming */
     bool outgoing;
+    /* The connect attempt which dialled this connection, among others to
+     * the same peer, or 0 */
+    uint32_t attempt_id;
     /* True, if the connection is opened via a relay server 
      * (used when opening a connection for accepting an incoming
      * connection) */
@@ -23,80 +23,411 @@
 #include "bson.h"
 #include "bson_visit.h"
 #include "wish_connection_mgr.h"
+#include "wish_wire.h"
+#include "wish_time.h"
+#include "wish_platform.h"
+#include "wish_local_discovery.h"
 #include "string.h"
+#include "utlist.h"
+#include "uthash.h"
+
+/* A (luid, ruid) pair the connection scheduler dials */
+typedef struct wish_connect_peer {
+    /* luid and ruid, in this order and adjacent, are the key */
+    uint8_t luid[WISH_ID_LEN];
+    uint8_t ruid[WISH_ID_LEN];
+    /* True once the pair has been connected, then the remote is known
+     * to accept this local identity */
+    bool reached;
+    /* When the dial is due, the priority in the queue */
+    wish_time_t due;
+    /* Dials failed in a row, and the time before which the peer is not
+     * dialed again */
+    int failures;
+    wish_time_t backoff_until;
+    /* Position in the queue, -1 when not queued */
+    int queue_index;
+    /* The dial in progress */
+    bool dialing;
+    wish_time_t dial_started;
+    int dial_candidates;
+    struct wish_connect_peer* next;
+    UT_hash_handle hh;
+} wish_connect_peer_t;
+
+typedef struct wish_connect_scheduler {
+    wish_connect_peer_t* peers;
+    /* Binary min-heap of pending dials, ordered by due time */
+    wish_connect_peer_t** queue;
+    int queue_len;
+    int queue_size;
+    /* Dials in progress */
+    wish_connect_peer_t* dialing;
+    int num_dialing;
+} wish_connect_scheduler_t;
+
+static void connect_scheduler_tick(wish_core_t* core, void* ctx);
 
 void wish_connections_init(wish_core_t* core) {
     core->connection_pool = wish_platform_malloc(sizeof(wish_connection_t)*WISH_CONTEXT_POOL_SZ);
     memset(core->connection_pool, 0, sizeof(wish_connection_t)*WISH_CONTEXT_POOL_SZ);
     core->next_conn_id = 1;
     
+    core->connect_scheduler = wish_platform_malloc(sizeof(wish_connect_scheduler_t));
+    memset(core->connect_scheduler, 0, sizeof(wish_connect_scheduler_t));
+    
     wish_core_time_set_interval(core, &check_connection_liveliness, NULL, 1);
+    wish_core_time_set_interval(core, &connect_scheduler_tick, NULL, 1);
+}
+
+static bool queue_before(wish_connect_peer_t* a, wish_connect_peer_t* b) {
+    if (a->due != b->due) {
+        return a->due < b->due;
+    }
+    /* Peers which have been reachable go first */
+    return a->failures < b->failures;
+}
+
+static void queue_swap(wish_connect_scheduler_t* s, int i, int j) {
+    wish_connect_peer_t* tmp = s->queue[i];
+    s->queue[i] = s->queue[j];
+    s->queue[j] = tmp;
+    s->queue[i]->queue_index = i;
+    s->queue[j]->queue_index = j;
+}
+
+static void queue_push(wish_connect_scheduler_t* s, wish_connect_peer_t* peer) {
+    if (s->queue_len == s->queue_size) {
+        int size = s->queue_size ? 2 * s->queue_size : 16;
+        wish_connect_peer_t** queue = wish_platform_realloc(s->queue, size * sizeof (wish_connect_peer_t*));
+        
+        if (queue == NULL) {
+            return;
+        }
+        s->queue = queue;
+        s->queue_size = size;
+    }
+    
+    int i = s->queue_len++;
+    s->queue[i] = peer;
+    peer->queue_index = i;
+    
+    while (i > 0 && queue_before(s->queue[i], s->queue[(i - 1) / 2])) {
+        queue_swap(s, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static wish_connect_peer_t* queue_pop(wish_connect_scheduler_t* s) {
+    wish_connect_peer_t* top = s->queue[0];
+    int i = 0;
+    
+    s->queue_len--;
+    if (s->queue_len > 0) {
+        s->queue[0] = s->queue[s->queue_len];
+        s->queue[0]->queue_index = 0;
+    }
+    
+    while (true) {
+        int l = 2 * i + 1;
+        int r = l + 1;
+        int min = i;
+        
+        if (l < s->queue_len && queue_before(s->queue[l], s->queue[min])) { min = l; }
+        if (r < s->queue_len && queue_before(s->queue[r], s->queue[min])) { min = r; }
+        if (min == i) { break; }
+        
+        queue_swap(s, i, min);
+        i = min;
+    }
+    
+    top->queue_index = -1;
+    return top;
 }
 
+static bool peer_connected(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid);
+
+static wish_connect_peer_t* connect_peer_find(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    uint8_t key[2 * WISH_ID_LEN];
+    wish_connect_peer_t* peer = NULL;
+    
+    memcpy(key, luid, WISH_ID_LEN);
+    memcpy(key + WISH_ID_LEN, ruid, WISH_ID_LEN);
+    HASH_FIND(hh, core->connect_scheduler->peers, key, sizeof (key), peer);
+    return peer;
+}
+
+int wish_connections_plan(wish_core_t* core, const uint8_t* ruid, const uint8_t** luids, int max) {
+    int n = 0;
+    int i;
+    
+    /* The local identities the remote has accepted before */
+    for (i = 0; i < core->num_local_ids && n < max; i++) {
+        const uint8_t* luid = core->local_uid_list[i].uid;
+        wish_connect_peer_t* peer = connect_peer_find(core, luid, ruid);
+        
+        if ((peer != NULL && peer->reached) || peer_connected(core, luid, ruid)) {
+            luids[n++] = luid;
+        }
+    }
+    
+    if (n > 0) {
+        return n;
+    }
+    
+    /* Unknown, so all of them */
+    for (i = 0; i < core->num_local_ids && n < max; i++) {
+        luids[n++] = core->local_uid_list[i].uid;
+    }
+    return n;
+}
+
+/* Queue a dial to each contact which is not connected, from each local
+ * identity given by wish_connections_plan. The dials are spread over
+ * WISH_CONNECT_SPREAD seconds, and made by connect_scheduler_tick. */
 void wish_connections_check(wish_core_t* core) {
+    wish_connect_scheduler_t* s = core->connect_scheduler;
     int num_uids_in_db = wish_get_num_uid_entries();
     wish_uid_list_elem_t uid_list[num_uids_in_db];
     int num_uids = wish_load_uid_list(uid_list, num_uids_in_db);
-
-    int i = 0;
+    wish_time_t now = wish_time_get_relative(core);
+    const uint8_t* luids[WISH_PORT_MAX_UIDS];
 
     int j;
     for (j = 0; j < num_uids; j++) {
-        if (i == j) { continue; }
-        if( wish_core_is_connected_luid_ruid(core, uid_list[0].uid, uid_list[j].uid) ) { continue; }
+        const uint8_t* ruid = uid_list[j].uid;
         
-        wish_identity_t id;
-        if (wish_identity_load(uid_list[j].uid, &id) != RET_SUCCESS) {
-            WISHDEBUG(LOG_CRITICAL, "Failed loading identity");
-            wish_identity_destroy(&id);
-            return;
-        }
+        if (wish_core_is_local_uid(core, ruid)) { continue; }
         
-        /* Check if we should connect, meta: { connect: false } */
+        int num_luids = wish_connections_plan(core, ruid, luids, WISH_PORT_MAX_UIDS);
         
-        if (wish_identity_get_meta_connect(&id) == false) {
-            WISHDEBUG(LOG_CRITICAL, "check connections: will not connect, %s flagged as 'do not connect'", id.alias);
-            wish_identity_destroy(&id);
-            continue;
+        for (int k = 0; k < num_luids; k++) {
+            if (wish_core_is_connected_luid_ruid(core, (uint8_t*) luids[k], (uint8_t*) ruid)) { continue; }
+
+            wish_connect_peer_t* peer = connect_peer_find(core, luids[k], ruid);
+
+            if (peer == NULL) {
+                peer = wish_platform_malloc(sizeof(wish_connect_peer_t));
+                if (peer == NULL) { return; }
+                memset(peer, 0, sizeof(wish_connect_peer_t));
+                memcpy(peer->luid, luids[k], WISH_ID_LEN);
+                memcpy(peer->ruid, ruid, WISH_ID_LEN);
+                peer->queue_index = -1;
+                HASH_ADD(hh, s->peers, luid, 2 * WISH_ID_LEN, peer);
+            }
+
+            if (peer->dialing || peer->queue_index >= 0) {
+                /* Already on its way */
+                continue;
+            }
+
+            peer->due = now + (unsigned long) wish_platform_rng() % WISH_CONNECT_SPREAD;
+            if (peer->due < peer->backoff_until) {
+                peer->due = peer->backoff_until;
+            }
+            queue_push(s, peer);
         }
+    }
+}
+
+
+static bool peer_connecting(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* c = &core->connection_pool[i];
         
-        /* Check if we should connect, permissions: { banned: true } */
-        if (wish_identity_is_banned(&id) == true) {
-            WISHDEBUG(LOG_CRITICAL, "check connections, will not connect, %s is flagged as 'banned'", id.alias);
-            wish_identity_destroy(&id);
-            continue;
+        if (c->context_state == WISH_CONTEXT_IN_MAKING && !c->friend_req_connection
+                && memcmp(c->luid, luid, WISH_ID_LEN) == 0 && memcmp(c->ruid, ruid, WISH_ID_LEN) == 0) {
+            return true;
         }
-         
-        for (int cnt = 0; cnt < WISH_MAX_TRANSPORTS; cnt++) {
-            int url_len = strnlen(id.transports[cnt], WISH_MAX_TRANSPORT_LEN);
-            if (url_len > 0) {
-                char* url = id.transports[cnt];
-                //WISHDEBUG(LOG_CRITICAL, "  Should connect %02x %02x > %02x %02x to %s", uid_list[0].uid[0], uid_list[0].uid[1], uid_list[j].uid[0], uid_list[j].uid[1], url);
-            
-                wish_ip_addr_t ip;
-                uint16_t port;
-                int ret = wish_parse_transport_port(url, url_len, &port);
+    }
+    return false;
+}
+
+/* Load the contact and start connecting to its transports.
+ * @return true if a dial was started */
+static bool connect_dial(wish_core_t* core, wish_connect_peer_t* peer) {
+    wish_connect_scheduler_t* s = core->connect_scheduler;
+    
+    if (wish_core_is_connected_luid_ruid(core, peer->luid, peer->ruid)) {
+        return false;
+    }
+    
+    wish_identity_t id;
+    memset(&id, 0, sizeof (id));
+    if (!wish_core_is_local_uid(core, peer->luid) || wish_identity_load(peer->ruid, &id) != RET_SUCCESS) {
+        /* The contact, or our identity, has been removed */
+        wish_identity_destroy(&id);
+        HASH_DEL(s->peers, peer);
+        wish_platform_free(peer);
+        return false;
+    }
+
+    /* Check if we should connect, meta: { connect: false } */
+
+    if (wish_identity_get_meta_connect(&id) == false) {
+        WISHDEBUG(LOG_CRITICAL, "check connections: will not connect, %s flagged as 'do not connect'", id.alias);
+        wish_identity_destroy(&id);
+        return false;
+    }
+
+    /* Check if we should connect, permissions: { banned: true } */
+    if (wish_identity_is_banned(&id) == true) {
+        WISHDEBUG(LOG_CRITICAL, "check connections, will not connect, %s is flagged as 'banned'", id.alias);
+        wish_identity_destroy(&id);
+        return false;
+    }
+
+    wish_transport_addr_t candidates[WISH_MAX_TRANSPORTS];
+    int num_candidates = 0;
+
+    for (int cnt = 0; cnt < WISH_MAX_TRANSPORTS; cnt++) {
+        int url_len = strnlen(id.transports[cnt], WISH_MAX_TRANSPORT_LEN);
+        if (url_len > 0) {
+            char* url = id.transports[cnt];
+            //WISHDEBUG(LOG_CRITICAL, "  Should connect %02x %02x > %02x %02x to %s", peer->luid[0], peer->luid[1], peer->ruid[0], peer->ruid[1], url);
+
+            wish_transport_addr_t* c = &candidates[num_candidates];
+            int ret = wish_parse_transport_port(url, url_len, &c->port);
+            if (ret) {
+                WISHDEBUG(LOG_CRITICAL, "Could not parse transport port");
+            }
+            else {
+                ret = wish_parse_transport_ip(url, url_len, &c->ip);
                 if (ret) {
-                    WISHDEBUG(LOG_CRITICAL, "Could not parse transport port");
+                    WISHDEBUG(LOG_CRITICAL, "Could not parse transport ip");
                 }
                 else {
-                    ret = wish_parse_transport_ip(url, url_len, &ip);
-                    if (ret) {
-                        WISHDEBUG(LOG_CRITICAL, "Could not parse transport ip");
-                    }
-                    else {
-                        /* Parsing of IP and port OK: go ahead with connecting */
-                        wish_connections_connect_tcp(core, uid_list[0].uid, uid_list[j].uid, &ip, port);
-                    }
+                    /* Parsing of IP and port OK: a candidate for connecting */
+                    num_candidates++;
                 }
             }
         }
-        wish_identity_destroy(&id);
+    }
+    wish_identity_destroy(&id);
+
+    if (wish_connections_connect_candidates(core, peer->luid, peer->ruid, candidates, num_candidates) != RET_SUCCESS) {
+        return false;
+    }
+    
+    peer->dialing = true;
+    peer->dial_started = wish_time_get_relative(core);
+    peer->dial_candidates = num_candidates;
+    LL_PREPEND(s->dialing, peer);
+    s->num_dialing++;
+    return true;
+}
+
+/* Collect the finished dials, and start the dials which are due, at
+ * most WISH_CONNECT_MAX_IN_FLIGHT at a time */
+static void connect_scheduler_tick(wish_core_t* core, void* ctx) {
+    wish_connect_scheduler_t* s = core->connect_scheduler;
+    wish_time_t now = wish_time_get_relative(core);
+    wish_connect_peer_t* peer;
+    wish_connect_peer_t* tmp;
+    
+    LL_FOREACH_SAFE(s->dialing, peer, tmp) {
+        if (peer_connected(core, peer->luid, peer->ruid)) {
+            peer->reached = true;
+            peer->failures = 0;
+            peer->backoff_until = 0;
+        } else if (now >= peer->dial_started + peer->dial_candidates * WISH_CONNECT_ATTEMPT_DELAY
+                && !peer_connecting(core, peer->luid, peer->ruid)) {
+            /* All attempts have failed, back off exponentially, with
+             * jitter so that the retries of peers failing together
+             * spread out */
+            int backoff = WISH_CONNECT_BACKOFF_MAX;
+            
+            if (peer->failures < 16 && (WISH_CONNECT_BACKOFF_MIN << peer->failures) < WISH_CONNECT_BACKOFF_MAX) {
+                backoff = WISH_CONNECT_BACKOFF_MIN << peer->failures;
+            }
+            peer->failures++;
+            peer->backoff_until = now + backoff / 2 + (unsigned long) wish_platform_rng() % (backoff / 2 + 1);
+        } else {
+            continue;
+        }
+        
+        peer->dialing = false;
+        LL_DELETE(s->dialing, peer);
+        s->num_dialing--;
+    }
+    
+    while (s->num_dialing < WISH_CONNECT_MAX_IN_FLIGHT && s->queue_len > 0 && s->queue[0]->due <= now) {
+        peer = queue_pop(s);
+        
+        /* One dial at a time to a remote identity, whatever the local
+         * identity. The connection of one pair is often enough for the
+         * remote to learn our other identities. */
+        LL_FOREACH(s->dialing, tmp) {
+            if (memcmp(tmp->ruid, peer->ruid, WISH_ID_LEN) == 0) {
+                break;
+            }
+        }
+        
+        if (tmp != NULL) {
+            peer->due = now + 1;
+            queue_push(s, peer);
+            continue;
+        }
+        
+        connect_dial(core, peer);
+    }
+}
+
+/* Millisecond time for round-trip times, from the core time if the
+ * platform has no millisecond clock */
+static uint32_t connection_time_ms(wish_core_t* core) {
+    uint32_t ms = wish_platform_time_ms();
+    return ms != 0 ? ms : (uint32_t) core->core_time * 1000;
+}
+
+/* Seconds to wait for a pong before the peer is declared dead */
+static wish_time_t ping_response_timeout(wish_connection_t* connection) {
+    if (connection->rtt_ms == 0) {
+        return PING_RESPONSE_TIMEOUT_MAX;
+    }
+    
+    uint32_t rto_ms = connection->rtt_ms + 4 * connection->rtt_var_ms;
+    wish_time_t timeout = (4 * rto_ms + 999) / 1000;
+    
+    if (timeout < PING_RESPONSE_TIMEOUT_MIN) {
+        return PING_RESPONSE_TIMEOUT_MIN;
+    }
+    return timeout < PING_RESPONSE_TIMEOUT_MAX ? timeout : PING_RESPONSE_TIMEOUT_MAX;
+}
+
+void wish_connection_pong_received(wish_core_t* core, wish_connection_t* connection) {
+    if (connection->ping_sent_ms == 0) {
+        return;
+    }
+    
+    uint32_t sample = connection_time_ms(core) - connection->ping_sent_ms;
+    connection->ping_sent_ms = 0;
+    
+    if (sample == 0) {
+        sample = 1;
+    }
+    
+    /* RFC 6298, alpha 1/8 and beta 1/4 */
+    if (connection->rtt_ms == 0) {
+        connection->rtt_ms = sample;
+        connection->rtt_var_ms = sample / 2;
+    } else {
+        uint32_t delta = sample > connection->rtt_ms ? sample - connection->rtt_ms : connection->rtt_ms - sample;
+        connection->rtt_var_ms = (3 * connection->rtt_var_ms + delta) / 4;
+        connection->rtt_ms = (7 * connection->rtt_ms + sample) / 8;
+    }
+    
+    /* The peer answers, so it can be pinged less often */
+    if (connection->keepalive_interval + PING_INTERVAL <= PING_INTERVAL_MAX) {
+        connection->keepalive_interval += PING_INTERVAL;
+    } else {
+        connection->keepalive_interval = PING_INTERVAL_MAX;
     }
 }
 
 /* This function will check the connections and send a 'ping' if they
- * have not received anything lately */
+ * have not received anything lately. Any input from the peer answers
+ * the ping, so connections which carry traffic are not pinged. */
 void check_connection_liveliness(wish_core_t* core, void* ctx) {
     //WISHDEBUG(LOG_CRITICAL, "check_connection_liveliness");
     int i = 0;
@@ -105,29 +436,20 @@ void check_connection_liveliness(wish_core_t* core, void* ctx) {
         switch (connection->context_state) {
         case WISH_CONTEXT_CONNECTED:
             /* We have found a connected context we must examine */
-            if ((core->core_time > (connection->latest_input_timestamp + PING_INTERVAL))
-                && (connection->ping_sent_timestamp <= connection->latest_input_timestamp)) 
-            {
+            if (connection->ping_sent_timestamp > connection->latest_input_timestamp) {
+                /* Waiting for an answer to the ping */
+                if (core->core_time > connection->ping_sent_timestamp + ping_response_timeout(connection)) {
+                    WISHDEBUG(LOG_CRITICAL, "Connection ping: Killing connection because of inactivity");
+                    wish_close_connection(core, connection);
+                }
+            }
+            else if (core->core_time > (connection->latest_input_timestamp + connection->keepalive_interval)) {
                 WISHDEBUG(LOG_DEBUG, "Pinging connection %d", i);
  
-                /* Enqueue a ping message */
-                const size_t ping_buffer_sz = 128;
-                uint8_t ping_buffer[ping_buffer_sz];
-                bson ping;
-                bson_init_buffer(&ping, ping_buffer, ping_buffer_sz);
-                
-                bson_append_bool(&ping, "ping", true);
-                
-                bson_finish(&ping);
-                
-                wish_core_send_message(core, connection, bson_data(&ping), bson_size(&ping));
+                /* Enqueue a ping message: { ping: true } */
+                wish_core_send_message(core, connection, wish_wire_ping, WISH_WIRE_PING_LEN);
                 connection->ping_sent_timestamp = core->core_time;
-            }
-
-            if (core->core_time > (connection->latest_input_timestamp + PING_TIMEOUT) &&
-                (connection->ping_sent_timestamp > connection->latest_input_timestamp)) {
-                WISHDEBUG(LOG_CRITICAL, "Connection ping: Killing connection because of inactivity");
-                wish_close_connection(core, connection);
+                connection->ping_sent_ms = connection_time_ms(core);
             }
             break;
         case WISH_CONTEXT_IN_MAKING: {
@@ -159,20 +481,10 @@ void check_connection_liveliness(wish_core_t* core, void* ctx) {
 
 return_t wish_connections_connect_tcp(wish_core_t* core, uint8_t *luid, uint8_t *ruid, wish_ip_addr_t *ip, uint16_t port) {
     
-    wish_identity_t lu;
-    wish_identity_t ru;
-    
-    if ( RET_SUCCESS != wish_identity_load(luid, &lu) 
-            || RET_SUCCESS != wish_identity_load(ruid, &ru) )
-    {
-        wish_identity_destroy(&lu);
-        wish_identity_destroy(&ru);
+    if ( !wish_identity_is_known(luid) || !wish_identity_is_known(ruid) ) {
         return RET_FAIL;
     }
     
-    wish_identity_destroy(&lu);
-    wish_identity_destroy(&ru);
-    
     wish_connection_t* connection = wish_connection_init(core, luid, ruid);
     
     if (connection != NULL) {
@@ -183,6 +495,198 @@ return_t wish_connections_connect_tcp(wish_core_t* core, uint8_t *luid, uint8_t
     return RET_SUCCESS;
 }
 
+/* Connection attempts in progress to one peer over several candidate
+ * addresses */
+typedef struct {
+    uint8_t luid[WISH_ID_LEN];
+    uint8_t ruid[WISH_ID_LEN];
+    wish_transport_addr_t candidates[WISH_CONNECT_MAX_CANDIDATES];
+    int num_candidates;
+    int next;
+    /* Upgrading a relayed connection, only a direct connection counts */
+    bool direct;
+    /* Marks the connections dialled by this attempt */
+    uint32_t id;
+} connect_attempt_t;
+
+static uint32_t connect_attempt_seq;
+
+static bool peer_connected(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* c = &core->connection_pool[i];
+        
+        if (c->context_state == WISH_CONTEXT_CONNECTED && !c->friend_req_connection
+                && memcmp(c->luid, luid, WISH_ID_LEN) == 0 && memcmp(c->ruid, ruid, WISH_ID_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Is there a direct connection, up or being opened, from luid to ruid */
+static bool peer_direct(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* c = &core->connection_pool[i];
+        
+        if ((c->context_state == WISH_CONTEXT_CONNECTED || c->context_state == WISH_CONTEXT_IN_MAKING)
+                && !c->via_relay && !c->friend_req_connection
+                && memcmp(c->luid, luid, WISH_ID_LEN) == 0 && memcmp(c->ruid, ruid, WISH_ID_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool peer_connected_direct(wish_core_t* core, const uint8_t* luid, const uint8_t* ruid) {
+    for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* c = &core->connection_pool[i];
+        
+        if (c->context_state == WISH_CONTEXT_CONNECTED && !c->via_relay && !c->friend_req_connection
+                && memcmp(c->luid, luid, WISH_ID_LEN) == 0 && memcmp(c->ruid, ruid, WISH_ID_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void connect_attempt_next(wish_core_t* core, void* ctx) {
+    connect_attempt_t* attempt = ctx;
+    
+    if (attempt->direct ? peer_connected_direct(core, attempt->luid, attempt->ruid)
+            : peer_connected(core, attempt->luid, attempt->ruid)) {
+        /* An earlier attempt won the race */
+        wish_platform_free(attempt);
+        return;
+    }
+    
+    wish_transport_addr_t* c = &attempt->candidates[attempt->next++];
+    wish_connection_t* connection = wish_connection_init(core, attempt->luid, attempt->ruid);
+    
+    if (connection != NULL) {
+        connection->attempt_id = attempt->id;
+        wish_open_connection(core, connection, &c->ip, c->port, false);
+    }
+    
+    if (connection != NULL && attempt->next < attempt->num_candidates) {
+        wish_core_time_set_timeout(core, connect_attempt_next, attempt, WISH_CONNECT_ATTEMPT_DELAY);
+    } else {
+        wish_platform_free(attempt);
+    }
+}
+
+static return_t connect_attempt_start(wish_core_t* core, const uint8_t *luid, const uint8_t *ruid, 
+        const wish_transport_addr_t *candidates, int num_candidates, bool direct) {
+    if (num_candidates <= 0) {
+        return RET_FAIL;
+    }
+    
+    connect_attempt_t* attempt = wish_platform_malloc(sizeof (connect_attempt_t));
+    
+    if (attempt == NULL) {
+        return RET_FAIL;
+    }
+    
+    memset(attempt, 0, sizeof (connect_attempt_t));
+    memcpy(attempt->luid, luid, WISH_ID_LEN);
+    memcpy(attempt->ruid, ruid, WISH_ID_LEN);
+    attempt->direct = direct;
+    
+    if (++connect_attempt_seq == 0) {
+        connect_attempt_seq = 1;
+    }
+    attempt->id = connect_attempt_seq;
+    
+    /* Order the candidates IPv6 first, alternating the address families
+     * after that, and drop duplicates */
+    int family_idx[2] = { 0, 0 };
+    enum wish_addr_domain family = WISH_ADDR_IPV6;
+    
+    while (attempt->num_candidates < WISH_CONNECT_MAX_CANDIDATES) {
+        const wish_transport_addr_t* c = NULL;
+        int f = (family == WISH_ADDR_IPV6);
+        
+        for (int i = family_idx[f]; i < num_candidates; i++) {
+            family_idx[f] = i + 1;
+            if (candidates[i].ip.domain == family) {
+                c = &candidates[i];
+                break;
+            }
+        }
+        
+        if (c == NULL && family_idx[!f] >= num_candidates) {
+            break;
+        }
+        
+        family = (family == WISH_ADDR_IPV6 ? WISH_ADDR_IPV4 : WISH_ADDR_IPV6);
+        
+        if (c == NULL) {
+            continue;
+        }
+        
+        bool duplicate = false;
+        for (int i = 0; i < attempt->num_candidates; i++) {
+            if (memcmp(&attempt->candidates[i], c, sizeof (wish_transport_addr_t)) == 0) {
+                duplicate = true;
+            }
+        }
+        
+        if (!duplicate) {
+            attempt->candidates[attempt->num_candidates++] = *c;
+        }
+    }
+    
+    connect_attempt_next(core, attempt);
+    return RET_SUCCESS;
+}
+
+return_t wish_connections_connect_candidates(wish_core_t* core, const uint8_t *luid, const uint8_t *ruid, 
+        const wish_transport_addr_t *candidates, int num_candidates) {
+    return connect_attempt_start(core, luid, ruid, candidates, num_candidates, false);
+}
+
+void wish_connections_attempt_won(wish_core_t* core, wish_connection_t* connection) {
+    if (connection->attempt_id == 0) {
+        return;
+    }
+    
+    for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+        wish_connection_t* c = &core->connection_pool[i];
+        
+        if (c != connection && c->attempt_id == connection->attempt_id 
+                && c->context_state == WISH_CONTEXT_IN_MAKING) {
+            wish_close_connection(core, c);
+        }
+    }
+}
+
+void wish_connections_upgrade(wish_core_t* core, void *_connection) {
+    wish_connection_t *connection = (wish_connection_t *) _connection;
+    
+    if (connection->context_state != WISH_CONTEXT_CONNECTED || !connection->via_relay 
+            || connection->friend_req_connection) {
+        return;
+    }
+    
+    if (peer_direct(core, connection->luid, connection->ruid)) {
+        /* Already upgrading, or the relayed connection is about to be
+         * closed */
+        return;
+    }
+    
+    /* The handshake only carries the relay servers of the peer, the
+     * addresses where it can be reached directly are known from local
+     * discovery */
+    wish_ldiscover_t* elt = wish_ldiscover_find(core, connection->ruid, connection->rhid);
+    
+    if (elt == NULL || elt->num_transports == 0) {
+        return;
+    }
+    
+    WISHDEBUG(LOG_CRITICAL, "Upgrading relayed connection (luid: %02x %02x, ruid: %02x %02x) to direct", 
+            connection->luid[0], connection->luid[1], connection->ruid[0], connection->ruid[1]);
+    connect_attempt_start(core, connection->luid, connection->ruid, elt->transports, elt->num_transports, true);
+}
+
 void wish_close_parallel_connections(wish_core_t *core, void *_connection) {
     wish_connection_t *connection = (wish_connection_t *) _connection;
     
@@ -190,6 +694,21 @@ void wish_close_parallel_connections(wish_core_t *core, void *_connection) {
         return;
     }
     
+    /* Keep the direct connection, if this one is relayed */
+    if (connection->via_relay) {
+        for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
+            wish_connection_t *c = &core->connection_pool[i];
+            
+            if (c != connection && c->context_state == WISH_CONTEXT_CONNECTED && !c->via_relay
+                    && memcmp(c->luid, connection->luid, WISH_ID_LEN) == 0
+                    && memcmp(c->ruid, connection->ruid, WISH_ID_LEN) == 0
+                    && memcmp(c->rhid, connection->rhid, WISH_WHID_LEN) == 0) {
+                wish_close_connection(core, connection);
+                return;
+            }
+        }
+    }
+    
     for (int i = 0; i < WISH_CONTEXT_POOL_SZ; i++) {
         wish_connection_t *c = &core->connection_pool[i];
 
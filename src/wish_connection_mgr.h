@@ -19,6 +19,16 @@
 #define PING_INTERVAL 10    /* seconds */
 #define PING_TIMEOUT (PING_INTERVAL + 30) /* seconds, must be larger than PING_INTERVAL */
 
+/* The ping interval of a connection grows by PING_INTERVAL with each
+ * pong, up to this. A connection which carries traffic is not pinged. */
+#define PING_INTERVAL_MAX 30 /* seconds */
+
+/* Bounds for the time to wait for a pong. Within them the wait is four
+ * times the retransmission timeout computed from the measured round-trip
+ * times (RFC 6298), and the upper bound until there are measurements. */
+#define PING_RESPONSE_TIMEOUT_MIN 10 /* seconds */
+#define PING_RESPONSE_TIMEOUT_MAX (PING_TIMEOUT - PING_INTERVAL) /* seconds */
+
 #define CONNECTION_TIMEOUT 30 /* seconds */
 
 /** Timeout of connection in making */
@@ -43,10 +53,43 @@ void wish_close_connection(wish_core_t* core, wish_connection_t* connection);
 
 void wish_connections_close_all(wish_core_t* core);
 
+/** The number of contacts dialed at the same time by wish_connections_check */
+#define WISH_CONNECT_MAX_IN_FLIGHT 8
+
+/** Seconds over which the dials queued by one wish_connections_check are spread */
+#define WISH_CONNECT_SPREAD 30
+
+/** Backoff of a contact which could not be reached: the first retry is
+ * after WISH_CONNECT_BACKOFF_MIN seconds, doubling up to WISH_CONNECT_BACKOFF_MAX */
+#define WISH_CONNECT_BACKOFF_MIN 60
+#define WISH_CONNECT_BACKOFF_MAX (30*60)
+
+/**
+ * Queue a connection attempt to each contact which is not connected.
+ * The attempts are made by a scheduler, at most
+ * WISH_CONNECT_MAX_IN_FLIGHT at a time and spread over
+ * WISH_CONNECT_SPREAD seconds. A contact that could not be reached is
+ * retried with exponential backoff.
+ */
 void wish_connections_check(wish_core_t* core);
 
+/**
+ * The local identities to connect to ruid from: the ones ruid has been
+ * connected with, or if there are none, all of our identities.
+ * 
+ * @param luids filled with pointers to the uids in core->local_uid_list
+ * @return the number of luids
+ */
+int wish_connections_plan(wish_core_t* core, const uint8_t* ruid, const uint8_t** luids, int max);
+
 void check_connection_liveliness(wish_core_t* core, void* ctx);
 
+/**
+ * To be called when a pong is received. Updates the round-trip time of
+ * the connection.
+ */
+void wish_connection_pong_received(wish_core_t* core, wish_connection_t* connection);
+
 /**
  * Get the local host IP addr formatted as a C string. The retuned
  * address should be the one which is the subnet having the host's
@@ -67,4 +110,49 @@ void wish_set_host_port(wish_core_t* core, uint16_t port);
 
 return_t wish_connections_connect_tcp(wish_core_t* core, uint8_t *luid, uint8_t *ruid, wish_ip_addr_t *ip, uint16_t port);
 
+/** The maximum number of addresses tried when connecting to a peer */
+#define WISH_CONNECT_MAX_CANDIDATES 8
+
+/** Seconds until the next candidate address is tried, if no connection
+ * has been established yet. The earlier attempts are left running. */
+#define WISH_CONNECT_ATTEMPT_DELAY 1
+
+/**
+ * Connect to a peer which has several addresses, "happy eyeballs" style
+ * (RFC 8305): the candidates are tried IPv6 first and then alternating
+ * between IPv6 and IPv4, a new attempt starting every
+ * WISH_CONNECT_ATTEMPT_DELAY seconds until the peer is connected. The
+ * first attempt to complete its handshake closes the others, see
+ * wish_connections_attempt_won.
+ *
+ * The candidates are copied.
+ */
+return_t wish_connections_connect_candidates(wish_core_t* core, const uint8_t *luid, const uint8_t *ruid, 
+        const wish_transport_addr_t *candidates, int num_candidates);
+
+/** Seconds after a relayed connection is established until a direct
+ * connection to the peer is tried */
+#define WISH_CONNECT_UPGRADE_DELAY 2
+
+/**
+ * Close the other connections of the connect attempt which dialled
+ * connection, to be called when its handshake is complete. Closing them
+ * before they come up keeps the parallel connection check from closing
+ * the winner later.
+ */
+void wish_connections_attempt_won(wish_core_t* core, wish_connection_t* connection);
+
+/**
+ * Try a direct connection to the peer of a relayed connection, at the
+ * addresses the peer has announced in local discovery. The attempts run
+ * until a direct connection is up, and then the relayed connection is
+ * closed as a parallel connection.
+ */
+void wish_connections_upgrade(wish_core_t* core, void *connection);
+
+/**
+ * Close the other connections to the same remote host and identity.
+ * A relayed connection is closed instead, if a direct connection is
+ * already up.
+ */
 void wish_close_parallel_connections(wish_core_t* core, void *connection);
@@ -14,6 +14,8 @@
  */
 #include "wish_core.h"
 #include "wish_identity.h"
+#include "wish_local_discovery.h"
+#include "wish_relay_client.h"
 
 #include "string.h"
 
@@ -26,15 +28,39 @@ int wish_core_update_identities(wish_core_t* core) {
     memset(core->uid_list, 0, sizeof(core->uid_list));
     core->loaded_num_ids = wish_load_uid_list(core->uid_list, core->num_ids);
     
+    /* The advertisements are indexed like uid_list */
+    wish_ldiscover_invalidate_adverts(core);
+    
     //printf("Number of loaded identities: %i\n", core->loaded_num_ids);
     
+    core->num_local_ids = 0;
+    
     int i = 0;
-    for (i = 0; i < core->num_ids; i++) {
+    for (i = 0; i < core->loaded_num_ids; i++) {
         wish_identity_t id;
         memset(&id, 0, sizeof (wish_identity_t));
         return_t load_retval = wish_identity_load(core->uid_list[i].uid, &id);
+        
+        if (load_retval == RET_SUCCESS && id.has_privkey) {
+            memcpy(&core->local_uid_list[core->num_local_ids++], &core->uid_list[i], sizeof (wish_uid_list_elem_t));
+        }
+        
         wish_identity_destroy(&id);
     }
     
+    /* One relay session per local identity */
+    wish_relay_client_update_identities(core);
+    
     return 0;
 }
+
+bool wish_core_is_local_uid(wish_core_t* core, const uint8_t* uid) {
+    int i = 0;
+    
+    for (i = 0; i < core->num_local_ids; i++) {
+        if (memcmp(core->local_uid_list[i].uid, uid, WISH_ID_LEN) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
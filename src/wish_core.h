@@ -43,6 +43,10 @@ typedef struct {
 #include "wish_rpc.h"
 #include "bson.h"
 
+#ifndef WISH_PORT_BSON_ARENA_SZ
+#define WISH_PORT_BSON_ARENA_SZ ( 4*1024 )
+#endif
+
 typedef struct {
     uint8_t name[WISH_PROTOCOL_NAME_MAX_LEN];
 } wish_protocol_t;
@@ -54,6 +58,8 @@ typedef struct wish_service_entry {
     uint8_t wsid[WISH_WSID_LEN];
     char name[WISH_APP_NAME_MAX_LEN];
     wish_protocol_t protocols[WISH_APP_MAX_PROTOCOLS]; 
+    /* Peer changes are sent in { type: "peers" } messages */
+    bool peer_batch;
     //uint8_t permissions[WISH_PERMISSION_NAME_MAX_LEN][WISH_APP_MAX_PERMISSIONS];
 } wish_app_entry_t;
 
@@ -95,11 +101,18 @@ typedef struct wish_claim_t {
 */
 
 struct wish_context;
+struct wish_connect_scheduler;
+struct wish_core_signals;
+struct wish_peer_state;
 struct wish_ldiscover_t;
+struct wish_ldiscover_adverts_t;
+struct wish_ldiscover_unknown_t;
 struct wish_relationship_t;
 struct wish_relay_client_ctx;
 struct wish_acl;
 struct wish_directory;
+struct wish_service_channel;
+struct wish_service_route;
 
 /**
  * Wish Core object
@@ -118,6 +131,9 @@ typedef struct wish_core {
     int num_ids;
     int loaded_num_ids;
     wish_uid_list_elem_t uid_list[WISH_PORT_MAX_UIDS];
+    /* Our own identities, the ones with a private key, in uid_list order */
+    int num_local_ids;
+    wish_uid_list_elem_t local_uid_list[WISH_PORT_MAX_UIDS];
     
     /* RPC Servers */
     #ifdef WISH_RPC_SERVER_STATIC_REQUEST_POOL
@@ -128,9 +144,16 @@ typedef struct wish_core {
     rpc_server* core_api;
     rpc_server* app_api;
     rpc_server* friend_req_api;
+    /* Subscribers of signals, on core_api and app_api */
+    struct wish_core_signals* signals;
     
     /* Services */
     struct wish_service_entry* service_registry;
+    struct wish_service_channel* service_channels;
+    int next_channel_id;
+    struct wish_service_route* service_routes;
+    /* Peer states reported to the services */
+    struct wish_peer_state* peer_state;
     
     rpc_client* core_rpc_client;
     
@@ -141,6 +164,7 @@ typedef struct wish_core {
     /* Connections */
     struct wish_context* connection_pool;
     wish_connection_id_t next_conn_id;
+    struct wish_connect_scheduler* connect_scheduler;
     
     /* Instantiate Relay client to a server with specied IP addr and port */
     struct wish_relay_client_ctx* relay_db;
@@ -148,6 +172,10 @@ typedef struct wish_core {
     /* Local discovery */
     bool ldiscover_allowed;
     struct wish_ldiscover_t* ldiscovery_db;
+    /** Locally discovered entries, least recently seen first */
+    struct wish_ldiscover_t* ldiscover_expiry;
+    struct wish_ldiscover_adverts_t* ldiscover_adverts;
+    struct wish_ldiscover_unknown_t* ldiscover_unknown;
     
     /* Relationship management */
     struct wish_relationship_req_t* relationship_req_db;
@@ -158,12 +186,19 @@ typedef struct wish_core {
     
     /* Wish Directory */
     struct wish_directory* directory;
+    
+    /* Scratch memory for the bson documents built while handling a
+     * request, reset once per round of the event loop */
+    bson_arena arena;
 } wish_core_t;
 
 #include "wish_config.h"
 
 int wish_core_update_identities(wish_core_t* core);
 
+/** Returns true if uid is one of our own identities */
+bool wish_core_is_local_uid(wish_core_t* core, const uint8_t* uid);
+
 #ifdef __cplusplus
 }
 #endif
@@ -52,6 +52,7 @@
 #include "wish_debug.h"
 #include "wish_port_config.h"
 #include "wish_relationship.h"
+#include "wish_peer_state.h"
 
 typedef struct wish_rpc_server_handler handler;
 
@@ -64,7 +65,7 @@ static void methods(rpc_server_req* req, const uint8_t* args) {
     handler *h = core->app_api->handlers;
     
     bson bs; 
-    bson_init(&bs);
+    bson_init_arena(&bs, &core->arena, 4096);
     bson_append_start_object(&bs, "data");
     
     while (h != NULL) {
@@ -93,9 +94,10 @@ static void methods(rpc_server_req* req, const uint8_t* args) {
  *   v0.6.8
  */
 static void version(rpc_server_req* req, const uint8_t* args) {
+    wish_core_t* core = (wish_core_t*) req->server->context;
     
     bson bs; 
-    bson_init(&bs);
+    bson_init_arena(&bs, &core->arena, 128);
     bson_append_string(&bs, "data", WISH_CORE_VERSION_STRING);
     bson_finish(&bs);
     
@@ -174,6 +176,9 @@ handler version_h =                                   { .op = "version",
 
 handler services_send_h =                             { .op = "services.send",                     .handler = wish_api_services_send, .args = "(peer: Peer, payload: Buffer): bool", .doc = "Send payload to peer." };
 handler services_list_h =                             { .op = "services.list",                     .handler = wish_api_services_list, .args = "(void): Service[]", .doc = "List local services." };
+handler services_open_channel_h =                     { .op = "services.openChannel",              .handler = wish_api_services_open_channel, .args = "(peer: Peer): number", .doc = "Open a channel for sending to peer." };
+handler services_send_batch_h =                       { .op = "services.sendBatch",                .handler = wish_api_services_send_batch, .args = "(channel: number, payloads: Buffer[]): number", .doc = "Send payloads on channel." };
+handler services_close_channel_h =                    { .op = "services.closeChannel",             .handler = wish_api_services_close_channel, .args = "(channel: number): bool", .doc = "Close channel." };
 
 handler identity_list_h =                             { .op = "identity.list",                     .handler = wish_api_identity_list, .args="(void): Identity[]" };
 handler identity_export_h =                           { .op = "identity.export",                   .handler = wish_api_identity_export, .args="(void): Document" };
@@ -248,6 +253,9 @@ void wish_core_app_rpc_init(wish_core_t* core) {
     
     rpc_server_register(core->app_api, &services_send_h);
     rpc_server_register(core->app_api, &services_list_h);
+    rpc_server_register(core->app_api, &services_open_channel_h);
+    rpc_server_register(core->app_api, &services_send_batch_h);
+    rpc_server_register(core->app_api, &services_close_channel_h);
     
     rpc_server_register(core->app_api, &identity_list_h);
     rpc_server_register(core->app_api, &identity_create_h);
@@ -322,6 +330,7 @@ void wish_core_app_rpc_cleanup_requests(wish_core_t* core, struct wish_service_e
         if (elm->context == service_entry_offline) {
             //WISHDEBUG(LOG_CRITICAL, "App rpc server clean up: request op %s", elm->op_str);
             LL_DELETE(core->app_api->requests, elm);
+            wish_core_signals_remove_req(core, elm);
             
 #ifdef WISH_RPC_SERVER_STATIC_REQUEST_POOL
             memset(&(elm->request_ctx), 0, sizeof(rpc_server_req));
@@ -340,48 +349,25 @@ void wish_send_peer_update_locals(wish_core_t* core, const uint8_t* sid, struct
         return;
     }
     
-    wish_uid_list_elem_t local_id_list[WISH_NUM_LOCAL_IDS];
-    int num_local_ids = wish_get_local_identity_list(local_id_list, WISH_NUM_LOCAL_IDS);
-    if (num_local_ids == 0) {
+    if (core->num_local_ids == 0) {
         WISHDEBUG(LOG_CRITICAL, "Unexpected: no local identities");
         return;
-    } else {
-        WISHDEBUG(LOG_DEBUG, "Local id list: %i", num_local_ids);
     }
     
     uint8_t local_hostid[WISH_WHID_LEN];
     wish_core_get_host_id(core, local_hostid);
-            
+    
+    wish_peer_t peer = { .rhid = local_hostid, .rsid = service_entry->wsid, 
+            /* FIXME support more protocols than just one */
+            .protocol = (const char*) service_entry->protocols[0].name, .local = true };
             
     int i = 0;
     int j = 0;
-    for (i = 0; i < num_local_ids; i++) {
-        for (j = 0; j < num_local_ids; j++) {
-            bson bs;
-            int buffer_len = 2 * WISH_ID_LEN + WISH_WSID_LEN + WISH_WHID_LEN + WISH_PROTOCOL_NAME_MAX_LEN + 200;
-            uint8_t buffer[buffer_len];
-            bson_init_buffer(&bs, buffer, buffer_len);
-            
-            bson_append_string(&bs, "type", "peer");
-            bson_append_start_object(&bs, "peer");
-            bson_append_binary(&bs, "luid", (uint8_t*) local_id_list[i].uid, WISH_ID_LEN);
-            bson_append_binary(&bs, "ruid", (uint8_t*) local_id_list[j].uid, WISH_ID_LEN);
-            bson_append_binary(&bs, "rsid", (uint8_t*) service_entry->wsid, WISH_WSID_LEN);
-            bson_append_binary(&bs, "rhid", (uint8_t*) local_hostid, WISH_ID_LEN);
-            /* FIXME support more protocols than just one */
-            bson_append_string(&bs, "protocol", service_entry->protocols[0].name);   
-            bson_append_string(&bs, "type", "N");
-            bson_append_bool(&bs, "online", online);
-            bson_append_finish_object(&bs);
-           
-            bson_finish(&bs);
-            if (bs.err) {
-                WISHDEBUG(LOG_CRITICAL, "BSON error when creating peer message: %i %s len %i", bs.err, bs.errstr, bs.dataSize);
-            }
-            else {
-                //WISHDEBUG(LOG_CRITICAL, "wish_core_app_rpc_func: wish_send_peer_update_locals: online");
-                send_core_to_app(core, sid, (uint8_t *) bson_data(&bs), bson_size(&bs));
-            }
+    for (i = 0; i < core->num_local_ids; i++) {
+        for (j = 0; j < core->num_local_ids; j++) {
+            peer.luid = core->local_uid_list[i].uid;
+            peer.ruid = core->local_uid_list[j].uid;
+            wish_peer_state_set(core, sid, &peer, online);
         }
     }
 }
@@ -36,6 +36,16 @@
 
 #include "utlist.h"
 #include "wish_connection_mgr.h"
+#include "wish_wire.h"
+#include "wish_peer_state.h"
+
+/* Paths into the replies to peers and friendRequest */
+static const bson_path data_protocol_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("protocol") } };
+static const bson_path data_rsid_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("rsid") } };
+static const bson_path data_name_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("name") } };
+static const bson_path data_online_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("online") } };
+static const bson_path data_data_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("data") } };
+static const bson_path data_meta_path = { 2, { BSON_PATH_KEY("data"), BSON_PATH_KEY("meta") } };
 
 void wish_send_peer_update(wish_core_t* core, struct wish_service_entry *service_entry, bool online) {
     int buffer_len = 300;
@@ -190,7 +200,7 @@ void peers_callback(rpc_client_req* req, void* context, const uint8_t* payload,
     
     bson_iterator_from_buffer(&it, payload);
     
-    if (bson_find_fieldpath_value("data.protocol", &it) != BSON_STRING) {
+    if (bson_find_path(&data_protocol_path, &it) != BSON_STRING) {
         WISHDEBUG(LOG_CRITICAL, "No data.protocol in peers_callback!");
         return;
     }
@@ -199,7 +209,7 @@ void peers_callback(rpc_client_req* req, void* context, const uint8_t* payload,
 
     bson_iterator_from_buffer(&it, payload);
     
-    if (bson_find_fieldpath_value("data.rsid", &it) != BSON_BINDATA) {
+    if (bson_find_path(&data_rsid_path, &it) != BSON_BINDATA) {
         WISHDEBUG(LOG_CRITICAL, "No data.rsid in peers_callback!");
         return;
     }
@@ -210,14 +220,14 @@ void peers_callback(rpc_client_req* req, void* context, const uint8_t* payload,
 
     const uint8_t* name = NULL;
     
-    if (bson_find_fieldpath_value("data.name", &it) == BSON_STRING) {
+    if (bson_find_path(&data_name_path, &it) == BSON_STRING) {
         //WISHDEBUG(LOG_CRITICAL, "No data.name in peers_callback!");
         name = bson_iterator_string(&it);
     }
 
     bson_iterator_from_buffer(&it, payload);
     
-    if (bson_find_fieldpath_value("data.online", &it) != BSON_BOOL) {
+    if (bson_find_path(&data_online_path, &it) != BSON_BOOL) {
         WISHDEBUG(LOG_CRITICAL, "No data.online in peers_callback!");
         return;
     }
@@ -231,31 +241,11 @@ void peers_callback(rpc_client_req* req, void* context, const uint8_t* payload,
     wish_core_add_remote_service(connection, name, rsid, protocol);
 
     
-    /* Build Core-to-App message indicating the new peer */
-    int l = 356;
-    char buf[l];
-
-    bson b;
-    bson_init_buffer(&b, buf, l);
-    bson_append_string(&b, "type", "peer");
-    bson_append_start_object(&b, "peer");
-    bson_append_binary(&b, "luid", connection->luid, WISH_UID_LEN);
-    bson_append_binary(&b, "ruid", connection->ruid, WISH_UID_LEN);
-    bson_append_binary(&b, "rhid", connection->rhid, WISH_UID_LEN);
-    bson_append_binary(&b, "rsid", rsid, WISH_WSID_LEN);
-    bson_append_string(&b, "protocol", protocol);
-    bson_append_bool(&b, "online", online);
-    bson_append_finish_object(&b);
-    bson_finish(&b);
-
-    if (b.err) {
-        WISHDEBUG(LOG_CRITICAL, "bs.err in peers_callback: %s", b.errstr);
-        return;
-    }
-    
+    /* Report the peer to the services of this core, which have the
+     * specified protocol */
+    wish_peer_t peer = { .luid = connection->luid, .ruid = connection->ruid, .rhid = connection->rhid, 
+            .rsid = rsid, .protocol = protocol };
 
-    /* Send the peer information to all the services of this core, which
-     * have the specified protocol */
     struct wish_service_entry *registry = wish_service_get_registry(core);
     if (registry == NULL) {
         WISHDEBUG(LOG_CRITICAL, "App registry is null");
@@ -266,17 +256,21 @@ void peers_callback(rpc_client_req* req, void* context, const uint8_t* payload,
     
     for (i = 0; i < WISH_MAX_SERVICES; i++) {
         if (wish_service_entry_is_valid(core, &(registry[i]))) {
-            //WISHDEBUG(LOG_CRITICAL, "Service entry is valid");
             if (strncmp(((const char*) &(registry[i].protocols[0].name)), protocol, WISH_PROTOCOL_NAME_MAX_LEN) == 0) {
-                //WISHDEBUG(LOG_CRITICAL, "core 0x%02x%02x: wish_core_rpc_func: peers_callback: %s", core->id[0], core->id[1], online ? "online" : "offline");
-                send_core_to_app(core, registry[i].wsid, (char*)bson_data(&b), bson_size(&b));
+                wish_peer_state_set(core, registry[i].wsid, &peer, online);
             }
         }
     }
-
-
 }
 
+/* args: [ rsid, lsid, protocol, payload ] */
+static const bson_extract_field send_op_schema[] = {
+    { .fpath = "0", .type = BSON_BINDATA, .len = WISH_UID_LEN },
+    { .fpath = "1", .type = BSON_BINDATA, .len = WISH_UID_LEN },
+    { .fpath = "2", .type = BSON_STRING },
+    { .fpath = "3", .type = BSON_BINDATA },
+};
+
 /**
  * Core to core send handler
  * 
@@ -291,64 +285,44 @@ static void send_op_handler(rpc_server_req* req, const uint8_t* args) {
     //bson_visit("Handling send request from remote core!", args_array);
     wish_core_t* core = req->server->context;
 
-    bson_iterator it;
-    
-    bson_iterator_from_buffer(&it, args);
-    
-    if (bson_find_fieldpath_value("0", &it) != BSON_BINDATA) {
-        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get rsid");
-        rpc_server_error_msg(req, 41, "rsid not Buffer.");
-        return;
-    }
+    wish_wire_send_args_t send;
     
-    if (bson_iterator_bin_len(&it) != WISH_UID_LEN) {
-        WISHDEBUG(LOG_CRITICAL, "send_op_handler: rsid not Buffer(32)");
-        rpc_server_error_msg(req, 41, "rsid not Buffer(32).");
-        return;
-    }
-   
-    /* The remote wsid, the originator of this message, is element "0" */
-    const uint8_t *rsid = bson_iterator_bin_data(&it);
-    
-    bson_iterator_from_buffer(&it, args);
-    
-    if (bson_find_fieldpath_value("1", &it) != BSON_BINDATA) {
-        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get lsid");
-        rpc_server_error_msg(req, 41, "lsid not Buffer.");
-        return;
-    }
-    
-    if (bson_iterator_bin_len(&it) != WISH_UID_LEN) {
-        WISHDEBUG(LOG_CRITICAL, "send_op_handler: lsid not Buffer(32)");
-        rpc_server_error_msg(req, 41, "lsid not Buffer(32).");
-        return;
-    }
-   
-    /* Take element 1 of args_array. That is the destination wsid */
-    const uint8_t *lsid = bson_iterator_bin_data(&it);
+    /* Fast path for the layout written by other cores, see wish_wire.h */
+    if (!wish_wire_decode_send_args(args, &send)) {
+        bson_iterator it[4];
 
-    /* The protocol is element 2 */
-    bson_iterator_from_buffer(&it, args);
-    
-    if (bson_find_fieldpath_value("2", &it) != BSON_STRING) {
-        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get protocol");
-        rpc_server_error_msg(req, 41, "Protocol not string.");
-        return;
-    }
-    
-    const char* protocol = bson_iterator_string(&it);
+        switch (bson_extract(args, send_op_schema, 4, it)) {
+            case -1:
+                break;
+            case 0:
+                WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get rsid");
+                rpc_server_error_msg(req, 41, bson_iterator_type(&it[0]) == BSON_BINDATA ? "rsid not Buffer(32)." : "rsid not Buffer.");
+                return;
+            case 1:
+                WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get lsid");
+                rpc_server_error_msg(req, 41, bson_iterator_type(&it[1]) == BSON_BINDATA ? "lsid not Buffer(32)." : "lsid not Buffer.");
+                return;
+            case 2:
+                WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get protocol");
+                rpc_server_error_msg(req, 41, "Protocol not string.");
+                return;
+            default:
+                WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get payload");
+                rpc_server_error_msg(req, 41, "payload not Buffer.");
+                return;
+        }
+   
+        /* The remote wsid, the originator of this message, is element "0" */
+        send.rsid = bson_iterator_bin_data(&it[0]);
+        /* Element 1 is the destination wsid */
+        send.lsid = bson_iterator_bin_data(&it[1]);
+        /* The protocol is element 2 */
+        send.protocol = bson_iterator_string(&it[2]);
 
-    bson_iterator_from_buffer(&it, args);
-    
-    if (bson_find_fieldpath_value("3", &it) != BSON_BINDATA) {
-        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Could not get payload");
-        rpc_server_error_msg(req, 41, "payload not Buffer.");
-        return;
+        send.payload = bson_iterator_bin_data(&it[3]);
+        send.payload_len = bson_iterator_bin_len(&it[3]);
     }
     
-    const uint8_t* payload = bson_iterator_bin_data(&it);
-    int32_t payload_len = bson_iterator_bin_len(&it);
-    
     /* Create new document 
      * Add a type:frame element, and build a peer document:
      * { luid, ruid, rhid, rsid, protocol } and add it add peer element.
@@ -356,29 +330,34 @@ static void send_op_handler(rpc_server_req* req, const uint8_t* args) {
      * "data".
      */
 
-    size_t buf_len = 4*WISH_ID_LEN + WISH_PROTOCOL_NAME_MAX_LEN + 100 + payload_len;
-    uint8_t buf[buf_len];
-    
-    bson bs;
-    bson_init_buffer(&bs, buf, buf_len);
-
     wish_connection_t* connection = req->ctx;
+    wish_wire_header_t header;
     
-    bson_append_string(&bs, "type", "frame");
-
     /* luid, ruid, rhid are obtained from the wish_connection */
-    bson_append_start_object(&bs, "peer");
-    bson_append_binary(&bs, "luid", connection->luid, WISH_ID_LEN);
-    bson_append_binary(&bs, "ruid", connection->ruid, WISH_ID_LEN);
-    bson_append_binary(&bs, "rhid", connection->rhid, WISH_WHID_LEN);
-    bson_append_binary(&bs, "rsid", rsid, WISH_WSID_LEN);
-    bson_append_string(&bs, "protocol", protocol);
-    bson_append_finish_object(&bs);
-    
-    bson_append_binary(&bs, "data", payload, payload_len); 
-    bson_finish(&bs);
+    if (!wish_wire_frame_header(&header, connection->luid, connection->ruid, connection->rhid, send.rsid, send.protocol)) {
+        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Protocol too long");
+        rpc_server_error_msg(req, 41, "Protocol too long.");
+        return;
+    }
+    
+    /* The payload is forwarded from the incoming message, only the frame
+     * around it is written here */
+    wish_wire_envelope_t env;
+    if (wish_wire_envelope(&header, &env, send.payload_len) == 0) {
+        WISHDEBUG(LOG_CRITICAL, "send_op_handler: Payload too large");
+        rpc_server_error_msg(req, 41, "Payload too large.");
+        return;
+    }
+    
+    wish_ipc_buf_t frame[3] = {
+        { env.head, env.head_len },
+        { send.payload, send.payload_len },
+        { env.tail, env.tail_len }
+    };
     
-    send_core_to_app(core, lsid, bson_data(&bs), bson_size(&bs));
+    /* The app must know the sender is online before it gets its frames */
+    wish_peer_state_flush(core);
+    send_core_to_app_v(core, send.lsid, frame, 3);
     rpc_server_send(req, NULL, 0);
 }
 
@@ -584,7 +563,7 @@ static void friend_req_callback(rpc_client_req* req, void* context, const uint8_
     
     bson_iterator data_it;
     bson_iterator_from_buffer(&data_it, payload);
-    bson_type type = bson_find_fieldpath_value("data.data", &data_it);
+    bson_type type = bson_find_path(&data_data_path, &data_it);
     if ( type != BSON_BINDATA ) {
         WISHDEBUG(LOG_CRITICAL, "Could not import friend cert, data.data not BSON_BINDATA, is type %i", type );
         return;
@@ -611,7 +590,7 @@ static void friend_req_callback(rpc_client_req* req, void* context, const uint8_
     
     /* Get the meta part from data; reset iterator */
     bson_iterator_from_buffer(&data_it, payload);
-    type = bson_find_fieldpath_value("data.meta", &data_it);
+    type = bson_find_path(&data_meta_path, &data_it);
     if ( type != BSON_BINDATA ) {
         WISHDEBUG(LOG_CRITICAL, "Could not import friend metadata, data.meta not BSON_BINDATA, is type %i", type );
         return;
@@ -926,11 +905,8 @@ void wish_core_send_peers_rpc_req(wish_core_t* core, wish_connection_t* connecti
  *  in ACLs, or service has shutdown). In that case the remote core will
  *  send offline messages over the Wish connection 
  *
- * Note that in contrast to online messages, offline messages do not
- * include information on the remote service id, or the protocol. 
- * The local wish core unconditionally delivers the offline message to 
- * each local service, regardless if the service got a online signal
- * before or not. FIXME this might not be the correct behaviour!
+ * The messages go out through wish_peer_state_set, so a service gets
+ * the offline message only for peers it was told to be online.
  *
  * @param ctx is the pointer to the wish connection context were luid, ruid and
  * rhid are taken. 
@@ -948,32 +924,11 @@ void wish_send_online_offline_signal_to_apps(wish_core_t* core, wish_connection_
             continue;
         }
         
-        /* Build Core-to-App message indicating the severed link */
-        int32_t core_to_app_max_len = 288;
-        uint8_t core_to_app[core_to_app_max_len];
-        
-        bson bs;
-        bson_init_buffer(&bs, core_to_app, core_to_app_max_len);
-        
-        bson_append_string(&bs, "type", "peer");
-        
         /* luid, ruid and rhid come from the wish context */
-        bson_append_start_object(&bs, "peer");
-        bson_append_binary(&bs, "luid", connection->luid, WISH_ID_LEN);
-        bson_append_binary(&bs, "ruid", connection->ruid, WISH_ID_LEN);
-        bson_append_binary(&bs, "rhid", connection->rhid, WISH_WHID_LEN);
-        bson_append_binary(&bs, "rsid", service->rsid, WISH_WSID_LEN);
-        bson_append_string(&bs, "protocol", service->protocol);
-        bson_append_bool(&bs, "online", online);
-        bson_append_finish_object(&bs);
-        bson_finish(&bs);
-        
-        if(bs.err) {
-            WISHDEBUG(LOG_CRITICAL, "wish_send_online_offline_signal_to_apps: error encoding bson: %s", bs.errstr);
-            return;
-        }
+        wish_peer_t peer = { .luid = connection->luid, .ruid = connection->ruid, .rhid = connection->rhid, 
+                .rsid = service->rsid, .protocol = service->protocol };
 
-        /* Send the peer offline information to all the services of this core */
+        /* Report the peer to all the services of this core */
         struct wish_service_entry *registry = wish_service_get_registry(core);
         if (registry == NULL) {
             WISHDEBUG(LOG_CRITICAL, "App registry is null");
@@ -983,9 +938,7 @@ void wish_send_online_offline_signal_to_apps(wish_core_t* core, wish_connection_
         int i = 0;
         for (i = 0; i < WISH_MAX_SERVICES; i++) {
             if (wish_service_entry_is_valid(core, &(registry[i]))) {
-                //bson_visit("This is peer info", peer_info);
-                //WISHDEBUG(LOG_CRITICAL, "wish_core_rpc_func: wish_send_online_offline_signal_to_apps: (len %d)", bson_size(&bs));
-                send_core_to_app(core, registry[i].wsid, bson_data(&bs), bson_size(&bs));
+                wish_peer_state_set(core, registry[i].wsid, &peer, online);
             }
         }
 
@@ -1017,6 +970,7 @@ void wish_cleanup_core_rpc_server(wish_core_t* core, wish_connection_t* connecti
         if (elm->ctx == (void*) connection) {
             //WISHDEBUG(LOG_CRITICAL, "Core disconnect clean up: Deleting outstanding rpc request: %s", elm->op);
             LL_DELETE(core->core_api->requests, elm);
+            wish_core_signals_remove_req(core, elm);
             
 #ifdef WISH_RPC_SERVER_STATIC_REQUEST_POOL
             memset(&(elm->request_ctx), 0, sizeof(rpc_server_req));
@@ -12,10 +12,176 @@
  *
  * @license Apache-2.0
  */
+#include <string.h>
 #include "wish_core_signals.h"
+#include "wish_platform.h"
+#include "wish_time.h"
+#include "wish_debug.h"
+#include "utlist.h"
+#include "uthash.h"
+
+/* A signals request. Requests ended by their owner are only noticed when
+ * the request is no longer on the server, so the id and the owner (the
+ * app entry or the connection) are kept, to tell the request apart from
+ * another one reusing the memory. Requests cleaned up with their owner
+ * are removed by wish_core_signals_remove_req. */
+typedef struct wish_signal_sub {
+    rpc_server_req* req;
+    rpc_server* server;
+    rpc_id id;
+    void* context;
+    void* ctx;
+    struct wish_signal_sub* next;
+} wish_signal_sub_t;
+
+typedef struct wish_signal_topic {
+    char topic[WISH_SIGNALS_TOPIC_LEN];
+    wish_signal_sub_t* subs;
+    UT_hash_handle hh;
+} wish_signal_topic_t;
+
+struct wish_core_signals {
+    /* topic -> requests with that filter */
+    wish_signal_topic_t* topics;
+    /* Requests without a filter */
+    wish_signal_sub_t* all;
+    /* Topics emitted since the last flush */
+    char pending[WISH_SIGNALS_PENDING_MAX][WISH_SIGNALS_TOPIC_LEN];
+    int num_pending;
+    bool flush_scheduled;
+};
+
+static struct wish_core_signals* signals_get(wish_core_t* core) {
+    if (core->signals == NULL) {
+        core->signals = wish_platform_malloc(sizeof (struct wish_core_signals));
+        if (core->signals != NULL) {
+            memset(core->signals, 0, sizeof (struct wish_core_signals));
+        }
+    }
+    return core->signals;
+}
+
+/* The rpc server frees the request when it ends, so check that it is
+ * still among the requests of the server */
+static bool sub_alive(wish_signal_sub_t* sub) {
+    rpc_server_req* elm;
+    
+    LL_FOREACH(sub->server->requests, elm) {
+        if (elm == sub->req) {
+            return elm->id == sub->id && elm->context == sub->context && elm->ctx == sub->ctx;
+        }
+    }
+    return false;
+}
+
+static void subs_remove_req(wish_signal_sub_t** list, rpc_server_req* req) {
+    wish_signal_sub_t* sub;
+    wish_signal_sub_t* tmp;
+    
+    LL_FOREACH_SAFE(*list, sub, tmp) {
+        if (sub->req == req) {
+            LL_DELETE(*list, sub);
+            wish_platform_free(sub);
+        }
+    }
+}
+
+/* Emit to the requests of the list, dropping the ones which have ended */
+static void subs_emit(wish_signal_sub_t** list, const uint8_t* data, size_t len) {
+    wish_signal_sub_t* sub;
+    wish_signal_sub_t* tmp;
+    
+    LL_FOREACH_SAFE(*list, sub, tmp) {
+        if (!sub_alive(sub)) {
+            LL_DELETE(*list, sub);
+            wish_platform_free(sub);
+            continue;
+        }
+        
+        if (data != NULL) {
+            rpc_server_emit(sub->req, data, len);
+        }
+    }
+}
+
+static void signals_publish(wish_core_t* core, const char* topic, const uint8_t* data, size_t len) {
+    struct wish_core_signals* s = signals_get(core);
+    
+    if (s == NULL) { return; }
+    
+    if (topic != NULL) {
+        wish_signal_topic_t* t = NULL;
+        HASH_FIND_STR(s->topics, topic, t);
+        
+        if (t != NULL) {
+            subs_emit(&t->subs, data, len);
+            
+            if (t->subs == NULL) {
+                HASH_DEL(s->topics, t);
+                wish_platform_free(t);
+            }
+        }
+    }
+    
+    subs_emit(&s->all, data, len);
+}
+
+static void signals_subscribe(wish_core_t* core, rpc_server_req* req, const char* topic) {
+    struct wish_core_signals* s = signals_get(core);
+    wish_signal_sub_t** list;
+    
+    if (s == NULL) { return; }
+    
+    if (topic != NULL) {
+        wish_signal_topic_t* t = NULL;
+        HASH_FIND_STR(s->topics, topic, t);
+        
+        if (t == NULL) {
+            t = wish_platform_malloc(sizeof (wish_signal_topic_t));
+            if (t == NULL) { return; }
+            memset(t, 0, sizeof (wish_signal_topic_t));
+            strncpy(t->topic, topic, WISH_SIGNALS_TOPIC_LEN - 1);
+            HASH_ADD_STR(s->topics, topic, t);
+        }
+        
+        list = &t->subs;
+    } else {
+        list = &s->all;
+    }
+    
+    /* Drop ended requests, so that the lists of topics which are never
+     * emitted do not grow */
+    subs_emit(list, NULL, 0);
+    
+    wish_signal_sub_t* sub = wish_platform_malloc(sizeof (wish_signal_sub_t));
+    if (sub == NULL) { return; }
+    
+    sub->req = req;
+    sub->server = req->server;
+    sub->id = req->id;
+    sub->context = req->context;
+    sub->ctx = req->ctx;
+    LL_PREPEND(*list, sub);
+}
 
 void wish_core_signals(rpc_server_req* req, const uint8_t* args) {
     wish_core_t* core = (wish_core_t*) req->server->context;
+    const char* filter = NULL;
+    
+    bson_iterator it;
+    bson_type type = bson_find_from_buffer(&it, args, "0");
+    
+    if (type == BSON_STRING) {
+        filter = bson_iterator_string(&it);
+        
+        if (bson_iterator_string_len(&it) >= WISH_SIGNALS_TOPIC_LEN) {
+            rpc_server_error_msg(req, 307, "Argument 1 too long.");
+            return;
+        }
+    } else if (type != BSON_EOO && type != BSON_NULL && type != BSON_UNDEFINED) {
+        rpc_server_error_msg(req, 307, "Argument 1 not String.");
+        return;
+    }
 
     int buffer_len = 300;
     uint8_t buffer[buffer_len];
@@ -28,26 +194,95 @@ void wish_core_signals(rpc_server_req* req, const uint8_t* args) {
     bson_finish(&bs);
 
     rpc_server_emit(req, bson_data(&bs), bson_size(&bs));
-    //wish_core_signals_emit_string(core, "ok");
+    
+    signals_subscribe(core, req, filter);
 }
 
-void wish_core_signals_emit(wish_core_t* core, bson* signal) {
-    rpc_server_emit_broadcast(core->app_api, "signals", bson_data(signal), bson_size(signal));
-    rpc_server_emit_broadcast(core->core_api, "signals", bson_data(signal), bson_size(signal));
+void wish_core_signals_remove_req(wish_core_t* core, rpc_server_req* req) {
+    struct wish_core_signals* s = core->signals;
+    wish_signal_topic_t* t;
+    wish_signal_topic_t* tmp;
+    
+    if (s == NULL) { return; }
+    
+    HASH_ITER(hh, s->topics, t, tmp) {
+        subs_remove_req(&t->subs, req);
+        
+        if (t->subs == NULL) {
+            HASH_DEL(s->topics, t);
+            wish_platform_free(t);
+        }
+    }
+    
+    subs_remove_req(&s->all, req);
 }
 
-void wish_core_signals_emit_string(wish_core_t* core, char* string) {
-    int buf_len = 1024;
-    char buf[1024];
+void wish_core_signals_emit(wish_core_t* core, bson* signal) {
+    const char* topic = NULL;
+    bson_iterator it;
+    
+    bson_iterator_from_buffer(&it, bson_data(signal));
+    if (bson_find_fieldpath_value("data.0", &it) == BSON_STRING) {
+        topic = bson_iterator_string(&it);
+    }
+    
+    signals_publish(core, topic, (const uint8_t*) bson_data(signal), bson_size(signal));
+}
 
-    bson bs;
-    bson_init_buffer(&bs, buf, buf_len);
-    bson_append_start_array(&bs, "data");
-    bson_append_string(&bs, "0", string);
-    bson_append_finish_array(&bs);
-    bson_finish(&bs);
+static void signals_flush(wish_core_t* core, void* ctx) {
+    struct wish_core_signals* s = signals_get(core);
+    
+    if (s == NULL) { return; }
+    
+    s->flush_scheduled = false;
     
-    rpc_server_emit_broadcast(core->app_api, "signals", bson_data(&bs), bson_size(&bs));
-    rpc_server_emit_broadcast(core->core_api, "signals", bson_data(&bs), bson_size(&bs));
+    for (int i = 0; i < s->num_pending; i++) {
+        /* Encoded once for all the subscribers */
+        uint8_t buf[WISH_SIGNALS_TOPIC_LEN + 32];
+        
+        bson bs;
+        bson_init_buffer(&bs, buf, sizeof (buf));
+        bson_append_start_array(&bs, "data");
+        bson_append_string(&bs, "0", s->pending[i]);
+        bson_append_finish_array(&bs);
+        bson_finish(&bs);
+        
+        if (bs.err) {
+            WISHDEBUG(LOG_CRITICAL, "Could not encode signal %s", s->pending[i]);
+            continue;
+        }
+        
+        signals_publish(core, s->pending[i], (const uint8_t*) bson_data(&bs), bson_size(&bs));
+    }
+    
+    s->num_pending = 0;
 }
 
+void wish_core_signals_emit_string(wish_core_t* core, char* string) {
+    struct wish_core_signals* s = signals_get(core);
+    
+    if (s == NULL) { return; }
+    
+    if (strlen(string) >= WISH_SIGNALS_TOPIC_LEN) {
+        WISHDEBUG(LOG_CRITICAL, "Signal name too long: %s", string);
+        return;
+    }
+    
+    for (int i = 0; i < s->num_pending; i++) {
+        if (strcmp(s->pending[i], string) == 0) {
+            /* Already going out with the next flush */
+            return;
+        }
+    }
+    
+    if (s->num_pending == WISH_SIGNALS_PENDING_MAX) {
+        signals_flush(core, NULL);
+    }
+    
+    strncpy(s->pending[s->num_pending++], string, WISH_SIGNALS_TOPIC_LEN);
+    
+    if (!s->flush_scheduled) {
+        s->flush_scheduled = true;
+        wish_core_time_set_timeout(core, signals_flush, NULL, 1);
+    }
+}
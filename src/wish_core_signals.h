@@ -16,9 +16,25 @@
 
 #include "wish_core.h"
     
+/* Longest signal name, and the number of different signals which can
+ * wait for the next flush */
+#define WISH_SIGNALS_TOPIC_LEN 32
+#define WISH_SIGNALS_PENDING_MAX 16
+
+/**
+ * signals(filter?: string)
+ *
+ * Subscribe to the core signals, or only to the signal named by filter.
+ */
 void wish_core_signals(rpc_server_req* req, const uint8_t* args);
 
+/* Drop the subscription of req, called before the request is freed */
+void wish_core_signals_remove_req(wish_core_t* core, rpc_server_req* req);
+
+/* Emit signal { data: [name, ...] } now to the subscribers of name */
 void wish_core_signals_emit(wish_core_t* core, bson* signal);
 
-/* Convenience function for emitting bson signal { data: [string] } */
+/* Convenience function for emitting bson signal { data: [string] }. The
+ * signals emitted within the same second are coalesced, and sent on the
+ * next tick. */
 void wish_core_signals_emit_string(wish_core_t* core, char* string);
@@ -49,7 +49,7 @@ void wish_api_directory_find(rpc_server_req* req, const uint8_t* args) {
     int limit = bson_iterator_int(&it);
     
     bson b;
-    bson_init(&b);
+    bson_init_arena(&b, &core->arena, 64 + strlen(name));
     bson_append_string(&b, "data", name);
     bson_finish(&b);
 
@@ -32,6 +32,7 @@
 #include "wish_core_app_rpc.h"
 #include "core_service_ipc.h"
 #include "wish_fs.h"
+#include "wish_wire.h"
 
 #include "mbedtls/sha256.h"
 #include "ed25519.h"
@@ -40,18 +41,8 @@
 
 void wish_core_send_pong(wish_core_t* core, wish_connection_t* ctx) {
     WISHDEBUG(LOG_DEBUG, "Ping, sending pong!");
-    /* Enqueue a pong message as answer to ping */
-    int32_t pong_msg_max_len = 50;
-    uint8_t pong_msg[pong_msg_max_len];
-    
-    bson bs;
-    bson_init_buffer(&bs, pong_msg, pong_msg_max_len);
-    
-    /* Send: { pong: true } */
-    bson_append_bool(&bs, "pong", true);
-    bson_finish(&bs);
-    
-    wish_core_send_message(core, ctx, bson_data(&bs), bson_size(&bs));
+    /* Enqueue a pong message as answer to ping: { pong: true } */
+    wish_core_send_message(core, ctx, wish_wire_pong, WISH_WIRE_PING_LEN);
 }
 
 
@@ -175,9 +166,14 @@ void wish_core_create_handshake_msg(wish_core_t* core, wish_connection_t* conn,
     }
 #endif
     
-    wish_relay_client_t* relay = NULL;
+    /* The remote side keeps the first WISH_MAX_TRANSPORTS, so the best
+     * relay servers of this identity go first */
+    wish_relay_client_t* relays[WISH_MAX_TRANSPORTS];
+    int num_relays = wish_relay_client_ranked(core, conn->luid, relays, WISH_MAX_TRANSPORTS);
     
-    LL_FOREACH(core->relay_db, relay) {
+    for (int r = 0; r < num_relays; r++) {
+        wish_relay_client_t* relay = relays[r];
+        
         char index[21];
         BSON_NUMSTR(index, i++);
         
@@ -281,6 +277,26 @@ void wish_core_process_message(wish_core_t* core, wish_connection_t* ctx, uint8_
      * if 'res', then feed to the corresponding instance of wish-client
      */
     
+    const uint8_t* body = NULL;
+    
+    /* The usual single element messages are recognized without a lookup */
+    switch (wish_wire_classify(msg, &body)) {
+        case WISH_WIRE_REQ:
+            wish_core_feed_to_rpc_server(core, ctx, body, 0);
+            return;
+        case WISH_WIRE_RES:
+            wish_core_feed_to_rpc_client(core, ctx, body, 0);
+            return;
+        case WISH_WIRE_PING:
+            wish_core_send_pong(core, ctx);
+            return;
+        case WISH_WIRE_PONG:
+            wish_connection_pong_received(core, ctx);
+            return;
+        default:
+            break;
+    }
+    
     bson_iterator it;
     
     if (bson_find_from_buffer(&it, msg, "req") == BSON_OBJECT) {
@@ -294,7 +310,7 @@ void wish_core_process_message(wish_core_t* core, wish_connection_t* ctx, uint8_
     } else if (bson_find_from_buffer(&it, msg, "ping") == BSON_BOOL) {
         wish_core_send_pong(core, ctx);
     } else if (bson_find_from_buffer(&it, msg, "pong") == BSON_BOOL) {
-        // received a pong, but won't do much with it here.
+        wish_connection_pong_received(core, ctx);
     } else {
         WISHDEBUG(LOG_CRITICAL, "Unknown message on wire!");
     }
@@ -363,6 +379,12 @@ void wish_core_handle_app_to_core(wish_core_t* core, const uint8_t src_wsid[WISH
         const uint8_t *permissions = bson_iterator_value(&it);
 
         wish_service_register_add(core, src_wsid, name, protocols, permissions);
+        
+        /* Optional: the service takes its peer changes as arrays */
+        struct wish_service_entry *service_entry = wish_service_get_entry(core, src_wsid);
+        if (service_entry != NULL && bson_find_from_buffer(&it, data, "peerBatch") == BSON_BOOL) {
+            service_entry->peer_batch = bson_iterator_bool(&it);
+        }
 
         /* Send 'signal: "ready" to App */
         const size_t ready_signal_max_len = 100;
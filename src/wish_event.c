@@ -59,6 +59,10 @@ void wish_message_processor_task(wish_core_t* core, struct wish_event *e) {
             if (memcmp(e->context->rhid, local_rhid, WISH_ID_LEN) < 0) { /* Only if we have the bigger rhid, then we can run the check */
                 wish_core_time_set_timeout(core, &wish_close_parallel_connections, e->context, 1);
             }
+            
+            if (e->context->via_relay) {
+                wish_core_time_set_timeout(core, &wish_connections_upgrade, e->context, WISH_CONNECT_UPGRADE_DELAY);
+            }
         }
         break;
     default:
@@ -88,6 +88,66 @@ static bson wish_identity_to_bson(wish_identity_t* identity) {
     return bs;
 }
 
+/* Bumped on every write to the database, starts from 1 so that 0 never
+ * matches */
+static uint32_t id_db_generation = 1;
+
+uint32_t wish_identity_db_generation(void) {
+    return id_db_generation;
+}
+
+/* The uids in the database and whether we have their private key, as of
+ * the database generation */
+static struct {
+    uint32_t generation;
+    int num_uids;
+    uint8_t uid[WISH_PORT_MAX_UIDS][WISH_ID_LEN];
+    bool privkey[WISH_PORT_MAX_UIDS];
+} id_cache;
+
+static void id_cache_refresh(void) {
+    if (id_cache.generation == id_db_generation) {
+        return;
+    }
+    
+    id_cache.generation = id_db_generation;
+    id_cache.num_uids = 0;
+    
+    int num_ids_in_db = wish_get_num_uid_entries();
+    if (num_ids_in_db <= 0) {
+        return;
+    }
+    
+    wish_uid_list_elem_t uid_list[num_ids_in_db];
+    int num_uids = wish_load_uid_list(uid_list, num_ids_in_db);
+    
+    for (int i = 0; i < num_uids && id_cache.num_uids < WISH_PORT_MAX_UIDS; i++) {
+        memcpy(id_cache.uid[id_cache.num_uids], uid_list[i].uid, WISH_ID_LEN);
+        id_cache.privkey[id_cache.num_uids] = wish_has_privkey(uid_list[i].uid);
+        id_cache.num_uids++;
+    }
+}
+
+static int id_cache_find(const uint8_t* uid) {
+    id_cache_refresh();
+    
+    for (int i = 0; i < id_cache.num_uids; i++) {
+        if (memcmp(id_cache.uid[i], uid, WISH_ID_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool wish_identity_is_known(const uint8_t* uid) {
+    return id_cache_find(uid) >= 0;
+}
+
+bool wish_identity_is_local(const uint8_t* uid) {
+    int i = id_cache_find(uid);
+    return i >= 0 && id_cache.privkey[i];
+}
+
 int wish_save_identity_entry(wish_identity_t* identity) {
     int num_uids_in_db = wish_get_num_uid_entries();
     wish_uid_list_elem_t uid_list[num_uids_in_db];
@@ -121,6 +181,7 @@ int wish_save_identity_entry(wish_identity_t* identity) {
  * @return 
  */
 int wish_save_identity_entry_bson(const uint8_t* identity) {
+    id_db_generation++;
     wish_file_t fd;
     int32_t io_retval = 0;
     fd = wish_fs_open(WISH_ID_DB_NAME);
@@ -300,6 +361,22 @@ int wish_load_uid_list(wish_uid_list_elem_t *list, int list_len ) {
 }
 
 
+/* The fields of an identity entry read by wish_identity_load, the uid
+ * excluded */
+enum { ID_PUBKEY, ID_PRIVKEY, ID_ALIAS, ID_TRANSPORT_0, ID_META = ID_TRANSPORT_0 + WISH_MAX_TRANSPORTS, ID_PERMISSIONS, ID_FIELDS };
+
+static const bson_extract_field identity_schema[] = {
+    { .fpath = "pubkey", .type = BSON_BINDATA },
+    { .fpath = "privkey", .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "alias", .type = BSON_STRING },
+    { .fpath = "transports.0", .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "transports.1", .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "transports.2", .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "transports.3", .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "meta", .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "permissions", .flags = BSON_EXTRACT_OPTIONAL },
+};
+
 return_t wish_identity_load(const uint8_t* uid, wish_identity_t* identity) {
     // init the structure to all zeroes, i.e. pointers to NULL
     memset(identity, 0, sizeof(wish_identity_t));
@@ -368,35 +445,38 @@ return_t wish_identity_load(const uint8_t* uid, wish_identity_t* identity) {
             memcpy(&(identity->uid), peek_uid, WISH_ID_LEN);
 
             
-            if (bson_find_from_buffer(&it, peek_buf, "pubkey") != BSON_BINDATA) {
+            bson_iterator fit[ID_FIELDS];
+            int err = bson_extract(peek_buf, identity_schema, ID_FIELDS, fit);
+            
+            if (err == ID_PUBKEY) {
                 WISHDEBUG(LOG_CRITICAL, "Could not load pubkey");
                 break;
             }
             
-            const uint8_t* pubkey = bson_iterator_bin_data(&it);
+            const uint8_t* pubkey = bson_iterator_bin_data(&fit[ID_PUBKEY]);
             int32_t len = 0;
             
             memcpy(&(identity->pubkey), pubkey, WISH_PUBKEY_LEN);
  
-            if (bson_find_from_buffer(&it, peek_buf, "privkey") != BSON_BINDATA) {
+            if (bson_iterator_type(&fit[ID_PRIVKEY]) != BSON_BINDATA) {
                 WISHDEBUG(LOG_DEBUG, "No privkey for this identity");
                 identity->has_privkey = false;
             } else {
                 WISHDEBUG(LOG_DEBUG, "Found privkey for identity");
-                if (bson_iterator_bin_len(&it) != WISH_PRIVKEY_LEN) {
+                if (bson_iterator_bin_len(&fit[ID_PRIVKEY]) != WISH_PRIVKEY_LEN) {
                     WISHDEBUG(LOG_CRITICAL, "Could not load privkey, invalid len");
                     break;
                 }
-                memcpy(&(identity->privkey), bson_iterator_bin_data(&it), WISH_PRIVKEY_LEN);
+                memcpy(&(identity->privkey), bson_iterator_bin_data(&fit[ID_PRIVKEY]), WISH_PRIVKEY_LEN);
                 identity->has_privkey = true;
             }
 
-            if (bson_find_from_buffer(&it, peek_buf, "alias") != BSON_STRING) {
+            if (err == ID_ALIAS) {
                 WISHDEBUG(LOG_CRITICAL, "Could not get alias");
                 break;
             }
             
-            const char* alias = bson_iterator_string(&it);
+            const char* alias = bson_iterator_string(&fit[ID_ALIAS]);
             
             strncpy(&(identity->alias[0]), alias, WISH_ALIAS_LEN);
 
@@ -405,19 +485,15 @@ return_t wish_identity_load(const uint8_t* uid, wish_identity_t* identity) {
             retval = RET_SUCCESS;
   
             for (int i = 0; i < WISH_MAX_TRANSPORTS; i++) {
-                const int max_len = 16;
-                char transports_path[max_len];
-                bson_iterator_init(&it, &bs);
-                wish_platform_snprintf(transports_path, max_len, "transports.%d", i);
-                if (bson_find_fieldpath_value(transports_path, &it) == BSON_STRING) {
-                    strncpy(&(identity->transports[i][0]), bson_iterator_string(&it), WISH_MAX_TRANSPORT_LEN);
+                if (bson_iterator_type(&fit[ID_TRANSPORT_0 + i]) == BSON_STRING) {
+                    strncpy(&(identity->transports[i][0]), bson_iterator_string(&fit[ID_TRANSPORT_0 + i]), WISH_MAX_TRANSPORT_LEN);
                 }
                 
             }
 
-            bson_iterator_init(&it, &bs);
+            it = fit[ID_META];
             
-            if (bson_find_fieldpath_value("meta", &it) == BSON_BINDATA) {
+            if (bson_iterator_type(&it) == BSON_BINDATA) {
                 bson b;
                 bson_init_with_data(&b, bson_iterator_bin_data(&it));
                 
@@ -435,9 +511,9 @@ return_t wish_identity_load(const uint8_t* uid, wish_identity_t* identity) {
                 }
             }
 
-            bson_iterator_init(&it, &bs);
+            it = fit[ID_PERMISSIONS];
             
-            if (bson_find_fieldpath_value("permissions", &it) == BSON_BINDATA) {
+            if (bson_iterator_type(&it) == BSON_BINDATA) {
                 bson b;
                 bson_init_with_data(&b, bson_iterator_bin_data(&it));
                 
@@ -639,13 +715,10 @@ void wish_create_local_identity(wish_core_t *core, wish_identity_t *id, const ch
         wish_relay_get_preferred_server_url(&(id->transports[0][0]), WISH_MAX_TRANSPORT_LEN);
     }
     else {
-        int i = 0;
-        LL_FOREACH(core->relay_db, relay) {
-            wish_relay_encode_as_url(&(id->transports[i][0]), &relay->ip, relay->port);
-            i++;
-            if (i >= WISH_MAX_TRANSPORTS) {
-                break;
-            }
+        wish_relay_client_t* relays[WISH_MAX_TRANSPORTS];
+        int n = wish_relay_client_ranked(core, NULL, relays, WISH_MAX_TRANSPORTS);
+        for (int i = 0; i < n; i++) {
+            wish_relay_encode_as_url(&(id->transports[i][0]), &relays[i]->ip, relays[i]->port);
         }
     }
 }
@@ -763,6 +836,7 @@ void wish_identity_add_meta_from_bson(wish_identity_t *id, const bson* meta) {
  * @return returns 1 if the identity was removed, or 0 for none
  */
 int wish_identity_remove(wish_core_t* core, uint8_t uid[WISH_ID_LEN]) {
+    id_db_generation++;
     int retval = 0;
 
     if (uid == NULL) {
@@ -869,6 +943,7 @@ int wish_identity_remove(wish_core_t* core, uint8_t uid[WISH_ID_LEN]) {
 }
 
 int wish_identity_update(wish_core_t* core, wish_identity_t* identity) {
+    id_db_generation++;
     int retval = 0;
 
     const char* oldpath = WISH_ID_DB_NAME;
@@ -966,6 +1041,7 @@ int wish_identity_update(wish_core_t* core, wish_identity_t* identity) {
 
 
 void wish_identity_delete_db(void) {
+    id_db_generation++;
     if (wish_fs_remove(WISH_ID_DB_NAME)) {
         WISHDEBUG(LOG_CRITICAL, "Unexpected while removing id db!");
     }
@@ -1125,14 +1201,18 @@ return_t wish_identity_export(wish_core_t *core, wish_identity_t *id, const char
     bson_append_binary(&bs, "uid", id->uid, WISH_UID_LEN);
     bson_append_binary(&bs, "pubkey", id->pubkey, WISH_PUBKEY_LEN);
     
-    /* Add core's current relay servers as transports of the identity */
-    wish_relay_client_t* relay;
+    /* Add core's current relay servers as transports of the identity,
+     * the best ones for this identity first */
+    wish_relay_client_t* relays[WISH_MAX_TRANSPORTS];
+    int num_relays = wish_relay_client_ranked(core, id->uid, relays, WISH_MAX_TRANSPORTS);
     int i = 0;
     
     if (core->relay_db != NULL) {
         bson_append_start_array(&bs, "transports");
 
-        LL_FOREACH(core->relay_db, relay) {
+        for (int r = 0; r < num_relays; r++) {
+            wish_relay_client_t* relay = relays[r];
+            
             char index[21];
             BSON_NUMSTR(index, i++);
             char host[29];
@@ -1355,7 +1435,7 @@ void wish_identity_add_meta_connect(wish_core_t *core, uint8_t *uid, bool status
     if (id.meta) {
         bson_init_with_data(&meta, id.meta);
     } else {
-        bson_init(&meta);
+        bson_init_arena(&meta, &core->arena, 128);
         bson_finish(&meta);
         meta_created = true;
     }
@@ -1396,7 +1476,7 @@ void wish_identity_remove_meta_connect(wish_core_t *core, uint8_t *uid) {
     if (id.meta) {
         bson_init_with_data(&meta, id.meta);
     } else {
-        bson_init(&meta);
+        bson_init_arena(&meta, &core->arena, 128);
         bson_finish(&meta);
         meta_created = true;
     }
@@ -185,6 +185,25 @@ int wish_identity_remove(wish_core_t* core, uint8_t uid[WISH_ID_LEN]);
  */
 void wish_identity_delete_db(void);
 
+/**
+ * Number that changes on every write to the identity database, for
+ * invalidating results derived from it
+ */
+uint32_t wish_identity_db_generation(void);
+
+/**
+ * Check if uid is in the identity database. Answered from an in-memory
+ * copy of the uids, which is reloaded after the database has changed,
+ * so this is cheap enough for every incoming connection.
+ */
+bool wish_identity_is_known(const uint8_t* uid);
+
+/**
+ * Check if uid is in the identity database with its private key, like
+ * wish_identity_is_known.
+ */
+bool wish_identity_is_local(const uint8_t* uid);
+
 return_t wish_identity_sign(wish_core_t* core, wish_identity_t* uid, const bin* data, const bin* claim, bin* signature);
 
 return_t wish_identity_verify(wish_core_t* core, wish_identity_t* uid, const bin* data, const bin* claim, const bin* signature);
@@ -16,20 +16,31 @@
 #define WISH_IP_ADDR_H
 
 #define WISH_IPV4_ADDRLEN 4
+#define WISH_IPV6_ADDRLEN 16
 
-//enum wish_addr_domain { WISH_ADDR_IPV4, WISH_ADDR_IPV6 };
+/* Zero is IPv4, so that zeroed addresses keep their old meaning */
+enum wish_addr_domain { WISH_ADDR_IPV4 = 0, WISH_ADDR_IPV6 };
 
 typedef struct {
-    //enum wish_addr_domain domain;
+    enum wish_addr_domain domain;
     
     /* Wish IPv4 address bytes are saved like this: An address expressed
      * in dotted-decimal notation A.B.C.D is saved into an array like
      * this: byte A is in addr[0], B in addr[1], C in addr[2] and D in addr[3]
      * In other words IP addresses in wish shall have network byte order
      * (big endian).
+     * 
+     * IPv6 addresses use all 16 bytes, also in network byte order.
      */
-    uint8_t addr[WISH_IPV4_ADDRLEN];
+    uint8_t addr[WISH_IPV6_ADDRLEN];
+    /* Interface index of an IPv6 link-local address, otherwise 0 */
+    uint32_t scope_id;
 } wish_ip_addr_t;
 
+/* An address and TCP port where a remote core can be contacted */
+typedef struct {
+    wish_ip_addr_t ip;
+    uint16_t port;
+} wish_transport_addr_t;
 
 #endif
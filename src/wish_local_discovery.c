@@ -36,10 +36,85 @@
 #include "wish_core_signals.h"
 #include "wish_time.h"
 #include "wish_connection.h"
+#include "utlist.h"
+
+static void ldiscover_expire(wish_core_t* core, uint32_t current_time);
+
+/* Check the negative cache for ruid, forgetting all of it if the identity
+ * database has changed since */
+static bool ldiscover_unknown_find(wish_core_t* core, const uint8_t* ruid, uint32_t id_gen) {
+    wish_ldiscover_unknown_t* unknown = core->ldiscover_unknown;
+    int i;
+    
+    if (unknown == NULL) {
+        return false;
+    }
+    
+    if (unknown->generation != id_gen) {
+        unknown->generation = id_gen;
+        unknown->count = 0;
+        unknown->next = 0;
+        return false;
+    }
+    
+    for (i = 0; i < unknown->count; i++) {
+        if (memcmp(unknown->uid[i], ruid, WISH_ID_LEN) == 0) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+/* Remember ruid as unknown, in place of the oldest one when full */
+static void ldiscover_unknown_add(wish_core_t* core, const uint8_t* ruid) {
+    wish_ldiscover_unknown_t* unknown = core->ldiscover_unknown;
+    
+    if (unknown == NULL) {
+        return;
+    }
+    
+    memcpy(unknown->uid[unknown->next], ruid, WISH_ID_LEN);
+    unknown->next = (unknown->next + 1) % WISH_LDISCOVER_UNKNOWN_MAX;
+    
+    if (unknown->count < WISH_LDISCOVER_UNKNOWN_MAX) {
+        unknown->count++;
+    }
+}
+
+/* Remember an address of the peer, as the most recent one */
+static void ldiscover_add_transport(wish_ldiscover_t* elt, const wish_ip_addr_t* ip, uint16_t port) {
+    wish_transport_addr_t t;
+    int i;
+    
+    memset(&t, 0, sizeof (t));
+    memcpy(&t.ip, ip, sizeof (wish_ip_addr_t));
+    t.port = port;
+    
+    for (i = 0; i < elt->num_transports; i++) {
+        if (memcmp(&elt->transports[i], &t, sizeof (t)) == 0) {
+            break;
+        }
+    }
+    
+    if (i == elt->num_transports && elt->num_transports < WISH_LDISCOVER_MAX_TRANSPORTS) {
+        elt->num_transports++;
+    } else if (i == elt->num_transports) {
+        /* Full, the oldest address is dropped */
+        i--;
+    }
+    
+    memmove(&elt->transports[1], &elt->transports[0], i * sizeof (wish_transport_addr_t));
+    elt->transports[0] = t;
+}
+
+static wish_ldiscover_t* ldiscover_insert(wish_core_t* core, wish_ldiscover_t* entry);
 
 static void wish_ldiscover_periodic(wish_core_t* core, void* ctx) {
     //WISHDEBUG(LOG_CRITICAL, "Do some discovering...", ctx);
     
+    ldiscover_expire(core, wish_time_get_relative(core));
+    
     //if (advertize_own_uid && core->loaded_num_ids > 0) {
     if (core->ldiscover_allowed) {
         wish_ldiscover_announce_all(core);
@@ -47,18 +122,71 @@ static void wish_ldiscover_periodic(wish_core_t* core, void* ctx) {
 }
 
 void wish_ldiscover_init(wish_core_t* core) {
-    int size = sizeof(wish_ldiscover_t)*WISH_LOCAL_DISCOVERY_MAX;
-    core->ldiscovery_db = wish_platform_malloc(size);
-    memset(core->ldiscovery_db, 0, size);
+    core->ldiscovery_db = NULL;
+    core->ldiscover_expiry = NULL;
+    core->ldiscover_adverts = wish_platform_malloc(sizeof(wish_ldiscover_adverts_t));
+    memset(core->ldiscover_adverts, 0, sizeof(wish_ldiscover_adverts_t));
+    core->ldiscover_unknown = wish_platform_malloc(sizeof(wish_ldiscover_unknown_t));
+    memset(core->ldiscover_unknown, 0, sizeof(wish_ldiscover_unknown_t));
     wish_core_time_set_interval(core, &wish_ldiscover_periodic, NULL, 5);
 }
 
+static int get_transport_url(wish_core_t* core, char* transport_url);
+
+static bool advert_build(wish_core_t* core, const char* transport_url, uint8_t* uid, wish_ldiscover_advert_t* advert);
+
+void wish_ldiscover_invalidate_adverts(wish_core_t* core) {
+    if (core->ldiscover_adverts == NULL) {
+        return;
+    }
+    for (int c = 0; c < WISH_PORT_MAX_UIDS; c++) {
+        core->ldiscover_adverts->advert[c].valid = false;
+    }
+}
+
+/* Check that the adverts were built with the current transport and claim
+ * flag, else drop them all. Returns false if the transport is not known. */
+static bool adverts_check(wish_core_t* core, char* transport_url) {
+    wish_ldiscover_adverts_t* adverts = core->ldiscover_adverts;
+    
+    if (get_transport_url(core, transport_url)) {
+        return false;
+    }
+    
+    if (strncmp(adverts->transport, transport_url, WISH_MAX_TRANSPORT_LEN) != 0
+            || adverts->claim != core->config_skip_connection_acl) {
+        wish_ldiscover_invalidate_adverts(core);
+        strncpy(adverts->transport, transport_url, WISH_MAX_TRANSPORT_LEN);
+        adverts->claim = core->config_skip_connection_acl;
+    }
+    return true;
+}
+
 void wish_ldiscover_announce_all(wish_core_t* core) {
-    if (core->loaded_num_ids > 0) {
-        int c;
-        for (c=0; c<core->loaded_num_ids; c++) {
-            wish_ldiscover_advertize(core, core->uid_list[c].uid);
+    char transport_url[WISH_MAX_TRANSPORT_LEN];
+    
+    if (core->loaded_num_ids <= 0 || core->ldiscover_adverts == NULL) {
+        return;
+    }
+    
+    if (!adverts_check(core, transport_url)) {
+        WISHDEBUG(LOG_CRITICAL, "Could not get Host IP addr");
+        return;
+    }
+    
+    int c;
+    for (c = 0; c < core->loaded_num_ids && c < WISH_PORT_MAX_UIDS; c++) {
+        wish_ldiscover_advert_t* advert = &core->ldiscover_adverts->advert[c];
+        
+        /* Identities keep their index until uid_list is reloaded, which
+         * invalidates the adverts, but check anyway */
+        if (!advert->valid || memcmp(advert->uid, core->uid_list[c].uid, WISH_ID_LEN) != 0) {
+            if (!advert_build(core, transport_url, core->uid_list[c].uid, advert)) {
+                continue;
+            }
         }
+        
+        wish_send_advertizement(core, advert->msg, advert->len);
     }
 }
 
@@ -68,6 +196,18 @@ void wish_ldiscover_start(wish_core_t* core) {
 }
 
 
+/* The fields of a local discovery advertisement, in the order of the
+ * enum in wish_ldiscover_feed */
+static const bson_extract_field wld_advert_schema[] = {
+    { .fpath = "wuid", .type = BSON_BINDATA, .len = WISH_ID_LEN },
+    { .fpath = "whid", .type = BSON_BINDATA, .len = WISH_ID_LEN },
+    { .fpath = "pubkey", .type = BSON_BINDATA, .len = WISH_PUBKEY_LEN },
+    { .fpath = "alias", .type = BSON_STRING },
+    { .fpath = "claim", .type = BSON_BOOL, .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "meta.product", .type = BSON_STRING, .flags = BSON_EXTRACT_OPTIONAL },
+    { .fpath = "transports.0", .type = BSON_STRING },
+};
+
 /* Feed local discovery message data into Wish core for processing.
  * ip[4], the originating IPv4 address
  * port, the originating UDP port (in host byte order)
@@ -90,6 +230,11 @@ size_t buffer_len) {
     /* Pointer to the beginning of the actual autoconfiguration data */
     uint8_t *msg = buffer + 2;
 
+    if (bson_check_buffer(msg, buffer_len - 2) != BSON_OK) {
+        WISHDEBUG(LOG_DEBUG, "Malformed ldiscover message (bad BSON)");
+        return;
+    }
+
     /* For Auto configuration, we expect a BSON message with following
      * fields:
      * uid: a buffer containing 32 bytes
@@ -98,78 +243,59 @@ size_t buffer_len) {
      * peer wishes to be claimed)
      */
 
-    bson_iterator it;
+    enum { WLD_WUID, WLD_WHID, WLD_PUBKEY, WLD_ALIAS, WLD_CLAIM, WLD_PRODUCT, WLD_TRANSPORT, WLD_FIELDS };
+    bson_iterator it[WLD_FIELDS];
     
-    if (bson_find_from_buffer(&it, msg, "wuid") != BSON_BINDATA) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no uid)");
-        return;
-    }
-
-    const uint8_t* ruid = bson_iterator_bin_data(&it);
-
-    if (bson_iterator_bin_len(&it) != WISH_ID_LEN) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (uid len mismatch)");
-        return;
-    }
-
-    /* Test if we already have a connection the said identity (using my identity) and host */
-
-    if (bson_find_from_buffer(&it, msg, "whid") != BSON_BINDATA) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no whid)");
-        return;
-    }
-
-    if (bson_iterator_bin_len(&it) != WISH_ID_LEN) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (whid len mismatch)");
-        return;
-    }
+    int err = bson_extract(msg, wld_advert_schema, WLD_FIELDS, it);
     
-    const uint8_t* rhid = bson_iterator_bin_data(&it);  /* The candidate remote host identity */
-
-    if (bson_find_from_buffer(&it, msg, "pubkey") != BSON_BINDATA) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no pubkey)");
-        return;
-    }
-
-    if (bson_iterator_bin_len(&it) != WISH_PUBKEY_LEN) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (pubkey len mismatch)");
-        return;
+    switch (err) {
+        case -1:
+            break;
+        case WLD_WUID:
+            WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no uid or uid len mismatch)");
+            return;
+        case WLD_WHID:
+            WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no whid or whid len mismatch)");
+            return;
+        case WLD_PUBKEY:
+            WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no pubkey or pubkey len mismatch)");
+            return;
+        case WLD_ALIAS:
+            WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no alias)");
+            return;
+        case WLD_TRANSPORT:
+            WISHDEBUG(LOG_CRITICAL, "No transport in local discovery message");
+            return;
+        default:
+            /* Optional fields of unexpected type are ignored */
+            break;
     }
-    
-    const uint8_t *pubkey_ptr = bson_iterator_bin_data(&it);
-
 
-    if (bson_find_from_buffer(&it, msg, "alias") != BSON_STRING) {
-        WISHDEBUG(LOG_CRITICAL, "Malformed ldiscover message (no pubkey)");
-        return;
-    }
-    
-    const char* alias = bson_iterator_string(&it);
+    const uint8_t* ruid = bson_iterator_bin_data(&it[WLD_WUID]);
+    const uint8_t* rhid = bson_iterator_bin_data(&it[WLD_WHID]);  /* The candidate remote host identity */
+    const uint8_t *pubkey_ptr = bson_iterator_bin_data(&it[WLD_PUBKEY]);
+    const char* alias = bson_iterator_string(&it[WLD_ALIAS]);
 
     bool claim = false;
     
-    if (bson_find_from_buffer(&it, msg, "claim") == BSON_BOOL) {
-        claim = bson_iterator_bool(&it);
+    if (bson_iterator_type(&it[WLD_CLAIM]) == BSON_BOOL) {
+        claim = bson_iterator_bool(&it[WLD_CLAIM]);
     }
     
-    bson_iterator_from_buffer(&it, msg);
-    
     const char* meta_product = NULL;
     
-    if (bson_find_fieldpath_value("meta.product", &it) == BSON_STRING) {
-        meta_product = bson_iterator_string(&it);
+    if (bson_iterator_type(&it[WLD_PRODUCT]) == BSON_STRING) {
+        meta_product = bson_iterator_string(&it[WLD_PRODUCT]);
     }
     
     /** The port number of the remote wish core will be saved here */
     uint16_t tcp_port = 0;
 
-    bson_iterator_from_buffer(&it, msg);
-
     // FIXME: Only first transport is read
     
-    if (bson_find_fieldpath_value("transports.0", &it) == BSON_STRING) {
-        const char* url = bson_iterator_string(&it);
-        int url_len = bson_iterator_string_len(&it);
+    if (bson_iterator_type(&it[WLD_TRANSPORT]) == BSON_STRING) {
+        const char* url = bson_iterator_string(&it[WLD_TRANSPORT]);
+        int url_len = bson_iterator_string_len(&it[WLD_TRANSPORT]);
         
         if (wish_parse_transport_port(url, url_len, &tcp_port)) {
             WISHDEBUG(LOG_CRITICAL, "wld: Error while parsing port");
@@ -183,116 +309,135 @@ size_t buffer_len) {
     //WISHDEBUG(LOG_CRITICAL, "LocalDiscovery checking cache. ruid: %02x %02x %02x %02x", ruid[0], ruid[1], ruid[2], ruid[3]);
     
     uint32_t current_time = wish_time_get_relative(core);
-    bool found = false;
-    int free = -1;
+    
+    ldiscover_expire(core, current_time);
+    
+    wish_ldiscover_t* elt = wish_ldiscover_find(core, ruid, rhid);
+    
+    if (elt != NULL) {
+        //WISHDEBUG(LOG_CRITICAL, "Found entry. Updating timestamp");
+        elt->timestamp = current_time;
+        ldiscover_add_transport(elt, ip, tcp_port);
+        
+        if (elt->type == DISCOVER_TYPE_LOCAL) {
+            /* Refreshed entries go last in the expiry queue */
+            DL_DELETE(core->ldiscover_expiry, elt);
+            DL_APPEND(core->ldiscover_expiry, elt);
+        }
+        
+        bool changed = false;
 
-    int i;
-    for(i=0; i<WISH_LOCAL_DISCOVERY_MAX; i++) {
-        if (core->ldiscovery_db[i].occupied && core->ldiscovery_db[i].type == DISCOVER_TYPE_LOCAL && current_time - core->ldiscovery_db[i].timestamp > 30) {
-            core->ldiscovery_db[i].occupied = false;
-            //WISHDEBUG(LOG_CRITICAL, "LocalDiscovery dropped timed out entry.");
-            if (core->ldiscovery_db[i].class) { wish_platform_free(core->ldiscovery_db[i].class); }
-            core->ldiscovery_db[i].class = NULL;
-            if (core->ldiscovery_db[i].meta) { wish_platform_free(core->ldiscovery_db[i].meta); }
-            core->ldiscovery_db[i].meta = NULL;
-            
+        if (strncmp(elt->alias, alias, WISH_ALIAS_LEN) != 0) {
+            strncpy((char*) &elt->alias, alias, WISH_ALIAS_LEN);
+            changed = true;
+        }
+
+        if (elt->claim != claim) {
+            // claim state changed
+            elt->claim = claim;
+            changed = true;
+        }
+
+        if (changed) {
             wish_core_signals_emit_string(core, "localDiscovery");
-            continue;
         }
+    } else if (HASH_COUNT(core->ldiscovery_db) < WISH_LOCAL_DISCOVERY_MAX) {
+        wish_ldiscover_t entry;
+        memset(&entry, 0, sizeof (entry));
         
-        if (core->ldiscovery_db[i].occupied) {
-            if( memcmp(&core->ldiscovery_db[i].ruid,  ruid, WISH_ID_LEN) == 0 && 
-                    memcmp(&core->ldiscovery_db[i].rhid, rhid, WISH_ID_LEN) == 0 ) 
-            {
-                //WISHDEBUG(LOG_CRITICAL, "Found entry. Updating timestamp");
-                found = true;
-                core->ldiscovery_db[i].timestamp = current_time;
-                
-                bool changed = false;
-                
-                if (strncmp(core->ldiscovery_db[i].alias, alias, WISH_ALIAS_LEN) != 0) {
-                    strncpy((char*) &core->ldiscovery_db[i].alias, alias, WISH_ALIAS_LEN);
-                    changed = true;
-                }
-                
-                if (core->ldiscovery_db[i].claim != claim) {
-                    // claim state changed
-                    changed = true;
-                }
-                
-                if (changed) {
-                    wish_core_signals_emit_string(core, "localDiscovery");
-                }
-                
-                break;
-            }
-        } else {
-            free = i;
-        }
-    }
-    if(!found && free != -1) {
-        core->ldiscovery_db[free].type = DISCOVER_TYPE_LOCAL;
-        core->ldiscovery_db[free].occupied = true;
-        core->ldiscovery_db[free].timestamp = current_time;
-        memcpy(&core->ldiscovery_db[free].ruid, ruid, WISH_ID_LEN);
-        memcpy(&core->ldiscovery_db[free].rhid, rhid, WISH_ID_LEN);
-        memcpy(&core->ldiscovery_db[free].pubkey, pubkey_ptr, WISH_PUBKEY_LEN);
-        strncpy((char*) &core->ldiscovery_db[free].alias, alias, WISH_ALIAS_LEN);
-        core->ldiscovery_db[free].class = (meta_product != NULL ? wish_platform_strdup(meta_product) : NULL);
-        core->ldiscovery_db[free].claim = claim;
-        /* FIXME ip address length here is hardcoded and assumed to be
-         * IPv4 */
+        entry.type = DISCOVER_TYPE_LOCAL;
+        entry.timestamp = current_time;
+        memcpy(&entry.ruid, ruid, WISH_ID_LEN);
+        memcpy(&entry.rhid, rhid, WISH_ID_LEN);
+        memcpy(&entry.pubkey, pubkey_ptr, WISH_PUBKEY_LEN);
+        strncpy((char*) &entry.alias, alias, WISH_ALIAS_LEN);
+        entry.class = (meta_product != NULL ? wish_platform_strdup(meta_product) : NULL);
+        entry.claim = claim;
         /* FIXME the ip address is read from where the broadcast is
          * received from - and not from transports! */
-        memcpy(&core->ldiscovery_db[free].transport_ip, ip, sizeof (wish_ip_addr_t));
-        /* FIXME the port is hardcoded, should be read from transports */
-        core->ldiscovery_db[free].transport_port = tcp_port;
-        WISHDEBUG(LOG_DEBUG, "Inserted Local Discovered peer at index %d", free);
+        ldiscover_add_transport(&entry, ip, tcp_port);
         
-        wish_core_signals_emit_string(core, "localDiscovery");
+        elt = ldiscover_insert(core, &entry);
+        
+        if (elt != NULL) {
+            WISHDEBUG(LOG_DEBUG, "Inserted Local Discovered peer");
+            wish_core_signals_emit_string(core, "localDiscovery");
+        } else if (entry.class) {
+            wish_platform_free((void*) entry.class);
+        }
     }
     
     /* Save the pubkey to contact database, along with metadata.
-     * But first, check if we already know this uid */
-    wish_identity_t discovered_id;
-    return_t ret = wish_identity_load(ruid, &discovered_id);
-    wish_identity_destroy(&discovered_id);
+     * But first, check if we already know this uid. The answer is kept
+     * in the entry, and unknown uids also in a negative cache of their
+     * own, until the identity database changes. So repeated adverts from
+     * strangers do not touch the database, even when the table is full. */
+    uint32_t id_gen = wish_identity_db_generation();
+    bool known;
+    
+    if (elt != NULL && elt->known_gen == id_gen) {
+        known = elt->known;
+    } else if (ldiscover_unknown_find(core, ruid, id_gen)) {
+        known = false;
+    } else {
+        wish_identity_t discovered_id;
+        return_t ret = wish_identity_load(ruid, &discovered_id);
+        wish_identity_destroy(&discovered_id);
+        
+        known = (ret == RET_SUCCESS);
+        if (elt != NULL) {
+            elt->known = known;
+            elt->known_gen = id_gen;
+        }
+        if (!known) {
+            ldiscover_unknown_add(core, ruid);
+        }
+    }
     
-    if (ret != RET_SUCCESS) {
+    if (!known) {
         // Not trying to connect to unknown uid
         return;
     }
 
     /* Start a connection to the new peer */
 
-    /* Determine what uid we will be using as local uid when
-     * connecting */
-    
-    /* FIXME now we use only the first identity in the database which is advertized to everybody */
-    wish_uid_list_elem_t uid_list[1];
-    int num_uids = wish_load_uid_list(uid_list, 1);
+    /* Determine what uids we will be using as local uid when
+     * connecting, leaving out the ones already connected or connecting */
+    const uint8_t* luids[WISH_PORT_MAX_UIDS];
+    int num_luids = wish_connections_plan(core, ruid, luids, WISH_PORT_MAX_UIDS);
+    int num_dial = 0;
+    int i;
 
-    if(num_uids == 0) {
-        // we do not have any identities, and cannot therefore connect
-        return;
-    }
-    
-    wish_connection_t *existing_conn_ctx = wish_core_lookup_ctx_by_luid_ruid_rhid(core, uid_list[0].uid, ruid, rhid);
-    if (existing_conn_ctx != NULL) {
-        if (existing_conn_ctx->context_state == WISH_CONTEXT_CONNECTED) {
-            /* Found that we already have a wish connection where one of
-             * our own identities is local identity */
-            WISHDEBUG(LOG_DEBUG, "Not opening a new connection because we already have a connection to the remote core");
-            return;
-        }
-        else if (existing_conn_ctx->context_state == WISH_CONTEXT_IN_MAKING) {
-            WISHDEBUG(LOG_CRITICAL, "wld: we are already opening a connection.");
-            return;
+    for (i = 0; i < num_luids; i++) {
+        if (memcmp(luids[i], ruid, WISH_ID_LEN) == 0) {
+            continue;
         }
-        else {
-            WISHDEBUG(LOG_CRITICAL, "wld: Unexpected context state");
-            return;
+        
+        wish_connection_t *existing_conn_ctx = wish_core_lookup_ctx_by_luid_ruid_rhid(core, luids[i], ruid, rhid);
+        if (existing_conn_ctx != NULL) {
+            if (existing_conn_ctx->context_state == WISH_CONTEXT_CONNECTED) {
+                /* Found that we already have a wish connection where this
+                 * identity of ours is local identity. A relayed one is
+                 * replaced by a direct connection, now that we know
+                 * where the peer is. */
+                WISHDEBUG(LOG_DEBUG, "Not opening a new connection because we already have a connection to the remote core");
+                wish_connections_upgrade(core, existing_conn_ctx);
+            }
+            else if (existing_conn_ctx->context_state == WISH_CONTEXT_IN_MAKING) {
+                WISHDEBUG(LOG_DEBUG, "wld: we are already opening a connection.");
+            }
+            else {
+                WISHDEBUG(LOG_CRITICAL, "wld: Unexpected context state");
+            }
+            continue;
         }
+        
+        luids[num_dial++] = luids[i];
+    }
+
+    if (num_dial == 0) {
+        // nothing to connect, or we do not have any identities
+        return;
     }
     
     /* Obtain local hostid and compare with the rhid of the broadcast */
@@ -332,41 +477,30 @@ size_t buffer_len) {
         wish_identity_destroy(&id);
     }
         
-    /* Start connecting: Create new wish context with the ids */
-    /* FIXME currently always using first uid of list */
-    uint8_t *my_uid = uid_list[0].uid;
-    wish_connection_t *connection = wish_connection_init(core, my_uid, ruid);
-    if (connection != NULL) {
-        /* FIXME the ipshould be read from * 'transports' */
-        
-        //WISHDEBUG(LOG_CRITICAL, "LocalDiscovery: Will start connection to: %u.%u.%u.%u:%hu\n", ip->addr[0], ip->addr[1], ip->addr[2], ip->addr[3], tcp_port);
-
-        /* Request opening of a new wish connection, and associate the
-         * new wish context with it */
-
-        wish_open_connection(core, connection, ip, tcp_port, false);
+    /* Start connecting to all the addresses the peer has been seen at */
+    for (i = 0; i < num_dial; i++) {
+        if (elt != NULL) {
+            wish_connections_connect_candidates(core, luids[i], ruid, elt->transports, elt->num_transports);
+        } else {
+            wish_transport_addr_t candidate = { .port = tcp_port };
+            memcpy(&candidate.ip, ip, sizeof (wish_ip_addr_t));
+            wish_connections_connect_candidates(core, luids[i], ruid, &candidate, 1);
+        }
     }
-
 }
 
-/* This function will create a 'transports' document in the memory
- * pointed to by the supplied pointer. 
- * @param transports_array   The pointer to memory where the document is to be
- * stored
- * @param transports_array_max_len The maxmimum allowed length of the document
+/* Get the transport URL of this core, wish://<ip>:<port>, where ip is the
+ * address of the host on the subnet of its default route.
+ * @param transport_url room for WISH_MAX_TRANSPORT_LEN bytes
  * @return Value 0, if no error
  */
-static int append_transports_array(wish_core_t* core, bson* bs) {
-    
-    bson_append_start_array(bs, "transports");
-    
-    char transport_url[WISH_MAX_TRANSPORT_LEN];
+static int get_transport_url(wish_core_t* core, char* transport_url) {
     char host_part[WISH_MAX_TRANSPORT_LEN];
     
 #ifdef __APPLE__
     struct ifaddrs *ifap, *ifa;
     struct sockaddr_in *sa;
-    char *addr;
+    int found = 1;
     
     getifaddrs (&ifap);
     int c = 0;
@@ -374,60 +508,52 @@ static int append_transports_array(wish_core_t* core, bson* bs) {
         if (ifa->ifa_addr->sa_family==AF_INET) {
             if(c==0) { c++; continue; }
             sa = (struct sockaddr_in *) ifa->ifa_addr;
-            addr = inet_ntoa(sa->sin_addr);
-            //printf("Interface: %s\tAddress: %s\n", ifa->ifa_name, addr);
-            wish_platform_sprintf(transport_url, "wish://%s:%d", addr, wish_get_host_port(core));
-            
-            bson_append_string(bs, "0", transport_url);
-            
-            freeifaddrs(ifap);
-            return 0;
+            strncpy(host_part, inet_ntoa(sa->sin_addr), WISH_MAX_TRANSPORT_LEN - 1);
+            host_part[WISH_MAX_TRANSPORT_LEN - 1] = '\0';
+            found = 0;
             break;
         }
     }
+    freeifaddrs(ifap);
+    if (found != 0) {
+        return 1;
+    }
 #else
     if (wish_get_host_ip_str(core, host_part, WISH_MAX_TRANSPORT_LEN)) {
-        WISHDEBUG(LOG_CRITICAL, "Could not get Host IP addr");
         return 1;
     }
-    wish_platform_sprintf(transport_url, "wish://%s:%d", host_part, wish_get_host_port(core));
-
-    bson_append_string(bs, "0", transport_url);
-    
 #endif
-    bson_append_finish_array(bs);
-    
+    wish_platform_snprintf(transport_url, WISH_MAX_TRANSPORT_LEN, "wish://%s:%d", host_part, wish_get_host_port(core));
     return 0;
 }
 
-/* Send out one "advertizement" message for wish identity my_uid */
-void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
-    /* Advert message length:
-     * uid len + hostid len + pubkey len + room for metadata */
-
+/* Serialize the advertisement of identity uid. Returns false if the
+ * identity cannot be advertised, in which case advert is left invalid. */
+static bool advert_build(wish_core_t* core, const char* transport_url, uint8_t* uid, wish_ldiscover_advert_t* advert) {
+    advert->valid = false;
+    
     wish_identity_t id;
     return_t ret = wish_identity_load(uid, &id);
     
     // Local discovery will not advertise if we cant load identity
     if (ret != RET_SUCCESS) { 
         wish_identity_destroy(&id);
-        return; 
+        return false; 
     }
 
     // Local discovery will not advertise if we don't have a private key
     if (!id.has_privkey) { 
         wish_identity_destroy(&id);
-        return; 
+        return false; 
     }
 
-    const size_t msg_len = 2 + 2*(20 + WISH_ID_LEN) + 20 + WISH_PUBKEY_LEN + 10 + WISH_MAX_TRANSPORT_LEN + WISH_ALIAS_LEN;
-    uint8_t msg[msg_len];
+    uint8_t* msg = advert->msg;
 
     msg[0] = 'W';
     msg[1] = '.';
 
     bson bs;
-    bson_init_buffer(&bs, msg+2, msg_len-2);
+    bson_init_buffer(&bs, msg+2, WISH_LDISCOVER_ADVERT_MAX_LEN-2);
     
     bson_append_string(&bs, "alias", id.alias);
 #ifdef WLD_META_PRODUCT
@@ -441,65 +567,128 @@ void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
     wish_core_get_host_id(core, host_id);
     bson_append_binary(&bs, "whid", host_id, WISH_ID_LEN);
 
-    uint8_t pubkey[WISH_PUBKEY_LEN] = { 0 };
-
-    if (wish_load_pubkey(uid, pubkey)) {
-        bson_visit("failed to load pubkey for uid", bson_data(&bs));
-        wish_identity_destroy(&id);
-        return;
-    }
-
-    bson_append_binary(&bs, "pubkey", pubkey, WISH_PUBKEY_LEN);
-    append_transports_array(core, &bs);
+    /* The identity has the pubkey already, no need to load it again */
+    bson_append_binary(&bs, "pubkey", id.pubkey, WISH_PUBKEY_LEN);
+    
+    bson_append_start_array(&bs, "transports");
+    bson_append_string(&bs, "0", transport_url);
+    bson_append_finish_array(&bs);
     
     if (core->config_skip_connection_acl) {
         bson_append_bool(&bs, "claim", true);
     }
 
     bson_finish(&bs);
+    wish_identity_destroy(&id);
+    
+    if (bs.err) {
+        WISHDEBUG(LOG_CRITICAL, "Could not build local discovery advertisement");
+        return false;
+    }
 
     //bson_visit("Advertisement message going out from core:", bson_data(&bs));
     
-    wish_send_advertizement(core, msg, 2 + bson_size(&bs));
-    wish_identity_destroy(&id);
+    memcpy(advert->uid, uid, WISH_ID_LEN);
+    advert->len = 2 + bson_size(&bs);
+    advert->valid = true;
+    return true;
 }
 
-void wish_ldiscover_add(wish_core_t* core, wish_ldiscover_t* entry) {
-    int i;
-    int free = -1;
+/* Send out one "advertizement" message for wish identity my_uid */
+void wish_ldiscover_advertize(wish_core_t* core, uint8_t* uid) {
+    char transport_url[WISH_MAX_TRANSPORT_LEN];
+    wish_ldiscover_advert_t tmp;
+    wish_ldiscover_advert_t* advert = &tmp;
     
-    for(i=0; i<WISH_LOCAL_DISCOVERY_MAX; i++) {
-        if (!core->ldiscovery_db[i].occupied) {
-            free = i;
+    if (core->ldiscover_adverts == NULL) {
+        return;
+    }
+    
+    if (!adverts_check(core, transport_url)) {
+        WISHDEBUG(LOG_CRITICAL, "Could not get Host IP addr");
+        return;
+    }
+    
+    /* Rebuild the cached advert of the identity, if it has one */
+    int c;
+    for (c = 0; c < core->loaded_num_ids && c < WISH_PORT_MAX_UIDS; c++) {
+        if (memcmp(core->uid_list[c].uid, uid, WISH_ID_LEN) == 0) {
+            advert = &core->ldiscover_adverts->advert[c];
             break;
         }
     }
     
-    if (free == -1) {
+    if (advert_build(core, transport_url, uid, advert)) {
+        wish_send_advertizement(core, advert->msg, advert->len);
+    }
+}
+
+static void ldiscover_remove(wish_core_t* core, wish_ldiscover_t* elt) {
+    HASH_DEL(core->ldiscovery_db, elt);
+    if (elt->type == DISCOVER_TYPE_LOCAL) {
+        DL_DELETE(core->ldiscover_expiry, elt);
+    }
+    if (elt->class) { wish_platform_free((void*) elt->class); }
+    if (elt->meta) { wish_platform_free((void*) elt->meta); }
+    wish_platform_free(elt);
+}
+
+/* Drop the local entries not advertized within the timeout. The expiry
+ * queue is in timestamp order, so only the expired entries are visited. */
+static void ldiscover_expire(wish_core_t* core, uint32_t current_time) {
+    bool expired = false;
+    
+    while (core->ldiscover_expiry != NULL
+            && current_time - core->ldiscover_expiry->timestamp > WISH_LOCAL_DISCOVERY_TIMEOUT) {
+        //WISHDEBUG(LOG_CRITICAL, "LocalDiscovery dropped timed out entry.");
+        ldiscover_remove(core, core->ldiscover_expiry);
+        expired = true;
+    }
+    
+    if (expired) {
+        wish_core_signals_emit_string(core, "localDiscovery");
+    }
+}
+
+static wish_ldiscover_t* ldiscover_insert(wish_core_t* core, wish_ldiscover_t* entry) {
+    wish_ldiscover_t* elt = wish_platform_malloc(sizeof (wish_ldiscover_t));
+    
+    if (elt == NULL) {
         WISHDEBUG(LOG_CRITICAL, "Dropped a discovery entry due to memory being full.");
-        return;
+        return NULL;
+    }
+    
+    memcpy(elt, entry, sizeof (wish_ldiscover_t));
+    elt->prev = NULL;
+    elt->next = NULL;
+    
+    HASH_ADD(hh, core->ldiscovery_db, ruid, 2 * WISH_ID_LEN, elt);
+    if (elt->type == DISCOVER_TYPE_LOCAL) {
+        DL_APPEND(core->ldiscover_expiry, elt);
     }
+    return elt;
+}
 
-    wish_ldiscover_t* elt = &core->ldiscovery_db[free];
+void wish_ldiscover_add(wish_core_t* core, wish_ldiscover_t* entry) {
+    wish_ldiscover_t* old = wish_ldiscover_find(core, entry->ruid, entry->rhid);
     
-    memcpy(elt, entry, sizeof(wish_ldiscover_t));
-    elt->occupied = true;
+    if (old != NULL) {
+        ldiscover_remove(core, old);
+    } else if (HASH_COUNT(core->ldiscovery_db) >= WISH_LOCAL_DISCOVERY_MAX) {
+        WISHDEBUG(LOG_CRITICAL, "Dropped a discovery entry due to memory being full.");
+        return;
+    }
+
+    ldiscover_insert(core, entry);
     //WISHDEBUG(LOG_CRITICAL, "wish_ldiscover_add completed successfully.");
 }
 
 void wish_ldiscover_clear(wish_core_t* core) {
-    int i;
-    for(i=0; i<WISH_LOCAL_DISCOVERY_MAX; i++) {
-        if (core->ldiscovery_db[i].meta) { 
-            wish_platform_free(core->ldiscovery_db[i].meta); 
-            core->ldiscovery_db[i].meta = NULL;
-        }
-        if (core->ldiscovery_db[i].class) {
-            wish_platform_free(core->ldiscovery_db[i].class);
-            core->ldiscovery_db[i].class = NULL;
-        }
-        
-        core->ldiscovery_db[i].occupied = false;
+    wish_ldiscover_t* elt;
+    wish_ldiscover_t* tmp;
+    
+    HASH_ITER(hh, core->ldiscovery_db, elt, tmp) {
+        ldiscover_remove(core, elt);
     }
 }
 
@@ -507,5 +696,12 @@ wish_ldiscover_t *wish_ldiscover_get(wish_core_t* core) {
     return core->ldiscovery_db;
 }
 
-
-
+wish_ldiscover_t *wish_ldiscover_find(wish_core_t* core, const uint8_t* ruid, const uint8_t* rhid) {
+    uint8_t key[2 * WISH_ID_LEN];
+    wish_ldiscover_t* elt = NULL;
+    
+    memcpy(key, ruid, WISH_ID_LEN);
+    memcpy(key + WISH_ID_LEN, rhid, WISH_ID_LEN);
+    HASH_FIND(hh, core->ldiscovery_db, key, sizeof (key), elt);
+    return elt;
+}
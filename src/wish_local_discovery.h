@@ -22,6 +22,14 @@
 #include "wish_connection.h"
 #include "wish_identity.h"
 #include "wish_port_config.h"
+#include "uthash.h"
+
+/* Seconds until a local entry is dropped, unless advertized again */
+#define WISH_LOCAL_DISCOVERY_TIMEOUT 30
+
+/* Addresses remembered per entry, a peer is often seen over both IPv4
+ * and IPv6, or on several interfaces */
+#define WISH_LDISCOVER_MAX_TRANSPORTS 4
 
 typedef enum {
     DISCOVER_TYPE_NONE,
@@ -32,13 +40,11 @@ typedef enum {
 } ldiscover_type;
 
 typedef struct wish_ldiscover_t {
-    /* This field is used for identifying occupied/vacant app contexts.
-     * Has value false if context is vacant */
-    bool occupied;
     /**  */
     ldiscover_type type;
     /* The service IF of the app */
     uint8_t luid[WISH_ID_LEN];
+    /* ruid and rhid, in this order and adjacent, are the key of the table */
     uint8_t ruid[WISH_ID_LEN];
     uint8_t rhid[WISH_ID_LEN];
     uint8_t rsid[WISH_ID_LEN];
@@ -46,14 +52,56 @@ typedef struct wish_ldiscover_t {
     uint8_t alias[WISH_ALIAS_LEN];
     bool claim;
     uint32_t timestamp;
-    /* FIXME support support multiple transports, and IPv6, and..  */
-    wish_ip_addr_t transport_ip;
-    uint16_t transport_port;
+    /* The addresses the peer was seen at, the most recent first */
+    wish_transport_addr_t transports[WISH_LDISCOVER_MAX_TRANSPORTS];
+    int num_transports;
     const char* meta;
     /** Class broadcasted by core. Can expose hint of device type or application of the core. */
     const char* class;
+    /* Whether ruid is in the identity database, valid while known_gen
+     * equals wish_identity_db_generation() */
+    bool known;
+    uint32_t known_gen;
+    /* Expiry queue of local entries, oldest timestamp first */
+    struct wish_ldiscover_t* prev;
+    struct wish_ldiscover_t* next;
+    UT_hash_handle hh;
 } wish_ldiscover_t;
 
+/* Room for the magic bytes and an advertisement with the longest alias
+ * and transport */
+#define WISH_LDISCOVER_ADVERT_MAX_LEN 384
+
+/* The advertisement of one identity, serialized once and sent as is until
+ * the identity or the transports of the core change */
+typedef struct wish_ldiscover_advert_t {
+    bool valid;
+    uint8_t uid[WISH_ID_LEN];
+    size_t len;
+    uint8_t msg[WISH_LDISCOVER_ADVERT_MAX_LEN];
+} wish_ldiscover_advert_t;
+
+typedef struct wish_ldiscover_adverts_t {
+    /* The transport and claim flag the advertisements were built with */
+    char transport[WISH_MAX_TRANSPORT_LEN];
+    bool claim;
+    /* Advertisements of the identities in uid_list of the core, by index */
+    wish_ldiscover_advert_t advert[WISH_PORT_MAX_UIDS];
+} wish_ldiscover_adverts_t;
+
+/* Uids of adverts that are not in the identity database. Kept apart from
+ * the table, which is full during a flood of strangers */
+#define WISH_LDISCOVER_UNKNOWN_MAX 64
+
+typedef struct wish_ldiscover_unknown_t {
+    /* The uids are valid while this equals wish_identity_db_generation() */
+    uint32_t generation;
+    int count;
+    /* The slot written next, the oldest uid once the cache is full */
+    int next;
+    uint8_t uid[WISH_LDISCOVER_UNKNOWN_MAX][WISH_ID_LEN];
+} wish_ldiscover_unknown_t;
+
 void wish_ldiscover_init(wish_core_t* core);
 
 /** Make announcements for all identities */
@@ -77,10 +125,17 @@ void wish_ldiscover_disable_bcast(wish_core_t* core);
  */
 void wish_ldiscover_feed(wish_core_t* core, wish_ip_addr_t *ip, uint16_t port, uint8_t *buffer, size_t buffer_len);
 
-/* Send out one "advertizement" message for wish identity my_uid */
+/* Send out one "advertizement" message for wish identity my_uid. The
+ * advertisement is rebuilt from the identity, so call this after the
+ * identity has changed. */
 void wish_ldiscover_advertize(wish_core_t* core, uint8_t *my_uid);
 
-/** */
+/* Drop the prebuilt advertisements, for instance when identities have
+ * been added or removed */
+void wish_ldiscover_invalidate_adverts(wish_core_t* core);
+
+/** Add a copy of entry to the table, replacing an entry with the same
+ * ruid and rhid */
 void wish_ldiscover_add(wish_core_t* core, wish_ldiscover_t* entry);
 
 /** */
@@ -89,5 +144,9 @@ void wish_ldiscover_add(wish_core_t* core, wish_ldiscover_t* entry);
 /** Clear the table */
 void wish_ldiscover_clear(wish_core_t* core);
 
+/** The table, a uthash hash table to be walked with HASH_ITER(hh, ...) */
 wish_ldiscover_t *wish_ldiscover_get(wish_core_t* core);
 
+/** Find the entry of ruid and rhid, or NULL */
+wish_ldiscover_t *wish_ldiscover_find(wish_core_t* core, const uint8_t* ruid, const uint8_t* rhid);
+
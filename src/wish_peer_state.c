@@ -0,0 +1,285 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wish_peer_state.h"
+#include "wish_service_registry.h"
+#include "core_service_ipc.h"
+#include "wish_platform.h"
+#include "wish_debug.h"
+#include "bson.h"
+#include "utlist.h"
+#include "uthash.h"
+
+/* Room for one peer in a message */
+#define PEER_STATE_PEER_LEN (4 * WISH_ID_LEN + WISH_PROTOCOL_NAME_MAX_LEN + 128)
+
+typedef struct wish_peer_entry {
+    /* The service, and the peer as reported to it. Zero padded, as the
+     * whole struct is the hash key. */
+    struct {
+        uint8_t wsid[WISH_WSID_LEN];
+        uint8_t luid[WISH_ID_LEN];
+        uint8_t ruid[WISH_ID_LEN];
+        uint8_t rhid[WISH_WHID_LEN];
+        uint8_t rsid[WISH_WSID_LEN];
+        char protocol[WISH_PROTOCOL_NAME_MAX_LEN + 1];
+    } key;
+    bool local;
+    /* The state the service should see */
+    bool online;
+    /* The state the service has been told */
+    bool announced;
+    /* Went offline since the service was told it is online, so that the
+     * service must see the offline even if it is back online already */
+    bool reset;
+    /* In the list of entries to look at on the next flush */
+    bool dirty;
+    struct wish_peer_entry* prev;
+    struct wish_peer_entry* next;
+    UT_hash_handle hh;
+} wish_peer_entry_t;
+
+struct wish_peer_state {
+    wish_peer_entry_t* peers;
+    wish_peer_entry_t* dirty;
+};
+
+/* A change to report in a { type: "peers" } message */
+typedef struct {
+    wish_peer_entry_t* e;
+    bool online;
+} wish_peer_change_t;
+
+static struct wish_peer_state* peer_state_get(wish_core_t* core) {
+    if (core->peer_state == NULL) {
+        core->peer_state = wish_platform_malloc(sizeof (struct wish_peer_state));
+        if (core->peer_state != NULL) {
+            memset(core->peer_state, 0, sizeof (struct wish_peer_state));
+        }
+    }
+    return core->peer_state;
+}
+
+static void peer_append(bson* bs, const char* name, wish_peer_entry_t* e, bool online) {
+    bson_append_start_object(bs, name);
+    bson_append_binary(bs, "luid", e->key.luid, WISH_ID_LEN);
+    bson_append_binary(bs, "ruid", e->key.ruid, WISH_ID_LEN);
+    bson_append_binary(bs, "rhid", e->key.rhid, WISH_WHID_LEN);
+    bson_append_binary(bs, "rsid", e->key.rsid, WISH_WSID_LEN);
+    bson_append_string(bs, "protocol", e->key.protocol);
+    if (e->local) {
+        bson_append_string(bs, "type", "N");
+    }
+    bson_append_bool(bs, "online", online);
+    bson_append_finish_object(bs);
+}
+
+static void peer_send(wish_core_t* core, wish_peer_entry_t* e, bool online) {
+    uint8_t buffer[PEER_STATE_PEER_LEN];
+    
+    bson bs;
+    bson_init_buffer(&bs, buffer, sizeof (buffer));
+    bson_append_string(&bs, "type", "peer");
+    peer_append(&bs, "peer", e, online);
+    bson_finish(&bs);
+    
+    if (bs.err) {
+        WISHDEBUG(LOG_CRITICAL, "BSON error when creating peer message: %i %s", bs.err, bs.errstr);
+        return;
+    }
+    
+    send_core_to_app(core, e->key.wsid, bson_data(&bs), bson_size(&bs));
+}
+
+static void peers_send(wish_core_t* core, const uint8_t* wsid, wish_peer_change_t* list, int n) {
+    bson bs;
+    bson_init_arena(&bs, &core->arena, 64 + n * PEER_STATE_PEER_LEN);
+    bson_append_string(&bs, "type", "peers");
+    bson_append_start_array(&bs, "peers");
+    
+    for (int i = 0; i < n; i++) {
+        char index[21];
+        BSON_NUMSTR(index, i);
+        peer_append(&bs, index, list[i].e, list[i].online);
+    }
+    
+    bson_append_finish_array(&bs);
+    bson_finish(&bs);
+    
+    if (bs.err) {
+        WISHDEBUG(LOG_CRITICAL, "BSON error when creating peers message: %i %s", bs.err, bs.errstr);
+    } else {
+        send_core_to_app(core, wsid, bson_data(&bs), bson_size(&bs));
+    }
+    
+    bson_destroy(&bs);
+}
+
+/* Entries which are offline, and the service knows it, are not needed */
+static void peer_settle(struct wish_peer_state* s, wish_peer_entry_t* e) {
+    if (!e->dirty && !e->online && !e->announced) {
+        HASH_DEL(s->peers, e);
+        wish_platform_free(e);
+    }
+}
+
+/* Queue the change for a batched service, sending the batch when full */
+static void peer_batch_add(wish_core_t* core, const uint8_t* wsid, wish_peer_change_t* batch, int* n, wish_peer_entry_t* e, bool online) {
+    batch[*n].e = e;
+    batch[*n].online = online;
+    (*n)++;
+    
+    if (*n == WISH_PEER_STATE_BATCH_MAX) {
+        peers_send(core, wsid, batch, *n);
+        *n = 0;
+    }
+}
+
+void wish_peer_state_flush(wish_core_t* core) {
+    struct wish_peer_state* s = core->peer_state;
+    
+    if (s == NULL) { return; }
+    
+    /* One service at a time, so that its changes go in one message */
+    while (s->dirty != NULL) {
+        uint8_t wsid[WISH_WSID_LEN];
+        memcpy(wsid, s->dirty->key.wsid, WISH_WSID_LEN);
+        
+        wish_app_entry_t* app = wish_service_get_entry(core, wsid);
+        /* A peer can be in a batch twice, offline and online again */
+        wish_peer_change_t batch[WISH_PEER_STATE_BATCH_MAX];
+        wish_peer_entry_t* done = NULL;
+        int n = 0;
+        
+        wish_peer_entry_t* e;
+        wish_peer_entry_t* tmp;
+        
+        DL_FOREACH_SAFE(s->dirty, e, tmp) {
+            if (memcmp(e->key.wsid, wsid, WISH_WSID_LEN) != 0) { continue; }
+            
+            DL_DELETE(s->dirty, e);
+            DL_APPEND(done, e);
+            
+            if (app == NULL) {
+                /* The service is gone */
+                e->online = false;
+                e->announced = false;
+                e->reset = false;
+                continue;
+            }
+            
+            if (e->reset && e->announced && e->online) {
+                /* Went offline and came back since the service was
+                 * told, report both */
+                if (app->peer_batch) {
+                    peer_batch_add(core, wsid, batch, &n, e, false);
+                } else {
+                    peer_send(core, e, false);
+                }
+                e->announced = false;
+            }
+            e->reset = false;
+            
+            if (e->online != e->announced) {
+                e->announced = e->online;
+                
+                if (app->peer_batch) {
+                    peer_batch_add(core, wsid, batch, &n, e, e->online);
+                } else {
+                    peer_send(core, e, e->online);
+                }
+            }
+        }
+        
+        if (n > 0) {
+            peers_send(core, wsid, batch, n);
+        }
+        
+        /* The batches have been sent, the entries can go */
+        DL_FOREACH_SAFE(done, e, tmp) {
+            DL_DELETE(done, e);
+            e->dirty = false;
+            peer_settle(s, e);
+        }
+    }
+}
+
+void wish_peer_state_set(wish_core_t* core, const uint8_t* wsid, const wish_peer_t* peer, bool online) {
+    struct wish_peer_state* s = peer_state_get(core);
+    
+    if (s == NULL) { return; }
+    
+    wish_peer_entry_t key;
+    memset(&key, 0, sizeof (key));
+    memcpy(key.key.wsid, wsid, WISH_WSID_LEN);
+    memcpy(key.key.luid, peer->luid, WISH_ID_LEN);
+    memcpy(key.key.ruid, peer->ruid, WISH_ID_LEN);
+    memcpy(key.key.rhid, peer->rhid, WISH_WHID_LEN);
+    memcpy(key.key.rsid, peer->rsid, WISH_WSID_LEN);
+    strncpy(key.key.protocol, peer->protocol, WISH_PROTOCOL_NAME_MAX_LEN);
+    
+    wish_peer_entry_t* e = NULL;
+    HASH_FIND(hh, s->peers, &key.key, sizeof (key.key), e);
+    
+    if (e == NULL) {
+        if (!online) {
+            /* The service has not been told about the peer */
+            return;
+        }
+        
+        e = wish_platform_malloc(sizeof (wish_peer_entry_t));
+        if (e == NULL) {
+            WISHDEBUG(LOG_CRITICAL, "Out of memory when adding peer state");
+            return;
+        }
+        
+        memcpy(e, &key, sizeof (wish_peer_entry_t));
+        HASH_ADD(hh, s->peers, key, sizeof (e->key), e);
+    }
+    
+    e->local = peer->local;
+    if (!online && e->announced) {
+        e->reset = true;
+    }
+    e->online = online;
+    
+    if (!e->dirty) {
+        e->dirty = true;
+        DL_APPEND(s->dirty, e);
+    }
+}
+
+void wish_peer_state_remove_service(wish_core_t* core, const uint8_t* wsid) {
+    struct wish_peer_state* s = core->peer_state;
+    wish_peer_entry_t* e;
+    wish_peer_entry_t* tmp;
+    
+    if (s == NULL) { return; }
+    
+    HASH_ITER(hh, s->peers, e, tmp) {
+        if (memcmp(e->key.wsid, wsid, WISH_WSID_LEN) != 0) { continue; }
+        
+        if (e->dirty) {
+            DL_DELETE(s->dirty, e);
+        }
+        
+        HASH_DEL(s->peers, e);
+        wish_platform_free(e);
+    }
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Peer online/offline reporting to the local services.
+ *
+ * The core records the state each service should see for each peer,
+ * and on wish_peer_state_flush reports the peers whose state differs
+ * from what the service was last told. A peer is reported online only
+ * once however many times it is set online, and a peer that goes online
+ * and offline between two flushes is not reported at all. A peer that
+ * goes offline and comes back is reported offline and online, so that
+ * the service sees the session was reset.
+ *
+ * A service which has logged in with { peerBatch: true } gets the
+ * changes as { type: "peers", peers: [peer, ...] }, the others one
+ * { type: "peer", peer } message for each peer. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "wish_core.h"
+
+/* The most peers in one { type: "peers" } message */
+#define WISH_PEER_STATE_BATCH_MAX 16
+
+typedef struct {
+    const uint8_t* luid;
+    const uint8_t* ruid;
+    const uint8_t* rhid;
+    const uint8_t* rsid;
+    const char* protocol;
+    /* Peers which are services on this core are of type "N" */
+    bool local;
+} wish_peer_t;
+
+/**
+ * Set the state of peer as seen by the service wsid. The service is
+ * told on the next flush, if the state differs from what it was told
+ * last.
+ */
+void wish_peer_state_set(wish_core_t* core, const uint8_t* wsid, const wish_peer_t* peer, bool online);
+
+/**
+ * Report the changed peers to the services. The porting layer calls this
+ * at the end of each round of its event loop, and it must be called
+ * before forwarding a frame to a service, so that the service knows the
+ * sender is online.
+ */
+void wish_peer_state_flush(wish_core_t* core);
+
+/**
+ * Forget the peers of the service wsid, to be called when the service
+ * is removed.
+ */
+void wish_peer_state_remove_service(wish_core_t* core, const uint8_t* wsid);
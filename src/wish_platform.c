@@ -27,6 +27,7 @@ void (*my_free)(void *ptr);
 int (*my_vsprintf)(char* str, const char* format, va_list args);
 int (*my_vprintf)(const char* format, va_list args);
 long (*my_random)(void);
+uint32_t (*my_time_ms)(void);
 
 
 int wish_platform_fill_random(void* dummy, unsigned char* buffer, size_t len) {
@@ -45,6 +46,17 @@ void wish_platform_set_rng(long (*fn)(void)) {
     my_random = fn;
 }
 
+void wish_platform_set_time_ms(uint32_t (*fn)(void)) {
+    my_time_ms = fn;
+}
+
+uint32_t wish_platform_time_ms(void) {
+    if (my_time_ms == NULL) {
+        return 0;
+    }
+    return my_time_ms();
+}
+
 
 void wish_platform_set_malloc(void* (*fn)(size_t size)) {
     my_malloc = fn;
@@ -17,6 +17,7 @@
 /* Porting layer functions */
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 
 
@@ -42,6 +43,14 @@ long wish_platform_rng(void);
 
 void wish_platform_set_rng(long (*fn)(void));
 
+/* Set the platform-dependent monotonic millisecond clock, used for
+ * measuring round-trip times. Wrapping around is allowed. */
+void wish_platform_set_time_ms(uint32_t (*fn)(void));
+
+/* Milliseconds from the clock set with wish_platform_set_time_ms, or 0
+ * if the platform has none */
+uint32_t wish_platform_time_ms(void);
+
 /* Set the platform-dependent sprintf function.
  * Note: You should provide the version which takes a va_list as
  * arguemnt.
@@ -37,6 +37,7 @@ void relay_ctrl_connected_cb(wish_core_t* core, wish_relay_client_t *relay) {
 void relay_ctrl_connect_fail_cb(wish_core_t* core, wish_relay_client_t *relay) {
     WISHDEBUG(LOG_CRITICAL, "Relay control connection fails\n");
     relay->curr_state = WISH_RELAY_CLIENT_WAIT_RECONNECT;
+    relay->failures++;
     
     // Used for reconnect timeout
     relay->last_input_timestamp = wish_time_get_relative(core);
@@ -45,11 +46,29 @@ void relay_ctrl_connect_fail_cb(wish_core_t* core, wish_relay_client_t *relay) {
 void relay_ctrl_disconnect_cb(wish_core_t* core, wish_relay_client_t *relay) {
     //WISHDEBUG(LOG_CRITICAL, "Relay control connection disconnected");
     relay->curr_state = WISH_RELAY_CLIENT_WAIT_RECONNECT;
+    
+    /* Sessions closed because the identity was removed are not the
+     * fault of the server */
+    if (wish_core_is_local_uid(core, relay->uid)) {
+        relay->failures++;
+    }
 
     // Used for reconnect timeout
     relay->last_input_timestamp = wish_time_get_relative(core);
 }
 
+/* Seconds to wait before reconnecting, doubles with each consecutive
+ * failure so that servers which are down are retried less often */
+static wish_time_t relay_client_reconnect_timeout(wish_relay_client_t* relay) {
+    wish_time_t timeout = RELAY_CLIENT_RECONNECT_TIMEOUT;
+    
+    for (int i = 1; i < relay->failures && timeout < RELAY_CLIENT_RECONNECT_MAX; i++) {
+        timeout *= 2;
+    }
+    
+    return timeout < RELAY_CLIENT_RECONNECT_MAX ? timeout : RELAY_CLIENT_RECONNECT_MAX;
+}
+
 static void wish_core_relay_periodic(wish_core_t* core, void* ctx) {
     wish_relay_client_t* relay;
 
@@ -61,14 +80,12 @@ static void wish_core_relay_periodic(wish_core_t* core, void* ctx) {
                 }
                 break;
             case WISH_RELAY_CLIENT_INITIAL:
-                if (core->loaded_num_ids > 0) {
-                    // Assume first identity in db is the one we want
-                    // FIXME This does not work with multiple identities!
-                    wish_relay_client_open(core, relay, core->uid_list[0].uid);
+                if (wish_core_is_local_uid(core, relay->uid)) {
+                    wish_relay_client_open(core, relay, relay->uid);
                 }
                 break;
             case WISH_RELAY_CLIENT_WAIT_RECONNECT:
-                if ( wish_time_get_relative(core) > relay->last_input_timestamp + RELAY_CLIENT_RECONNECT_TIMEOUT) {
+                if ( wish_time_get_relative(core) > relay->last_input_timestamp + relay_client_reconnect_timeout(relay)) {
                     relay->curr_state = WISH_RELAY_CLIENT_INITIAL;
                 }
                 break;
@@ -114,7 +131,7 @@ void wish_relay_client_add(wish_core_t* core, const char* host) {
     
     bool found = false;
     LL_FOREACH(core->relay_db, elt) {
-        if ( memcmp(&elt->ip.addr, &relay->ip.addr, 4) == 0 && elt->port == relay->port ) {
+        if ( wish_transport_addr_equal(&elt->ip, elt->port, &relay->ip, relay->port) ) {
             // already in list, bailing
             found = true;
             break;
@@ -123,11 +140,85 @@ void wish_relay_client_add(wish_core_t* core, const char* host) {
     
     if (!found) {
         LL_APPEND(core->relay_db, relay);
+        wish_relay_client_update_identities(core);
     } else {
         wish_platform_free(relay);
     }
 }
 
+static bool relay_client_is_open(wish_relay_client_t* relay) {
+    return relay->curr_state != WISH_RELAY_CLIENT_INITIAL 
+            && relay->curr_state != WISH_RELAY_CLIENT_WAIT_RECONNECT;
+}
+
+void wish_relay_client_update_identities(wish_core_t* core) {
+    wish_relay_client_t* relay;
+    wish_relay_client_t* tmp;
+    
+    /* Close the sessions of identities which are gone. Primary sessions
+     * are kept for the server, and get a new identity below. */
+    LL_FOREACH_SAFE(core->relay_db, relay, tmp) {
+        bool local = wish_core_is_local_uid(core, relay->uid);
+        
+        if (relay->secondary && local) {
+            continue;
+        }
+        
+        if (!local && relay_client_is_open(relay)) {
+            wish_relay_client_close(core, relay);
+        }
+        
+        if (relay->secondary) {
+            LL_DELETE(core->relay_db, relay);
+            wish_platform_free(relay);
+        } else if (!local) {
+            memset(relay->uid, 0, WISH_ID_LEN);
+            relay->curr_state = WISH_RELAY_CLIENT_INITIAL;
+        }
+    }
+    
+    if (core->num_local_ids == 0) {
+        return;
+    }
+    
+    /* The primary session of each server, uses the first identity
+     * unless it already has one */
+    LL_FOREACH(core->relay_db, relay) {
+        if (!relay->secondary && !wish_core_is_local_uid(core, relay->uid)) {
+            memcpy(relay->uid, core->local_uid_list[0].uid, WISH_ID_LEN);
+        }
+    }
+    
+    LL_FOREACH_SAFE(core->relay_db, relay, tmp) {
+        if (relay->secondary) { continue; }
+        
+        for (int i = 0; i < core->num_local_ids; i++) {
+            const uint8_t* uid = core->local_uid_list[i].uid;
+            wish_relay_client_t* elt;
+            bool found = false;
+            
+            LL_FOREACH(core->relay_db, elt) {
+                if (wish_transport_addr_equal(&elt->ip, elt->port, &relay->ip, relay->port)
+                        && memcmp(elt->uid, uid, WISH_ID_LEN) == 0) {
+                    found = true;
+                    break;
+                }
+            }
+            
+            if (found) { continue; }
+            
+            wish_relay_client_t* session = wish_platform_malloc(sizeof(wish_relay_client_t));
+            if (session == NULL) { return; }
+            memset(session, 0, sizeof(wish_relay_client_t));
+            memcpy(&session->ip, &relay->ip, sizeof(wish_ip_addr_t));
+            session->port = relay->port;
+            memcpy(session->uid, uid, WISH_ID_LEN);
+            session->secondary = true;
+            LL_APPEND(core->relay_db, session);
+        }
+    }
+}
+
 /* This function should be invoked regularly to process data received
  * from relay server and take actions accordingly */
 void wish_relay_client_periodic(wish_core_t* core, wish_relay_client_t *relay) {
@@ -163,11 +254,15 @@ again:
                 RELAY_SESSION_ID_LEN);
             /* Advance state */
             relay->curr_state = WISH_RELAY_CLIENT_WAIT;
+            relay->failures = 0;
+            relay->late_keepalives = 0;
+            relay->last_keepalive_timestamp = wish_time_get_relative(core);
             
             //WISHDEBUG(LOG_CRITICAL, "Relay provided by: %i.%i.%i.%i:%d", relay->ip.addr[0], relay->ip.addr[1], relay->ip.addr[2], relay->ip.addr[3], relay->port);
             
             /* This a convenient place to make a first connection check, because we know at this point that we have a working Internet connection */
             wish_connections_check(core); 
+            goto again;
         }
         break;
     case WISH_RELAY_CLIENT_WAIT:
@@ -179,10 +274,16 @@ again:
             uint8_t byte = 0;
             ring_buffer_read(&(relay->rx_ringbuf), &byte, 1);
             switch (byte) {
-            case '.':
-                /* Keepalive received - just ignore it */
+            case '.': {
+                /* Keepalive received, only its timing is of interest */
                 WISHDEBUG(LOG_DEBUG, "Relay: received keep-alive");
+                wish_time_t now = wish_time_get_relative(core);
+                if (now > relay->last_keepalive_timestamp + 2 * RELAY_KEEPALIVE_INTERVAL && relay->late_keepalives < UINT16_MAX) {
+                    relay->late_keepalives++;
+                }
+                relay->last_keepalive_timestamp = now;
                 break;
+            }
             case ':': {
                 /* We have a connection attempt to the relayed uid -
                  * Start accepting it! */
@@ -219,6 +320,8 @@ again:
                 WISHDEBUG(LOG_CRITICAL, "Relay error: Unexepected data");
                 break;
             }
+            /* Handle everything received in one go */
+            goto again;
         }
 
         break;
@@ -235,6 +338,74 @@ again:
 
 }
 
+void wish_relay_client_rtt_sample(wish_core_t* core, wish_relay_client_t *relay, uint32_t rtt_ms) {
+    if (rtt_ms == 0) {
+        rtt_ms = 1;
+    }
+    
+    if (rtt_ms > RELAY_SERVER_TIMEOUT * 1000) {
+        rtt_ms = RELAY_SERVER_TIMEOUT * 1000;
+    }
+    
+    /* Smoothed like the TCP srtt, gain 1/8 */
+    if (relay->rtt_ms == 0) {
+        relay->rtt_ms = rtt_ms;
+    } else {
+        relay->rtt_ms = (7 * relay->rtt_ms + rtt_ms) / 8;
+    }
+}
+
+/* Lower is better */
+static uint32_t relay_client_score(wish_relay_client_t* relay) {
+    if (relay->curr_state != WISH_RELAY_CLIENT_WAIT) {
+        return 0x80000000u + relay->failures;
+    }
+    
+    uint32_t rtt = relay->rtt_ms != 0 ? relay->rtt_ms : RELAY_RTT_UNKNOWN_MS;
+    
+    return rtt + (uint32_t) relay->late_keepalives * RELAY_LATE_KEEPALIVE_PENALTY_MS;
+}
+
+int wish_relay_client_ranked(wish_core_t* core, const uint8_t* uid, wish_relay_client_t** list, int max) {
+    uint32_t score[max > 0 ? max : 1];
+    wish_relay_client_t* relay;
+    int n = 0;
+    
+    LL_FOREACH(core->relay_db, relay) {
+        if (relay->secondary) { continue; }
+        if (n >= max) { break; }
+        
+        wish_relay_client_t* session = relay;
+        
+        if (uid != NULL) {
+            wish_relay_client_t* elt;
+            
+            LL_FOREACH(core->relay_db, elt) {
+                if (wish_transport_addr_equal(&elt->ip, elt->port, &relay->ip, relay->port)
+                        && memcmp(elt->uid, uid, WISH_ID_LEN) == 0) {
+                    session = elt;
+                    break;
+                }
+            }
+        }
+        
+        /* Insertion sort, servers of equal score keep the configured order */
+        uint32_t s = relay_client_score(session);
+        int i = n++;
+        
+        while (i > 0 && score[i - 1] > s) {
+            score[i] = score[i - 1];
+            list[i] = list[i - 1];
+            i--;
+        }
+        
+        score[i] = s;
+        list[i] = relay;
+    }
+    
+    return n;
+}
+
 void wish_relay_client_feed(wish_core_t* core, wish_relay_client_t *relay, uint8_t *data, size_t data_len) {
     ring_buffer_write(&(relay->rx_ringbuf), data, data_len);
     relay->last_input_timestamp = wish_time_get_relative(core);
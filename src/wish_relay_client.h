@@ -31,10 +31,23 @@
 
 #define RELAY_CLIENT_RECONNECT_TIMEOUT 10 /* Seconds */
 
+/* Upper limit of the reconnect wait, which doubles with every
+ * consecutive failure of a relay server */
+#define RELAY_CLIENT_RECONNECT_MAX 320 /* Seconds */
+
 #define RELAY_CLIENT_CONNECT_TIMEOUT 30 /* Seconds */
 
 #define RELAY_SESSION_ID_LEN 10
 
+/* The relay server sends a keep-alive this often. A keep-alive which
+ * arrives more than twice this late counts against the server. */
+#define RELAY_KEEPALIVE_INTERVAL 10 /* Seconds */
+
+/* Round-trip time assumed for a relay server which has not been
+ * measured, and the penalty of one late keep-alive, in milliseconds */
+#define RELAY_RTT_UNKNOWN_MS 1000
+#define RELAY_LATE_KEEPALIVE_PENALTY_MS 250
+
 enum wish_relay_client_state {
     WISH_RELAY_CLIENT_INITIAL,  /* The initial state */
     WISH_RELAY_CLIENT_CONNECTING,  /* The relay client connection has been started, but has not yet connected */
@@ -71,9 +84,21 @@ typedef struct wish_relay_client_ctx {
      * server system. User for detecting dead relay server control
      * connection */
     wish_time_t last_input_timestamp;
-    /* TODO: Add here some kind of reference to the actual port-specific connection
-     * object (such as file descriptor or struct espconn) so that we
-     * could some day handle several relay control connections */
+    /* Time of the latest keep-alive, and the number of late keep-alives
+     * since the control connection was opened */
+    wish_time_t last_keepalive_timestamp;
+    uint16_t late_keepalives;
+    /* Consecutive failures to get or keep a control connection */
+    uint16_t failures;
+    /* Smoothed round-trip time to the server in milliseconds, 0 when not
+     * measured */
+    uint32_t rtt_ms;
+    /* For the port: millisecond timestamp of starting the connect */
+    uint32_t connect_started_ms;
+    /* True for the sessions of our other identities to a relay server
+     * which is listed earlier in relay_db. Lists of the relay servers
+     * skip these. */
+    bool secondary;
     struct wish_relay_client_ctx* next;
 } wish_relay_client_t;
 
@@ -86,6 +111,29 @@ void wish_core_relay_client_init(wish_core_t* core);
 
 void wish_relay_client_add(wish_core_t* core, const char* host);
 
+/**
+ * Keep one relay session to each relay server per local identity. To be
+ * called when the identities change.
+ */
+void wish_relay_client_update_identities(wish_core_t* core);
+
+/**
+ * Feed a round-trip time sample to the relay server, measured by the
+ * port, for example as the time taken by the TCP connect.
+ */
+void wish_relay_client_rtt_sample(wish_core_t* core, wish_relay_client_t *relay, uint32_t rtt_ms);
+
+/**
+ * List the relay servers in the order of preference: servers with an
+ * open control connection first, by round-trip time and keep-alive
+ * health, then the others by their count of failures. Each server is
+ * judged by the session of uid, or by its primary session if uid is
+ * NULL or has no session. The primary sessions are stored in list.
+ *
+ * @return the number of relay servers stored in list
+ */
+int wish_relay_client_ranked(wish_core_t* core, const uint8_t* uid, wish_relay_client_t** list, int max);
+
 /* To be implemented in port-specific code */
 void wish_relay_client_open(wish_core_t* core, wish_relay_client_t *rctx,
     uint8_t relay_uid[32]);
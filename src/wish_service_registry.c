@@ -22,6 +22,8 @@
 #include "wish_debug.h"
 #include "wish_core_rpc.h"
 #include "wish_core_app_rpc.h"
+#include "wish_api_services.h"
+#include "wish_peer_state.h"
 
 wish_app_entry_t* wish_service_get_registry(wish_core_t* core) {
     return core->service_registry;
@@ -106,6 +108,10 @@ void wish_service_register_remove(wish_core_t* core, const uint8_t* wsid) {
                 wish_send_peer_update_locals(core, core->service_registry[i].wsid, service_entry_offline, false);
             }
         }
+        /* Close the sending channels the service had open */
+        wish_api_services_channels_cleanup(core, service_entry_offline->wsid);
+        /* Forget what the service has been told about peers */
+        wish_peer_state_remove_service(core, service_entry_offline->wsid);
         /* Delete the entry from service registry */
         memset(service_entry_offline, 0, sizeof (wish_app_entry_t));
         /* Clean up RPC requests which might have been left behind by the app */
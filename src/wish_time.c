@@ -21,6 +21,7 @@
 #include "wish_debug.h"
 #include "wish_connection_mgr.h"
 #include "wish_relay_client.h"
+#include "wish_peer_state.h"
 
 #include "utlist.h"
 
@@ -52,6 +53,9 @@ void wish_time_report_periodic(wish_core_t* core) {
             }
         }
     }
+    
+    /* For ports which do not flush the peer state every round */
+    wish_peer_state_flush(core);
 }
 
 wish_timer_db_t* wish_core_time_set_interval(wish_core_t* core, timer_cb cb, void* cb_ctx, int interval ) {
@@ -55,6 +55,105 @@ int wish_parse_transport_port(const char *url, size_t url_len, uint16_t *port) {
 }
 
 
+/* Parse the text form of an IPv6 address, such as fe80::1, into
+ * network byte order. Embedded IPv4 notation is not supported.
+ * @return 0 on success */
+static int parse_ipv6(const char *str, int len, uint8_t *out) {
+    uint16_t groups[8];
+    int n = 0;
+    int gap = -1; /* The group index where "::" was */
+    int i = 0;
+    
+    if (len >= 2 && str[0] == ':' && str[1] == ':') {
+        gap = 0;
+        i = 2;
+    }
+    
+    while (i < len) {
+        int digits = 0;
+        uint16_t group = 0;
+        
+        while (i < len && digits < 5) {
+            char c = str[i];
+            int v;
+            
+            if (c >= '0' && c <= '9') { v = c - '0'; }
+            else if (c >= 'a' && c <= 'f') { v = c - 'a' + 10; }
+            else if (c >= 'A' && c <= 'F') { v = c - 'A' + 10; }
+            else { break; }
+            
+            group = (group << 4) | v;
+            digits++;
+            i++;
+        }
+        
+        if (digits == 0 || digits > 4 || n == 8) { return 1; }
+        groups[n++] = group;
+        
+        if (i == len) { break; }
+        if (str[i] != ':') { return 1; }
+        i++;
+        
+        if (i < len && str[i] == ':') {
+            if (gap >= 0) { return 1; }
+            gap = n;
+            i++;
+        } else if (i == len) {
+            /* Trailing single colon */
+            return 1;
+        }
+    }
+    
+    if (gap < 0 && n != 8) { return 1; }
+    if (gap >= 0 && n > 7) { return 1; }
+    
+    int zeros = 8 - n;
+    int g = 0;
+    for (i = 0; i < 8; i++) {
+        uint16_t v = 0;
+        
+        if (gap >= 0 && i >= gap && i < gap + zeros) {
+            v = 0;
+        } else {
+            v = groups[g++];
+        }
+        out[2 * i] = v >> 8;
+        out[2 * i + 1] = v & 0xff;
+    }
+    return 0;
+}
+
+/* Parse "[addr]" or "[addr%scope]" where the scope is a numeric
+ * interface index */
+static int parse_transport_ipv6(const char *start, wish_ip_addr_t *ip) {
+    const char *end = strchr(start, ']');
+    
+    if (end == NULL) {
+        WISHDEBUG(LOG_CRITICAL, "IPv6 addr parse error");
+        return 1;
+    }
+    
+    const char *percent = memchr(start, '%', end - start);
+    const char *addr_end = percent ? percent : end;
+    
+    if (ip == NULL) {
+        return 1;
+    }
+    
+    memset(ip, 0, sizeof (wish_ip_addr_t));
+    
+    if (parse_ipv6(start + 1, addr_end - start - 1, ip->addr)) {
+        WISHDEBUG(LOG_CRITICAL, "IPv6 addr parse error");
+        return 1;
+    }
+    
+    ip->domain = WISH_ADDR_IPV6;
+    if (percent) {
+        ip->scope_id = atoi(percent + 1);
+    }
+    return 0;
+}
+
 int wish_parse_transport_ip(const char *url, size_t url_len, wish_ip_addr_t *ip) {
     int retval = 1;
     const int ip_str_max_len = 4*3+3; /* t.ex. 255.255.255.255 */
@@ -67,6 +166,11 @@ int wish_parse_transport_ip(const char *url, size_t url_len, wish_ip_addr_t *ip)
     } else {
         start_of_ip_str = first_slash+2;
     }
+    
+    if (start_of_ip_str[0] == '[') {
+        return parse_transport_ipv6(start_of_ip_str, ip);
+    }
+    
     char* colon = strchr(start_of_ip_str, ':');
     if (colon == NULL) {
         WISHDEBUG(LOG_CRITICAL, "IP addr parse error");
@@ -90,6 +194,9 @@ int wish_parse_transport_ip(const char *url, size_t url_len, wish_ip_addr_t *ip)
     /* We now have a valid looking IP address in start_of_ip_str, of
      * length actual_ip_str_len */
 
+    memset(ip, 0, sizeof (wish_ip_addr_t));
+    ip->domain = WISH_ADDR_IPV4;
+
     /* Parse out the bytes */
     const int num_bytes = 4; /* There are always 4 dots */
     const char *curr_byte_str = start_of_ip_str;
@@ -109,5 +216,12 @@ int wish_parse_transport_ip(const char *url, size_t url_len, wish_ip_addr_t *ip)
     return retval;
 }
 
-
-
+bool wish_transport_addr_equal(const wish_ip_addr_t *a, uint16_t a_port, const wish_ip_addr_t *b, uint16_t b_port) {
+    if (a->domain != b->domain || a_port != b_port) {
+        return false;
+    }
+    if (a->domain == WISH_ADDR_IPV6) {
+        return memcmp(a->addr, b->addr, WISH_IPV6_ADDRLEN) == 0 && a->scope_id == b->scope_id;
+    }
+    return memcmp(a->addr, b->addr, WISH_IPV4_ADDRLEN) == 0;
+}
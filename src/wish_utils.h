@@ -16,6 +16,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include "wish_ip_addr.h"
 
 int wish_parse_transport_ip_port(const char *url, size_t url_len, wish_ip_addr_t *ip, uint16_t *port);
@@ -30,10 +31,16 @@ int wish_parse_transport_ip_port(const char *url, size_t url_len, wish_ip_addr_t
 int wish_parse_transport_port(const char *url, size_t url_len, uint16_t *port);
 
 /**
- * Parse a IP address from a "wish URL"
+ * Parse a IP address from a "wish URL". IPv6 addresses are written in
+ * brackets, optionally with a numeric scope: wish://[fe80::1%2]:37009
  * @return 0 if the parsing was successful and yeilded results. Any
  * other return value signifies failure.
  */
 int wish_parse_transport_ip(const char *url, size_t url_len, wish_ip_addr_t *ip);
 
-
+/**
+ * Compare two transport addresses: the address domain, the address bytes
+ * used by that domain, the scope of IPv6 addresses and the port.
+ * @return true if the addresses are the same
+ */
+bool wish_transport_addr_equal(const wish_ip_addr_t *a, uint16_t a_port, const wish_ip_addr_t *b, uint16_t b_port);
@@ -0,0 +1,266 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#include <string.h>
+
+#include "wish_wire.h"
+
+typedef struct {
+    uint8_t type;
+    /* Key including the terminating NUL */
+    const char* key;
+    uint8_t key_size;
+} wish_wire_key_t;
+
+#define WISH_WIRE_KEY_DEF(name, t, str) \
+    static const wish_wire_key_t wire_##name = { .type = t, .key = str, .key_size = sizeof(str) };
+
+WISH_WIRE_KEYS(WISH_WIRE_KEY_DEF)
+
+#undef WISH_WIRE_KEY_DEF
+
+const uint8_t wish_wire_ping[WISH_WIRE_PING_LEN] = { WISH_WIRE_PING_LEN, 0, 0, 0, BSON_BOOL, 'p', 'i', 'n', 'g', 0, 1, 0 };
+
+const uint8_t wish_wire_pong[WISH_WIRE_PING_LEN] = { WISH_WIRE_PING_LEN, 0, 0, 0, BSON_BOOL, 'p', 'o', 'n', 'g', 0, 1, 0 };
+
+static void put_le32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static int32_t get_le32(const uint8_t* p) {
+    return (int32_t) ((uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24));
+}
+
+/* Encoding. The header buffer is always large enough for the shapes
+ * below, only the protocol name length needs checking. */
+
+static uint8_t* put_key(uint8_t* p, const wish_wire_key_t* k) {
+    *p++ = k->type;
+    memcpy(p, k->key, k->key_size);
+    return p + k->key_size;
+}
+
+static uint8_t* put_bin(uint8_t* p, const wish_wire_key_t* k, const uint8_t* data, int len) {
+    p = put_key(p, k);
+    put_le32(p, len);
+    p[4] = BSON_BIN_BINARY;
+    memcpy(p + 5, data, len);
+    return p + 5 + len;
+}
+
+static uint8_t* put_string(uint8_t* p, const wish_wire_key_t* k, const char* str, int len) {
+    p = put_key(p, k);
+    put_le32(p, len + 1);
+    memcpy(p + 4, str, len);
+    p[4 + len] = 0;
+    return p + 4 + len + 1;
+}
+
+/* Start a document (or an embedded one, when k is given), its length is
+ * filled in by wish_wire_finish */
+static uint8_t* put_open(wish_wire_header_t* h, uint8_t* p, const wish_wire_key_t* k) {
+    if (k != NULL) {
+        p = put_key(p, k);
+    }
+    h->open[h->depth++] = p - h->data;
+    return p + 4;
+}
+
+bool wish_wire_send_header(wish_wire_header_t* h, const uint8_t* lsid, const uint8_t* rsid, const char* protocol) {
+    size_t protocol_len = strnlen(protocol, WISH_PROTOCOL_NAME_MAX_LEN + 1);
+    if (protocol_len > WISH_PROTOCOL_NAME_MAX_LEN) {
+        return false;
+    }
+
+    h->depth = 0;
+    uint8_t* p = h->data;
+    p = put_open(h, p, NULL);
+    p = put_open(h, p, &wire_req);
+    p = put_string(p, &wire_op, "send", 4);
+    p = put_open(h, p, &wire_args);
+    p = put_bin(p, &wire_arg0, lsid, WISH_WSID_LEN);
+    p = put_bin(p, &wire_arg1, rsid, WISH_WSID_LEN);
+    p = put_string(p, &wire_arg2, protocol, protocol_len);
+    p = put_key(p, &wire_arg3);
+    h->len = p - h->data;
+    return true;
+}
+
+bool wish_wire_frame_header(wish_wire_header_t* h, const uint8_t* luid, const uint8_t* ruid, const uint8_t* rhid, const uint8_t* rsid, const char* protocol) {
+    size_t protocol_len = strnlen(protocol, WISH_PROTOCOL_NAME_MAX_LEN + 1);
+    if (protocol_len > WISH_PROTOCOL_NAME_MAX_LEN) {
+        return false;
+    }
+
+    h->depth = 0;
+    uint8_t* p = h->data;
+    p = put_open(h, p, NULL);
+    p = put_string(p, &wire_type, "frame", 5);
+    /* The peer document is closed right away */
+    p = put_key(p, &wire_peer);
+    uint8_t* peer = p;
+    p += 4;
+    p = put_bin(p, &wire_luid, luid, WISH_UID_LEN);
+    p = put_bin(p, &wire_ruid, ruid, WISH_UID_LEN);
+    p = put_bin(p, &wire_rhid, rhid, WISH_WHID_LEN);
+    p = put_bin(p, &wire_rsid, rsid, WISH_WSID_LEN);
+    p = put_string(p, &wire_protocol, protocol, protocol_len);
+    *p++ = 0;
+    put_le32(peer, p - peer);
+    p = put_key(p, &wire_data);
+    h->len = p - h->data;
+    return true;
+}
+
+size_t wish_wire_message_len(const wish_wire_header_t* h, size_t payload_len) {
+    /* Binary length and subtype, payload, a terminator per open document */
+    return h->len + 5 + payload_len + h->depth;
+}
+
+size_t wish_wire_envelope(const wish_wire_header_t* h, wish_wire_envelope_t* env, size_t payload_len) {
+    if (payload_len > INT32_MAX - WISH_WIRE_HEADER_MAX) {
+        return 0;
+    }
+
+    memcpy(env->head, h->data, h->len);
+    put_le32(env->head + h->len, payload_len);
+    env->head[h->len + 4] = BSON_BIN_BINARY;
+    env->head_len = h->len + 5;
+
+    /* Document i ends with terminator depth - 1 - i of the tail */
+    size_t end = env->head_len + payload_len;
+    for (int i = h->depth - 1; i >= 0; i--) {
+        env->tail[h->depth - 1 - i] = 0;
+        end++;
+        put_le32(env->head + h->open[i], end - h->open[i]);
+    }
+    env->tail_len = h->depth;
+    return end;
+}
+
+size_t wish_wire_finish(const wish_wire_header_t* h, uint8_t* buf, size_t buf_len, const uint8_t* payload, size_t payload_len) {
+    wish_wire_envelope_t env;
+    size_t len = wish_wire_message_len(h, payload_len);
+    if (len > buf_len || wish_wire_envelope(h, &env, payload_len) == 0) {
+        return 0;
+    }
+
+    memcpy(buf, env.head, env.head_len);
+    memcpy(buf + env.head_len, payload, payload_len);
+    memcpy(buf + env.head_len + payload_len, env.tail, env.tail_len);
+    return len;
+}
+
+/* Decoding. Each matcher checks that the element fits before end, the
+ * position of the terminator of the enclosing document. */
+
+static bool match_key(const uint8_t** p, const uint8_t* end, const wish_wire_key_t* k) {
+    if (end - *p < 1 + k->key_size || (*p)[0] != k->type || memcmp(*p + 1, k->key, k->key_size) != 0) {
+        return false;
+    }
+    *p += 1 + k->key_size;
+    return true;
+}
+
+static bool match_bin(const uint8_t** p, const uint8_t* end, const wish_wire_key_t* k, int32_t len, const uint8_t** data, int32_t* data_len) {
+    const uint8_t* q = *p;
+    if (!match_key(&q, end, k) || end - q < 5) {
+        return false;
+    }
+    int32_t l = get_le32(q);
+    if (l < 0 || (len >= 0 && l != len) || q[4] != BSON_BIN_BINARY || end - q - 5 < l) {
+        return false;
+    }
+    *data = q + 5;
+    if (data_len != NULL) {
+        *data_len = l;
+    }
+    *p = q + 5 + l;
+    return true;
+}
+
+static bool match_string(const uint8_t** p, const uint8_t* end, const wish_wire_key_t* k, const char** str) {
+    const uint8_t* q = *p;
+    if (!match_key(&q, end, k) || end - q < 4) {
+        return false;
+    }
+    int32_t l = get_le32(q);
+    if (l < 1 || end - q - 4 < l || q[4 + l - 1] != 0 || memchr(q + 4, 0, l - 1) != NULL) {
+        return false;
+    }
+    *str = (const char*) q + 4;
+    *p = q + 4 + l;
+    return true;
+}
+
+/* Match a document which is the only element of msg */
+static bool match_single(const uint8_t* msg, int32_t len, const wish_wire_key_t* k, const uint8_t** body) {
+    const uint8_t* p = msg + 4;
+    const uint8_t* end = msg + len - 1;
+
+    if (!match_key(&p, end, k)) {
+        return false;
+    }
+    if (k->type == BSON_BOOL) {
+        return p + 1 == end;
+    }
+    if (end - p < 5 || get_le32(p) != end - p || *(end - 1) != 0) {
+        return false;
+    }
+    *body = p;
+    return true;
+}
+
+wish_wire_msg_t wish_wire_classify(const uint8_t* msg, const uint8_t** body) {
+    int32_t len = get_le32(msg);
+
+    if (len < 5 || msg[len - 1] != 0) {
+        return WISH_WIRE_OTHER;
+    }
+    if (match_single(msg, len, &wire_req, body)) {
+        return WISH_WIRE_REQ;
+    }
+    if (match_single(msg, len, &wire_res, body)) {
+        return WISH_WIRE_RES;
+    }
+    if (match_single(msg, len, &wire_ping, NULL)) {
+        return WISH_WIRE_PING;
+    }
+    if (match_single(msg, len, &wire_pong, NULL)) {
+        return WISH_WIRE_PONG;
+    }
+    return WISH_WIRE_OTHER;
+}
+
+bool wish_wire_decode_send_args(const uint8_t* args, wish_wire_send_args_t* out) {
+    int32_t len = get_le32(args);
+
+    if (len < 5 || args[len - 1] != 0) {
+        return false;
+    }
+
+    const uint8_t* p = args + 4;
+    const uint8_t* end = args + len - 1;
+
+    if (!match_bin(&p, end, &wire_arg0, WISH_WSID_LEN, &out->rsid, NULL)
+            || !match_bin(&p, end, &wire_arg1, WISH_WSID_LEN, &out->lsid, NULL)
+            || !match_string(&p, end, &wire_arg2, &out->protocol)
+            || !match_bin(&p, end, &wire_arg3, -1, &out->payload, &out->payload_len)) {
+        return false;
+    }
+    return p == end;
+}
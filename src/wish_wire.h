@@ -0,0 +1,139 @@
+/**
+ * Copyright (C) 2018, ControlThings Oy Ab
+ * Copyright (C) 2018, André Kaustell
+ * Copyright (C) 2018, Jan Nyman
+ * Copyright (C) 2018, Jepser Lökfors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * @license Apache-2.0
+ */
+#pragma once
+
+/* Specialized codecs for the fixed shape messages of the core wire
+ * protocol and the core to app frames. The output is byte for byte what
+ * the equivalent bson_append_* chain produces. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "wish_core.h"
+#include "bson.h"
+
+/* Element prefixes of the message shapes below: BSON type and key.
+ * X(name, type, key) */
+#define WISH_WIRE_KEYS(X) \
+    X(req,      BSON_OBJECT,  "req") \
+    X(res,      BSON_OBJECT,  "res") \
+    X(ping,     BSON_BOOL,    "ping") \
+    X(pong,     BSON_BOOL,    "pong") \
+    X(op,       BSON_STRING,  "op") \
+    X(args,     BSON_ARRAY,   "args") \
+    X(arg0,     BSON_BINDATA, "0") \
+    X(arg1,     BSON_BINDATA, "1") \
+    X(arg2,     BSON_STRING,  "2") \
+    X(arg3,     BSON_BINDATA, "3") \
+    X(type,     BSON_STRING,  "type") \
+    X(peer,     BSON_OBJECT,  "peer") \
+    X(luid,     BSON_BINDATA, "luid") \
+    X(ruid,     BSON_BINDATA, "ruid") \
+    X(rhid,     BSON_BINDATA, "rhid") \
+    X(rsid,     BSON_BINDATA, "rsid") \
+    X(protocol, BSON_STRING,  "protocol") \
+    X(data,     BSON_BINDATA, "data")
+
+#define WISH_WIRE_HEADER_MAX (256 + WISH_PROTOCOL_NAME_MAX_LEN)
+
+#define WISH_WIRE_DEPTH_MAX 3
+
+/* { ping: true } and { pong: true } are constant */
+#define WISH_WIRE_PING_LEN 12
+
+extern const uint8_t wish_wire_ping[WISH_WIRE_PING_LEN];
+
+extern const uint8_t wish_wire_pong[WISH_WIRE_PING_LEN];
+
+/* A message encoded up to and including the key of its trailing binary
+ * payload element. open[] holds the offsets of the documents still open,
+ * outermost first. */
+typedef struct {
+    uint8_t data[WISH_WIRE_HEADER_MAX];
+    int len;
+    int depth;
+    int open[WISH_WIRE_DEPTH_MAX];
+} wish_wire_header_t;
+
+/* Header of { req: { op: 'send', args: [ lsid, rsid, protocol, <payload> ] } }
+ * Returns false if the protocol name is too long. */
+bool wish_wire_send_header(wish_wire_header_t* h, const uint8_t* lsid, const uint8_t* rsid, const char* protocol);
+
+/* Header of the frame to an app:
+ * { type: 'frame', peer: { luid, ruid, rhid, rsid, protocol }, data: <payload> }
+ * Returns false if the protocol name is too long. */
+bool wish_wire_frame_header(wish_wire_header_t* h, const uint8_t* luid, const uint8_t* ruid, const uint8_t* rhid, const uint8_t* rsid, const char* protocol);
+
+/* Length of the message completed from header h with payload_len bytes of
+ * payload */
+size_t wish_wire_message_len(const wish_wire_header_t* h, size_t payload_len);
+
+/* Complete a message into buf: copy the header, append the payload and
+ * close the open documents. Returns the message length, or 0 if buf is
+ * too small. */
+size_t wish_wire_finish(const wish_wire_header_t* h, uint8_t* buf, size_t buf_len, const uint8_t* payload, size_t payload_len);
+
+/* The bytes of a message before and after its payload, for sending the
+ * payload from where it is: head is the header with its document
+ * lengths filled in and the prefix of the binary element, tail closes the
+ * open documents. */
+typedef struct {
+    uint8_t head[WISH_WIRE_HEADER_MAX + 5];
+    size_t head_len;
+    uint8_t tail[WISH_WIRE_DEPTH_MAX];
+    size_t tail_len;
+} wish_wire_envelope_t;
+
+/* Build the envelope of the message completed from header h with
+ * payload_len bytes of payload. Returns the message length, or 0 if the
+ * payload is too large. */
+size_t wish_wire_envelope(const wish_wire_header_t* h, wish_wire_envelope_t* env, size_t payload_len);
+
+typedef enum {
+    WISH_WIRE_OTHER,
+    WISH_WIRE_REQ,
+    WISH_WIRE_RES,
+    WISH_WIRE_PING,
+    WISH_WIRE_PONG,
+} wish_wire_msg_t;
+
+/* Classify a message from a remote core by its shape. Messages with one
+ * element, req, res, ping or pong, are recognized; for a req or res the
+ * embedded document is returned in body. Anything else is WISH_WIRE_OTHER
+ * and must be handled by the generic parser. */
+wish_wire_msg_t wish_wire_classify(const uint8_t* msg, const uint8_t** body);
+
+/* Arguments of the core 'send' request, pointing into the args array */
+typedef struct {
+    const uint8_t* rsid;
+    const uint8_t* lsid;
+    const char* protocol;
+    const uint8_t* payload;
+    int32_t payload_len;
+} wish_wire_send_args_t;
+
+/* Decode the args array of a 'send' request laid out as written by
+ * wish_wire_send_header. Returns false for any other layout, in which case
+ * the generic parser must be used. */
+bool wish_wire_decode_send_args(const uint8_t* args, wish_wire_send_args_t* out);
+
+#ifdef __cplusplus
+}
+#endif